@@ -16,6 +16,7 @@ cp -r textures package
 cp -r fonts package
 cp -r sounds package
 cp -r levels package
+cp snapshots.dict package
 
 cp hiscore package
 
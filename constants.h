@@ -4,6 +4,9 @@
 #include "raylib.h"
 
 const int MAX_SFX_PLAYED = 4;
+const int TICK_RATE = 120;
+const float TICK_TIME = 1.0 / TICK_RATE;
+const float MAX_FRAME_TIME = 0.25;
 const int LEVEL_COUNT = 35;
 const float SLIDING_TIME = 0.6;
 const int FONT_SIZE = 28;
@@ -28,6 +31,9 @@ const int SCREEN_HEIGHT = FIELD_ROWS * CELL_SIZE;
 const int SNAP_TO = CELL_SIZE * 2;
 const int TANK_SIZE = CELL_SIZE * 4;
 const int TANK_TEXTURE_SIZE = 16;
+const int ATLAS_WIDTH = 1024;
+const int ATLAS_PADDING = 1;
+const int MAX_ATLAS_SPRITES = 64;
 const int FLAG_SIZE = TANK_SIZE;
 const Vector2 POWER_UP_TEXTURE_SIZE = {30, 28};
 const int POWER_UP_SIZE = CELL_SIZE * 4;
@@ -45,6 +51,11 @@ const short ENEMY_SPEEDS[3] = {140, 170, 240};
 const int MAX_ENEMY_COUNT = 20;
 const int MAX_TANK_COUNT = MAX_ENEMY_COUNT + 2;
 const int MAX_BULLET_COUNT = 100;
+// Tank broadphase buckets, 4x4 cells each. Bucket masks are u64, so
+// MAX_TANK_COUNT must stay <= 64.
+const int TANK_GRID_CELL_SIZE = CELL_SIZE * 4;
+const int TANK_GRID_COLS = FIELD_COLS / 4;
+const int TANK_GRID_ROWS = FIELD_ROWS / 4;
 const int MAX_EXPLOSION_COUNT = MAX_BULLET_COUNT;
 const int MAX_SCORE_POPUP_COUNT = MAX_BULLET_COUNT;
 const Vector2 SCORE_POPUP_TEXTURE_SIZE = (Vector2){16, 9};
@@ -81,10 +92,78 @@ const Vector2 POWERUP_POSITIONS[POWERUP_POSITIONS_COUNT] = {
 #define PORT 5000
 #define BROADCAST_IP "255.255.255.255"
 #define BUFFER_SIZE 256
-#define CLIENT_INPUT_SIZE 6
+// Client packets carry the last snapshot tick the client applied and its
+// input tick as 32-bit integers, the snapshot loss in percent, then the
+// last INPUT_REDUNDANCY input frames, newest first
+#define INPUT_REDUNDANCY 8
+#define INPUT_FRAME_BITS 5
+#define CLIENT_PACKET_SIZE \
+    (9 + (INPUT_REDUNDANCY * INPUT_FRAME_BITS + 7) / 8)
+// Lockstep packets start with a byte no compressed snapshot starts with
+#define LOCKSTEP_MARKER 0x80
+#define LOCKSTEP_PACKET_SIZE \
+    (17 + (INPUT_REDUNDANCY * INPUT_FRAME_BITS + 7) / 8)
+// Flags byte and a 16-bit stream sequence number
+#define COMPRESSION_HEADER_SIZE 3
+#define COMPRESSION_LEVEL 7
+#define SNAPSHOT_DICT_FILE "snapshots.dict"
 
 const int MAX_AVAILABLE_GAMES = 4;
+const int SNAPSHOT_HISTORY_SIZE = 64;
+const int INPUT_HISTORY_SIZE = 64;
+// Client inputs the host may queue before it skips ahead to the newest.
+const int MAX_INPUT_BACKLOG = 4;
+// Capacities of the rings between the game loop and the network thread.
+// Both must be powers of two.
+const int SNAPSHOT_RING_SIZE = 8;
+const int INPUT_RING_SIZE = 64;
+// Entities that move further than this between two snapshots are not
+// interpolated: they were respawned rather than moved.
+const int MAX_INTERPOLATION_DISTANCE = CELL_SIZE * 4;
+// A lost packet stalls a streaming client until the next frame starts.
+const int STREAM_KEYFRAME_INTERVAL = 60;
+// Snapshots per second the host sends, unless --net-rate says otherwise. On
+// loss the rate halves, down to MIN_NET_RATE, and recovers one step at a
+// time once the client stops reporting loss.
+const int NET_TICK_RATE = 60;
+const int MIN_NET_RATE = 10;
+const int LOSS_BACKOFF_PERCENT = 5;
+const int LOSS_WINDOW = 32;
 const float TIMEOUT = 3.0;
 const float TIMEOUT_SCREEN_TIME = 3.0;
+// Spectators share one slower snapshot stream. It restarts from a full
+// snapshot every SPECTATOR_KEYFRAME_INTERVAL snapshots, so a watcher that
+// lost one waits at most that long, and they buffer SPECTATOR_DELAY more
+// ticks than a player. A keepalive every SPECTATOR_KEEPALIVE_TICKS keeps
+// them on the host's list.
+const int MAX_SPECTATORS = 64;
+const int SPECTATOR_NET_RATE = 20;
+const int SPECTATOR_KEYFRAME_INTERVAL = 20;
+const int SPECTATOR_DELAY = TICK_RATE / 10;
+const int SPECTATOR_KEEPALIVE_TICKS = TICK_RATE / 4;
+// Lockstep peers compare state hashes every LOCKSTEP_HASH_INTERVAL ticks.
+// Input runs LOCKSTEP_INPUT_DELAY ticks late unless --input-delay says
+// otherwise. The delay has to cover half the round trip and stay below the
+// hash interval.
+const int LOCKSTEP_HASH_INTERVAL = 60;
+const int LOCKSTEP_INPUT_DELAY = 6;
+// Rollback steps up to ROLLBACK_WINDOW ticks past the last tick it has the
+// peer's input for, and delays its own input by ROLLBACK_INPUT_DELAY.
+const int ROLLBACK_WINDOW = 16;
+const int ROLLBACK_INPUT_DELAY = 1;
+// Ticks --bench-rollback rewinds and replays every tick.
+const int ROLLBACK_BENCH_TICKS = 8;
+// Length of each --bench-lan scenario.
+const int LAN_BENCH_SECONDS = 10;
+// Length of the --check-desync game.
+const int DESYNC_CHECK_SECONDS = 4;
+// Dedicated server limits. The session table maps client addresses to
+// matches, it and the input rings must be powers of two.
+const int MAX_MATCHES = 64;
+const int SESSION_TABLE_SIZE = 256;
+const int SERVER_INPUT_RING_SIZE = 1024;
+const int SERVER_STATS_INTERVAL = 5;
+// Ticks a match keeps sending its final screen before it is freed.
+const int MATCH_END_TICKS = TICK_RATE;
 
 #endif
\ No newline at end of file
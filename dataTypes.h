@@ -1,17 +1,42 @@
 #ifndef DATA_TYPES_H
 #define DATA_TYPES_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <zstd.h>
 
 #include "constants.h"
+#include "netEmulator.h"
 #include "networkHeaders.h"
+#include "packetBatch.h"
 #include "raylib.h"
+#include "spscRing.h"
+#include "utils.h"
 
 typedef struct {
     int row;
     int col;
 } CellInfo;
 
+// A region of the sprite atlas.
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} Sprite;
+
+// Shelf packer collecting images for the atlas at load time.
+typedef struct {
+    Image images[MAX_ATLAS_SPRITES];
+    Sprite sprites[MAX_ATLAS_SPRITES];
+    int count;
+    int x;
+    int y;
+    int shelfHeight;
+} AtlasPacker;
+
 const CellInfo fortressWall[] = {
     {13 * 4 - 6 + 2, 5 * 4 + 2 + 4}, {13 * 4 - 5 + 2, 5 * 4 + 2 + 4},
     {13 * 4 - 4 + 2, 5 * 4 + 2 + 4}, {13 * 4 - 3 + 2, 5 * 4 + 2 + 4},
@@ -66,7 +91,7 @@ typedef struct {
 } PlayerScore;
 
 typedef struct {
-    Texture2D *texture;
+    Sprite *texture;
     Rectangle textureSrc;
     Vector2 pos;
     Vector2 size;
@@ -75,8 +100,8 @@ typedef struct {
 } UIElement;
 
 typedef struct {
-    Texture2D *texture;
-    Texture2D *powerUpTexture;
+    Sprite *texture;
+    Sprite *powerUpTexture;
     short speed;
     short bulletSpeed;
     char maxBulletCount;
@@ -97,7 +122,7 @@ typedef enum {
 } PowerUpType;
 
 typedef struct {
-    Texture2D *texture;
+    Sprite *texture;
     int texCol;
 } PowerUpSpec;
 
@@ -112,6 +137,7 @@ typedef struct {
 typedef struct {
     TankType type;
     Vector2 pos;
+    Vector2 prevPos;
     Direction direction;
     char texColOffset;
     char firedBulletCount;
@@ -132,12 +158,28 @@ typedef struct {
     Direction direction;
 } Command;
 
+// One line of a headless input script: hold the commands for `ticks` ticks.
+typedef struct {
+    int ticks;
+    Command commands[2];
+    bool proceed;
+} ScriptStep;
+
+typedef struct {
+    ScriptStep *steps;
+    int stepCount;
+    int step;
+    int tick;
+} InputScript;
+
 typedef struct {
     float duration;
-    Texture2D *textures;
+    Sprite *textures;
     char textureCount;
 } Animation;
 
+typedef enum { FLTerrain, FLRiver1, FLRiver2, FLForest, FLMax } FieldLayer;
+
 typedef enum { ETBullet, ETBig, ETMax } ExplosionType;
 
 typedef struct {
@@ -158,6 +200,7 @@ typedef enum { BTNone, BTTank } BulletType;
 
 typedef struct {
     Vector2 pos;
+    Vector2 prevPos;
     Vector2 speed;
     Direction direction;
     BulletType type;
@@ -183,42 +226,58 @@ typedef struct {
 } Cell;
 
 typedef struct {
-    Texture2D *texture;
+    Sprite *texture;
     bool isSolid;
     bool isPassable;
 } CellSpec;
 
+// One bit per cell. rows[r] bit c and cols[c] bit r describe the same cell,
+// so horizontal and vertical spans are both a single AND (FIELD_COLS and
+// FIELD_ROWS must stay <= 64).
 typedef struct {
-    Texture2D flag;
-    Texture2D deadFlag;
-    Texture2D brick;
-    Texture2D border;
-    Texture2D concrete;
-    Texture2D forest;
-    Texture2D river[2];
-    Texture2D blank;
-    Texture2D player1Tank;
-    Texture2D player2Tank;
-    Texture2D enemies;
-    Texture2D enemiesWithPowerUps;
-    Texture2D bullet;
-    Texture2D bulletExplosions[3];
-    Texture2D bigExplosions[5];
-    Texture2D spawningTank;
-    Texture2D uiFlag;
-    Texture2D ui;
-    Texture2D digits;
-    Texture2D powerups;
-    Texture2D shield;
-    Texture2D ice;
-    Texture2D title;
-    Texture2D leftArrow;
-    Texture2D rightArrow;
-    Texture2D gameOver;
-    Texture2D gameOverCurtain;
-    Texture2D pause;
-    Texture2D scores;
-    Texture2D lan;
+    u64 rows[FIELD_ROWS];
+    u64 cols[FIELD_COLS];
+} FieldMask;
+
+// Inclusive range of tank grid buckets covered by a box.
+typedef struct {
+    char minRow;
+    char minCol;
+    char maxRow;
+    char maxCol;
+} GridSpan;
+
+typedef struct {
+    Sprite flag;
+    Sprite deadFlag;
+    Sprite brick;
+    Sprite border;
+    Sprite concrete;
+    Sprite forest;
+    Sprite river[2];
+    Sprite blank;
+    Sprite player1Tank;
+    Sprite player2Tank;
+    Sprite enemies;
+    Sprite enemiesWithPowerUps;
+    Sprite bullet;
+    Sprite bulletExplosions[3];
+    Sprite bigExplosions[5];
+    Sprite spawningTank;
+    Sprite uiFlag;
+    Sprite ui;
+    Sprite digits;
+    Sprite powerups;
+    Sprite shield;
+    Sprite ice;
+    Sprite title;
+    Sprite leftArrow;
+    Sprite rightArrow;
+    Sprite gameOver;
+    Sprite gameOverCurtain;
+    Sprite pause;
+    Sprite scores;
+    Sprite lan;
 } Textures;
 
 typedef enum {
@@ -274,6 +333,12 @@ typedef enum { GMOnePlayer, GMTwoPlayers, GMLan } GameMode;
 
 typedef enum { LServer, LClient } LanMode;
 
+// CMFrame compresses every snapshot as its own zstd frame, CMStream flushes
+// it as a block of a long running frame so it can match earlier snapshots.
+typedef enum { CMFrame, CMStream } CompressionMode;
+
+typedef enum { CFStream = 1, CFStreamStart = 2, CFRaw = 4 } CompressionFlags;
+
 // typedef struct {
 //     struct sockaddr_in serverAddress, clientAdress;
 //     socklen_t addressLen = sizeof(clientAdress);
@@ -286,7 +351,72 @@ typedef enum { LServer, LClient } LanMode;
 
 typedef int Socket;
 
+// One tick of LAN client input.
+typedef struct {
+    long tick;
+    Command command;
+    bool proceed;
+} InputFrame;
+
+// A LAN client packet as the game loop sees it. The network thread adds the
+// snapshot ack and does the bit packing. In lockstep both peers send these,
+// with the last tick they have both inputs for and their latest state hash,
+// and desynced marks a peer that fell back to snapshots.
 typedef struct {
+    long inputTick;
+    u8 lossPercent;
+    InputFrame frames[INPUT_REDUNDANCY];
+    long ackTick;
+    long hashTick;
+    u32 hash;
+    bool desynced;
+} InputPacket;
+
+// Network counters of a LAN session, added to by the network thread and
+// the game loop and turned into per second rates once a second.
+typedef enum {
+    NCPacketsIn,
+    NCPacketsOut,
+    NCBytesIn,
+    NCBytesOut,
+    // Snapshot bytes before and after compression.
+    NCRawBytes,
+    NCCompressedBytes,
+    // Time spent encoding snapshots on the host, decoding them on the
+    // client, in nanoseconds.
+    NCCodecTime,
+    NCCodedSnapshots,
+    NCRttTime,
+    NCRttSamples,
+    // Snapshots and input packets that came after their tick was played.
+    NCLatePackets,
+    // Client input frames the host folded into another tick's.
+    NCMergedInputs,
+    NCMax
+} NetCounter;
+
+typedef struct {
+    float rtt;
+    long packetsIn;
+    long packetsOut;
+    long bytesIn;
+    long bytesOut;
+    float compressionRatio;
+    float codecTime;
+    long latePackets;
+    long mergedInputs;
+    int lossPercent;
+} NetStats;
+
+typedef struct {
+    long tick;
+    double time;
+} SendStamp;
+
+typedef struct SnapshotHistory SnapshotHistory;
+typedef struct GameCheckpoint GameCheckpoint;
+
+typedef struct Lan {
     LanMode lanMode;
     Socket socket;
     struct sockaddr_in broadcastAddress, clientAddress, serverAddress;
@@ -294,7 +424,114 @@ typedef struct {
     int availableGames;
     int selectedAddressIndex;
     struct sockaddr_in joinableAddresses[MAX_AVAILABLE_GAMES];
-    char clientInput[CLIENT_INPUT_SIZE];
+    InputFrame clientInput;
+    // The tank a client controls: player 2 when joining a hosted game, either
+    // one on a dedicated server.
+    TankType localTank;
+    bool isSpectator;
+    // Lockstep: both peers simulate and trade only their inputs, which
+    // apply inputDelay ticks after they are sampled. inputHistory holds the
+    // local player's frames on both sides, peerInputHistory the other's.
+    // useLockstep is the host's setting, lockstep the current session's.
+    bool useLockstep;
+    bool lockstep;
+    int inputDelay;
+    u64 lockstepSeed;
+    InputFrame pendingInput;
+    InputFrame peerInputHistory[INPUT_HISTORY_SIZE];
+    long hashTick;
+    u32 hash;
+    long peerHashTick;
+    u32 peerHash;
+    // Each side acks confirmedTick, the newest tick up to which all the
+    // peer's frames are in.
+    long confirmedTick;
+    long peerAckTick;
+    // Rollback runs on top of lockstep: the game steps ahead on predicted
+    // peer frames, keeping the state before every tick past confirmedTick.
+    // A frame that differs from predictedInput rewinds to rollbackTick.
+    bool useRollback;
+    bool rollback;
+    GameCheckpoint *checkpoints;
+    InputFrame predictedInput[INPUT_HISTORY_SIZE];
+    long rollbackTick;
+    long pendingHashTick;
+    u32 pendingHash;
+    long rollbacks;
+    long replayedTicks;
+    SnapshotHistory *snapshots;
+    // Client input ticks: the client's own counter on the client, the last
+    // one applied on the host, which the host echoes in every snapshot. The
+    // history holds the client's inputs, and on the host the ones received
+    // up to receivedInputTick.
+    long inputTick;
+    long receivedInputTick;
+    long minInputBacklog;
+    InputFrame inputHistory[INPUT_HISTORY_SIZE];
+    // Client jitter buffer: snapshots are played back at renderTick, a delay
+    // behind the newest one that is sized from the measured jitter.
+    long latestTick;
+    long clientTick;
+    long transit;
+    float jitter;
+    float snapshotInterval;
+    double renderTick;
+    CompressionMode compression;
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+    u32 dictId;
+    bool dictMismatch;
+    u16 streamSequence;
+    bool streamSynced;
+    // Host send scheduler. Snapshots go out every sendInterval ticks, with
+    // the sounds of the ticks in between.
+    int netRate;
+    int minSendInterval;
+    int sendInterval;
+    long nextSendTick;
+    long lastRateChangeTick;
+    u8 reportedLoss;
+    SfxType pendingSfx[MAX_SFX_PLAYED];
+    // Client side loss, counted from the snapshot sequence numbers.
+    bool hasSequence;
+    u16 lastSequence;
+    int windowExpected;
+    int windowReceived;
+    // Atomic, as the network stats read it on the game loop.
+    _Atomic u8 lossPercent;
+    // During a LAN game only the network thread touches the socket, the zstd
+    // contexts, the loss counters and the fields below. It trades snapshots
+    // and input packets with the game loop through the two rings. Before the
+    // game starts the lobby screens use the packet batches.
+    pthread_t netThread;
+    atomic_bool netRunning;
+    SpscRing outbox;
+    SpscRing inbox;
+    PacketBatch received;
+    PacketBatch outgoing;
+    // Set by the --net-* options: outgoing datagrams go through it.
+    NetEmulator *netEmulator;
+    // When packets for a tick first went out, to time the round trip until
+    // the peer echoes the tick back.
+    SendStamp sendStamps[INPUT_HISTORY_SIZE];
+    long stampedTick;
+    long echoedTick;
+    _Atomic long netCounters[NCMax];
+    long reportedCounters[NCMax];
+    double statsTime;
+    NetStats stats;
+    SnapshotHistory *netSnapshots;
+    long netTick;
+    long ackedTick;
+    // Host side spectators. They all get the snapshots of spectatorFeed,
+    // encoded and compressed once into the first buffer of spectatorBatch.
+    struct Lan *spectatorFeed;
+    PacketBatch spectatorBatch;
+    struct sockaddr_in spectators[MAX_SPECTATORS];
+    long spectatorSeenTicks[MAX_SPECTATORS];
+    int spectatorCount;
     float timeout;
     float timeoutScreenTime;
 } Lan;
@@ -313,19 +550,43 @@ typedef enum {
     GSTimedOut,
 } GameScreen;
 
+typedef struct Game Game;
+
 typedef struct {
-    void (*logic)(void);
-    void (*draw)(void);
+    void (*logic)(Game *game);
+    void (*draw)(Game *game);
 } GameFunctions;
 
 typedef struct {
+    Texture2D atlas;
+    Textures textures;
+    Sounds sounds;
+    Font font;
+} Assets;
+
+struct Game {
     int screenWidth;
     int screenHeight;
     Camera2D camera;
     Cell field[FIELD_ROWS][FIELD_COLS];
+    FieldMask solidCells;
+    FieldMask passableCells;
+    FieldMask iceCells;
+    FieldMask forestCells;
+    // Cells whose type changed since the field layers were last redrawn.
+    FieldMask dirtyCells;
     Tank tanks[MAX_TANK_COUNT];
+    // Bit i of a bucket is set when tanks[i] overlaps it.
+    u64 tankGrid[TANK_GRID_ROWS][TANK_GRID_COLS];
+    GridSpan tankGridSpans[MAX_TANK_COUNT];
     TankSpec tankSpecs[TMax];
     Bullet bullets[MAX_BULLET_COUNT];
+    // Slots of live bullets, packed. Destroyed bullets are swap-removed at the
+    // end of the bullet pass and their slots pushed on the free list.
+    u8 activeBullets[MAX_BULLET_COUNT];
+    u8 freeBullets[MAX_BULLET_COUNT];
+    int activeBulletCount;
+    int freeBulletCount;
     Vector2 flagPos;
     bool isFlagDead;
     CellSpec cellSpecs[CTMax];
@@ -333,10 +594,9 @@ typedef struct {
     Animation explosionAnimations[ETMax];
     Explosion explosions[MAX_EXPLOSION_COUNT];
     ScorePopup scorePopups[MAX_SCORE_POPUP_COUNT];
-    Textures textures;
-    Sounds sounds;
     SfxType sfxPlayed[MAX_SFX_PLAYED];
     float frameTime;
+    float renderAlpha;
     float totalTime;
     float timeSinceSpawn;
     char activeEnemyCount;
@@ -348,8 +608,8 @@ typedef struct {
     PowerUp powerUps[MAX_POWERUP_COUNT];
     float timerPowerUpTimeLeft;
     float shovelPowerUpTimeLeft;
-    void (*logic)();
-    void (*draw)();
+    void (*logic)(Game *game);
+    void (*draw)(Game *game);
     Title title;
     LanMenu lanMenu;
     Lan lan;
@@ -365,11 +625,36 @@ typedef struct {
     char soundtrackPhase;
     char soundtrack;
     bool isDieSoundtrackPlayed;
-    Font font;
     bool proceed;
+    bool switchMode;
     bool mute;
+    bool showNetStats;
     bool fullscreen;
+    bool headless;
+    Command playerCommands[2];
+    u64 seed;
+    Rng rng;
     long tick;
-} Game;
+};
+
+// The part of Game that a tick changes, for rollback. Specs, assets, menus
+// and the LAN session stay out.
+#define CHECKPOINT_FIELDS(X)                                                 \
+    X(field) X(solidCells) X(passableCells) X(iceCells) X(forestCells)       \
+    X(tanks) X(tankGrid) X(tankGridSpans) X(tankSpecs) X(bullets)            \
+    X(activeBullets) X(freeBullets) X(activeBulletCount) X(freeBulletCount)  \
+    X(flagPos) X(isFlagDead) X(explosions) X(scorePopups) X(timeSinceSpawn)  \
+    X(activeEnemyCount) X(pendingEnemyCount) X(maxActiveEnemyCount)          \
+    X(stage) X(uiElements) X(playerScores) X(powerUps)                       \
+    X(timerPowerUpTimeLeft) X(shovelPowerUpTimeLeft) X(logic) X(draw)        \
+    X(stageSummary) X(stageCurtainTime) X(gameOverTime) X(stageEndTime)      \
+    X(isStageCurtainSoundPlayed) X(isPaused) X(hiScore) X(screen) X(rng)     \
+    X(tick)
+
+#define CHECKPOINT_MEMBER(name) __typeof__(((Game *)0)->name) name;
+
+struct GameCheckpoint {
+    CHECKPOINT_FIELDS(CHECKPOINT_MEMBER)
+};
 
 #endif
\ No newline at end of file
@@ -0,0 +1,99 @@
+// Trains the zstd dictionary used for LAN snapshots.
+//
+//   ./bc4000 --record-snapshots snapshots.rec --bench-compression --stage N
+//   clang dict_trainer.c -o dict_trainer -l zstd
+//   ./dict_trainer snapshots.dict 1 snapshots.rec [more.rec ...]
+//
+// A recording is a sequence of raw snapshots, each prefixed with its size as
+// a 4 byte little endian integer. The dictionary ID is written into every
+// zstd frame, so it is kept below 256 to take a single byte there. Bump it
+// whenever the dictionary is retrained.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zdict.h>
+#include <zstd.h>
+
+static const size_t DICT_CAPACITY = 128 * 1024;
+
+static char *samples;
+static size_t samplesSize;
+static size_t samplesCapacity;
+static size_t *sampleSizes;
+static unsigned sampleCount;
+static unsigned sampleCapacity;
+
+void addSample(const char *bytes, size_t size) {
+    if (samplesSize + size > samplesCapacity) {
+        samplesCapacity = (samplesSize + size) * 2;
+        samples = realloc(samples, samplesCapacity);
+    }
+    if (sampleCount == sampleCapacity) {
+        sampleCapacity = sampleCapacity ? sampleCapacity * 2 : 1024;
+        sampleSizes = realloc(sampleSizes, sampleCapacity * sizeof(size_t));
+    }
+    memcpy(samples + samplesSize, bytes, size);
+    samplesSize += size;
+    sampleSizes[sampleCount++] = size;
+}
+
+void readRecording(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        printf("Cannot open file %s\n", filename);
+        exit(1);
+    }
+    unsigned char header[4];
+    char *snapshot = NULL;
+    while (fread(header, sizeof(header), 1, f) == 1) {
+        size_t size = header[0] | (header[1] << 8) | (header[2] << 16) |
+                      ((size_t)header[3] << 24);
+        snapshot = realloc(snapshot, size);
+        if (fread(snapshot, size, 1, f) != 1) {
+            printf("Truncated recording %s\n", filename);
+            break;
+        }
+        addSample(snapshot, size);
+    }
+    free(snapshot);
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        printf("Usage: %s output.dict id recording [recording ...]\n",
+               argv[0]);
+        return 1;
+    }
+    unsigned dictId = atoi(argv[2]);
+    if (dictId < 1 || dictId > 255) {
+        printf("Dictionary id must be between 1 and 255\n");
+        return 1;
+    }
+    for (int i = 3; i < argc; i++) {
+        readRecording(argv[i]);
+    }
+    printf("%u samples, %zu bytes\n", sampleCount, samplesSize);
+
+    char *dict = malloc(DICT_CAPACITY);
+    size_t dictSize = ZDICT_trainFromBuffer(dict, DICT_CAPACITY, samples,
+                                            sampleSizes, sampleCount);
+    if (ZDICT_isError(dictSize)) {
+        printf("Training failed: %s\n", ZDICT_getErrorName(dictSize));
+        return 1;
+    }
+    // Dictionary header: 4 byte magic number, then the little endian ID.
+    memset(dict + 4, 0, 4);
+    dict[4] = dictId;
+
+    FILE *f = fopen(argv[1], "wb");
+    if (!f || fwrite(dict, dictSize, 1, f) != 1) {
+        printf("Cannot write %s\n", argv[1]);
+        return 1;
+    }
+    fclose(f);
+    printf("Wrote %s: %zu bytes, id %u\n", argv[1], dictSize,
+           ZSTD_getDictID_fromDict(dict, dictSize));
+    return 0;
+}
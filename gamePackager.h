@@ -1,6 +1,9 @@
 #ifndef GAME_PACKAGER_H
 #define GAME_PACKAGER_H
 
+#include <assert.h>
+#include <stddef.h>
+
 #include "constants.h"
 #include "dataTypes.h"
 #include "utils.h"
@@ -69,9 +72,257 @@ typedef struct {
     PlayerScore playerScores[2];
     bool isPaused;
     SfxType sfxPlayed[MAX_SFX_PLAYED];
+    u32 inputTick;
 } GameStatePacket;
 
-const int MAX_PACKET_SIZE = sizeof(GameStatePacket);
+struct SnapshotHistory {
+    GameStatePacket packets[SNAPSHOT_HISTORY_SIZE];
+};
+
+// Little endian bit stream, least significant bit first.
+typedef struct {
+    u8* bytes;
+    size_t capacity;
+    size_t size;
+    u64 bits;
+    int bitCount;
+} BitWriter;
+
+typedef struct {
+    const u8* bytes;
+    size_t size;
+    size_t pos;
+    u64 bits;
+    int bitCount;
+    bool overflow;
+} BitReader;
+
+static void writeBits(BitWriter* w, u32 value, int count) {
+    w->bits |= (u64)(value & (u32)((1ULL << count) - 1)) << w->bitCount;
+    w->bitCount += count;
+    while (w->bitCount >= 8) {
+        assert(w->size < w->capacity);
+        w->bytes[w->size++] = w->bits & 0xFF;
+        w->bits >>= 8;
+        w->bitCount -= 8;
+    }
+}
+
+static size_t flushBits(BitWriter* w) {
+    if (w->bitCount > 0) writeBits(w, 0, 8 - w->bitCount);
+    return w->size;
+}
+
+// Reading past the end returns zeros and sets overflow.
+static u32 readBits(BitReader* r, int count) {
+    while (r->bitCount < count) {
+        u8 byte = 0;
+        if (r->pos < r->size) {
+            byte = r->bytes[r->pos++];
+        } else {
+            r->overflow = true;
+        }
+        r->bits |= (u64)byte << r->bitCount;
+        r->bitCount += 8;
+    }
+    u32 value = r->bits & (u32)((1ULL << count) - 1);
+    r->bits >>= count;
+    r->bitCount -= count;
+    return value;
+}
+
+static void writeInputFrame(BitWriter* w, const InputFrame* frame) {
+    writeBits(w, frame->command.move, 1);
+    writeBits(w, frame->command.direction, 2);
+    writeBits(w, frame->command.fire, 1);
+    writeBits(w, frame->proceed, 1);
+}
+
+static InputFrame readInputFrame(BitReader* r, long tick) {
+    InputFrame frame = {tick};
+    frame.command.move = readBits(r, 1);
+    frame.command.direction = readBits(r, 2);
+    frame.command.fire = readBits(r, 1);
+    frame.proceed = readBits(r, 1);
+    return frame;
+}
+
+static size_t writeInputPacket(char* buffer, long ackedTick,
+                               const InputPacket* packet) {
+    BitWriter w = {(u8*)buffer, CLIENT_PACKET_SIZE};
+    writeBits(&w, ackedTick, 32);
+    writeBits(&w, packet->inputTick, 32);
+    writeBits(&w, packet->lossPercent, 8);
+    for (int i = 0; i < INPUT_REDUNDANCY; i++) {
+        writeInputFrame(&w, &packet->frames[i]);
+    }
+    return flushBits(&w);
+}
+
+// Returns the snapshot tick the client acked.
+static long readInputPacket(const char* buffer, InputPacket* packet) {
+    BitReader r = {(const u8*)buffer, CLIENT_PACKET_SIZE};
+    long ackedTick = readBits(&r, 32);
+    packet->inputTick = readBits(&r, 32);
+    packet->lossPercent = readBits(&r, 8);
+    for (int i = 0; i < INPUT_REDUNDANCY; i++) {
+        packet->frames[i] = readInputFrame(&r, packet->inputTick - i);
+    }
+    return ackedTick;
+}
+
+static size_t writeLockstepPacket(char* buffer, const InputPacket* packet) {
+    BitWriter w = {(u8*)buffer, LOCKSTEP_PACKET_SIZE};
+    writeBits(&w, LOCKSTEP_MARKER, 8);
+    writeBits(&w, packet->inputTick, 32);
+    writeBits(&w, packet->ackTick, 32);
+    writeBits(&w, packet->hashTick, 32);
+    writeBits(&w, packet->hash, 32);
+    for (int i = 0; i < INPUT_REDUNDANCY; i++) {
+        writeInputFrame(&w, &packet->frames[i]);
+    }
+    return flushBits(&w);
+}
+
+// Returns false for anything but a lockstep packet.
+static bool readLockstepPacket(const char* buffer, size_t size,
+                               InputPacket* packet) {
+    if (size != LOCKSTEP_PACKET_SIZE) return false;
+    BitReader r = {(const u8*)buffer, size};
+    if (readBits(&r, 8) != LOCKSTEP_MARKER) return false;
+    *packet = (InputPacket){};
+    packet->inputTick = readBits(&r, 32);
+    packet->ackTick = readBits(&r, 32);
+    packet->hashTick = readBits(&r, 32);
+    packet->hash = readBits(&r, 32);
+    for (int i = 0; i < INPUT_REDUNDANCY; i++) {
+        packet->frames[i] = readInputFrame(&r, packet->inputTick - i);
+    }
+    return true;
+}
+
+// A packet struct member of 1, 2 or 4 bytes, or an array of them, and its
+// width on the wire.
+typedef struct {
+    u16 offset;
+    u8 size;
+    u8 count;
+    u8 bits;
+} PacketField;
+
+#define MEMBER(record, member) (((record*)0)->member)
+#define PACKET_FIELD(record, member, bits) \
+    {offsetof(record, member), sizeof(MEMBER(record, member)), 1, bits}
+#define TAIL_OFFSET(member)               \
+    (offsetof(GameStatePacket, member) - \
+     offsetof(GameStatePacket, stageCurtainTime))
+#define TAIL_FIELD(member, bits) \
+    {TAIL_OFFSET(member), sizeof(MEMBER(GameStatePacket, member)), 1, bits}
+#define TAIL_ARRAY(member, bits)                           \
+    {TAIL_OFFSET(member), sizeof(MEMBER(GameStatePacket, member)[0]), \
+     ASIZE(MEMBER(GameStatePacket, member)), bits}
+
+// Positions fit in 11 bits: the field is FIELD_COLS * CELL_SIZE wide.
+static const PacketField TANK_FIELDS[] = {
+    PACKET_FIELD(GameStateTank, type, 3),
+    PACKET_FIELD(GameStateTank, x, 11),
+    PACKET_FIELD(GameStateTank, y, 11),
+    PACKET_FIELD(GameStateTank, direction, 2),
+    PACKET_FIELD(GameStateTank, status, 2),
+    PACKET_FIELD(GameStateTank, spawningTime, 8),
+    PACKET_FIELD(GameStateTank, shieldTimeLeft, 8),
+    PACKET_FIELD(GameStateTank, immobileTimeLeft, 8),
+    PACKET_FIELD(GameStateTank, texColOffset, 1),
+};
+
+static const PacketField BULLET_FIELDS[] = {
+    PACKET_FIELD(GameStateBullet, x, 11),
+    PACKET_FIELD(GameStateBullet, y, 11),
+    PACKET_FIELD(GameStateBullet, direction, 2),
+    PACKET_FIELD(GameStateBullet, type, 1),
+};
+
+static const PacketField CELL_FIELDS[] = {
+    PACKET_FIELD(GameStateCell, type, 3),
+};
+
+static const PacketField POWERUP_FIELDS[] = {
+    PACKET_FIELD(GameStatePowerUp, type, 3),
+    PACKET_FIELD(GameStatePowerUp, x, 11),
+    PACKET_FIELD(GameStatePowerUp, y, 11),
+    PACKET_FIELD(GameStatePowerUp, state, 2),
+};
+
+static const PacketField EXPLOSION_FIELDS[] = {
+    PACKET_FIELD(GameStateExplosion, type, 1),
+    PACKET_FIELD(GameStateExplosion, x, 11),
+    PACKET_FIELD(GameStateExplosion, y, 11),
+    PACKET_FIELD(GameStateExplosion, ttl, 8),
+};
+
+static const PacketField SCORE_POPUP_FIELDS[] = {
+    PACKET_FIELD(GameStateScorePopup, texCol, 8),
+    PACKET_FIELD(GameStateScorePopup, x, 11),
+    PACKET_FIELD(GameStateScorePopup, y, 11),
+    PACKET_FIELD(GameStateScorePopup, ttl, 8),
+};
+
+static const PacketField TAIL_FIELDS[] = {
+    TAIL_FIELD(stageCurtainTime, 8),
+    TAIL_FIELD(gameOverTime, 8),
+    TAIL_FIELD(pendingEnemyCount, 8),
+    TAIL_ARRAY(lifes, 8),
+    TAIL_FIELD(stageSummaryTime, 32),
+    TAIL_FIELD(hiScore, 32),
+    TAIL_FIELD(stage, 8),
+    TAIL_FIELD(screen, 8),
+    TAIL_FIELD(playerScores[0].totalScore, 32),
+    TAIL_ARRAY(playerScores[0].kills, 16),
+    TAIL_FIELD(playerScores[1].totalScore, 32),
+    TAIL_ARRAY(playerScores[1].kills, 16),
+    TAIL_FIELD(isPaused, 1),
+    TAIL_ARRAY(sfxPlayed, 4),
+    TAIL_FIELD(inputTick, 32),
+};
+
+typedef struct {
+    size_t offset;
+    size_t recordSize;
+    int count;
+    const PacketField* fields;
+    int fieldCount;
+} PacketSection;
+
+#define PACKET_SECTION(member, record, fields)                       \
+    {offsetof(GameStatePacket, member), sizeof(record),              \
+     sizeof(MEMBER(GameStatePacket, member)) / sizeof(record), fields, \
+     ASIZE(fields)}
+
+// Every packet is a delta: against an acked snapshot or, for a full
+// snapshot, against an all zero packet. Per section it carries a changed
+// bit, then one bit per record, then the changed records. A changed record
+// is a single bit if it became all zero, which is what empty slots pack to.
+static const PacketSection PACKET_SECTIONS[] = {
+    PACKET_SECTION(tanks, GameStateTank, TANK_FIELDS),
+    PACKET_SECTION(bullets, GameStateBullet, BULLET_FIELDS),
+    PACKET_SECTION(field, GameStateCell, CELL_FIELDS),
+    PACKET_SECTION(powerUps, GameStatePowerUp, POWERUP_FIELDS),
+    PACKET_SECTION(explosions, GameStateExplosion, EXPLOSION_FIELDS),
+    PACKET_SECTION(scorePopups, GameStateScorePopup, SCORE_POPUP_FIELDS),
+    {offsetof(GameStatePacket, stageCurtainTime),
+     sizeof(GameStatePacket) - offsetof(GameStatePacket, stageCurtainTime), 1,
+     TAIL_FIELDS, ASIZE(TAIL_FIELDS)},
+};
+
+static const GameStatePacket EMPTY_PACKET;
+
+// 32-bit tick and 8-bit base tick age, 0 for a full snapshot.
+const int SNAPSHOT_HEADER_SIZE = 5;
+// Worst case: every record changed plus the flags and masks.
+const int MAX_PACKET_SIZE =
+    SNAPSHOT_HEADER_SIZE + sizeof(GameStatePacket) * 9 / 8 + 16;
+const int MAX_COMPRESSED_PACKET_SIZE =
+    COMPRESSION_HEADER_SIZE + ZSTD_COMPRESSBOUND(MAX_PACKET_SIZE);
 
 static void packTank(Tank* tank, GameStateTank* gameStateTank) {
     gameStateTank->type = (uint8_t)tank->type;
@@ -128,61 +379,213 @@ static void packScorePopup(ScorePopup* scorePopup,
     gameStateScorePopup->ttl = (uint8_t)(scorePopup->ttl * 64);
 }
 
-static size_t packGameState(Game* game, char* buffer) {
-    GameStatePacket packet;
-    memset(&packet, 0, sizeof(packet));
+static void fillGameStatePacket(Game* game, GameStatePacket* packet) {
+    memset(packet, 0, sizeof(*packet));
 
-    packet.tick = game->tick;
+    packet->tick = game->tick;
 
     for (int i = 0; i < MAX_TANK_COUNT; i++) {
-        packTank(&game->tanks[i], &packet.tanks[i]);
+        packTank(&game->tanks[i], &packet->tanks[i]);
     }
 
+    // Empty slots stay zero so they cost a single bit on the wire.
     for (int i = 0; i < MAX_BULLET_COUNT; i++) {
-        packBullet(&game->bullets[i], &packet.bullets[i]);
+        if (game->bullets[i].type == BTNone) continue;
+        packBullet(&game->bullets[i], &packet->bullets[i]);
     }
 
     for (int i = 0; i < MAX_POWERUP_COUNT; i++) {
-        packPowerUp(&game->powerUps[i], &packet.powerUps[i]);
+        packPowerUp(&game->powerUps[i], &packet->powerUps[i]);
     }
 
     for (int i = 0; i < MAX_EXPLOSION_COUNT; i++) {
-        packExplosion(&game->explosions[i], &packet.explosions[i]);
+        if (game->explosions[i].ttl <= 0) continue;
+        packExplosion(&game->explosions[i], &packet->explosions[i]);
     }
 
     for (int i = 0; i < MAX_SCORE_POPUP_COUNT; i++) {
-        packScorePopup(&game->scorePopups[i], &packet.scorePopups[i]);
+        if (game->scorePopups[i].ttl <= 0) continue;
+        packScorePopup(&game->scorePopups[i], &packet->scorePopups[i]);
     }
 
-    packField(game->field, packet.field);
+    packField(game->field, packet->field);
 
-    packet.stageCurtainTime = (game->stageCurtainTime * 64.0);
-    packet.gameOverTime = (game->gameOverTime * 64.0);
-    packet.pendingEnemyCount = game->pendingEnemyCount;
-    packet.lifes[0] = game->tanks[0].lifes;
-    packet.lifes[1] = game->tanks[1].lifes;
-    packet.hiScore = game->hiScore;
-    packet.stage = game->stage;
-    packet.stageSummaryTime = game->stageSummary.time;
-    packet.screen = game->screen;
-    packet.isPaused = game->isPaused;
+    packet->stageCurtainTime = (game->stageCurtainTime * 64.0);
+    packet->gameOverTime = (game->gameOverTime * 64.0);
+    packet->pendingEnemyCount = game->pendingEnemyCount;
+    packet->lifes[0] = game->tanks[0].lifes;
+    packet->lifes[1] = game->tanks[1].lifes;
+    packet->hiScore = game->hiScore;
+    packet->stage = game->stage;
+    packet->stageSummaryTime = game->stageSummary.time;
+    packet->screen = game->screen;
+    packet->isPaused = game->isPaused;
 
-    packet.playerScores[0] = game->playerScores[0];
-    packet.playerScores[1] = game->playerScores[1];
+    packet->playerScores[0] = game->playerScores[0];
+    packet->playerScores[1] = game->playerScores[1];
 
     for (int i = 0; i < MAX_SFX_PLAYED; i++) {
-        packet.sfxPlayed[i] = game->sfxPlayed[i];
+        packet->sfxPlayed[i] = game->sfxPlayed[i];
     }
 
-    memcpy(buffer, &packet, sizeof(packet));
+    packet->inputTick = game->lan.inputTick;
+}
+
+// FNV-1a over the snapshot of the game. Lockstep peers compare these, so
+// what may differ between them is left out: the high score comes from a
+// local file, the input tick is the host's and a rollback replay collects
+// the sounds of several ticks.
+static u32 hashGameState(Game* game) {
+    GameStatePacket packet;
+    fillGameStatePacket(game, &packet);
+    packet.hiScore = 0;
+    packet.inputTick = 0;
+    memset(packet.sfxPlayed, 0, sizeof(packet.sfxPlayed));
+    u32 hash = 2166136261u;
+    const u8* bytes = (const u8*)&packet;
+    for (size_t i = 0; i < sizeof(packet); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
 
-    return sizeof(packet);
+static GameStatePacket* findSnapshot(SnapshotHistory* history, long tick) {
+    if (tick <= 0) return NULL;
+    GameStatePacket* packet = &history->packets[tick % SNAPSHOT_HISTORY_SIZE];
+    return packet->tick == tick ? packet : NULL;
+}
+
+static void encodeRecord(BitWriter* w, const PacketSection* section,
+                         const u8* record) {
+    for (int i = 0; i < section->fieldCount; i++) {
+        const PacketField* field = &section->fields[i];
+        for (int k = 0; k < field->count; k++) {
+            const u8* at = record + field->offset + k * field->size;
+            u32 value = 0;
+            if (field->size == 1) {
+                value = *at;
+            } else if (field->size == 2) {
+                u16 v;
+                memcpy(&v, at, sizeof(v));
+                value = v;
+            } else {
+                memcpy(&value, at, sizeof(value));
+            }
+            writeBits(w, value, field->bits);
+        }
+    }
+}
+
+static void decodeRecord(BitReader* r, const PacketSection* section,
+                         u8* record) {
+    memset(record, 0, section->recordSize);
+    for (int i = 0; i < section->fieldCount; i++) {
+        const PacketField* field = &section->fields[i];
+        for (int k = 0; k < field->count; k++) {
+            u8* at = record + field->offset + k * field->size;
+            u32 value = readBits(r, field->bits);
+            if (field->size == 1) {
+                *at = value;
+            } else if (field->size == 2) {
+                u16 v = value;
+                memcpy(at, &v, sizeof(v));
+            } else {
+                memcpy(at, &value, sizeof(value));
+            }
+        }
+    }
+}
+
+static void encodeDelta(BitWriter* w, const GameStatePacket* packet,
+                        const GameStatePacket* base) {
+    for (int s = 0; s < ASIZE(PACKET_SECTIONS); s++) {
+        const PacketSection* section = &PACKET_SECTIONS[s];
+        const u8* cur = (const u8*)packet + section->offset;
+        const u8* old = (const u8*)base + section->offset;
+        const u8* empty = (const u8*)&EMPTY_PACKET + section->offset;
+        size_t size = section->recordSize;
+        bool changed = memcmp(cur, old, size * section->count) != 0;
+        writeBits(w, changed, 1);
+        if (!changed) continue;
+        for (int i = 0; i < section->count; i++) {
+            writeBits(w, memcmp(cur + i * size, old + i * size, size) != 0,
+                      1);
+        }
+        for (int i = 0; i < section->count; i++) {
+            size_t at = i * size;
+            if (!memcmp(cur + at, old + at, size)) continue;
+            bool isEmpty = !memcmp(cur + at, empty + at, size);
+            writeBits(w, isEmpty, 1);
+            if (!isEmpty) encodeRecord(w, section, cur + at);
+        }
+    }
+}
+
+static bool decodeDelta(BitReader* r, GameStatePacket* packet,
+                        const GameStatePacket* base) {
+    u8 changed[FIELD_ROWS * FIELD_COLS];
+    memcpy(packet, base, sizeof(*packet));
+    for (int s = 0; s < ASIZE(PACKET_SECTIONS); s++) {
+        const PacketSection* section = &PACKET_SECTIONS[s];
+        u8* cur = (u8*)packet + section->offset;
+        if (!readBits(r, 1)) continue;
+        for (int i = 0; i < section->count; i++) {
+            changed[i] = readBits(r, 1);
+        }
+        for (int i = 0; i < section->count; i++) {
+            if (!changed[i]) continue;
+            u8* record = cur + i * section->recordSize;
+            if (readBits(r, 1)) {
+                memset(record, 0, section->recordSize);
+            } else {
+                decodeRecord(r, section, record);
+            }
+        }
+    }
+    return !r->overflow && r->pos == r->size;
+}
+
+// Stores a filled packet in the history and encodes it as a delta against
+// the snapshot at baseTick, or in full if that one is gone.
+static size_t encodeSnapshot(const GameStatePacket* filled,
+                             SnapshotHistory* history, long baseTick,
+                             char* buffer) {
+    const GameStatePacket* base = NULL;
+    long age = filled->tick - baseTick;
+    if (age > 0 && age < SNAPSHOT_HISTORY_SIZE) {
+        base = findSnapshot(history, baseTick);
+    }
+    if (!base) {
+        base = &EMPTY_PACKET;
+        age = 0;
+    }
+
+    GameStatePacket* packet =
+        &history->packets[filled->tick % SNAPSHOT_HISTORY_SIZE];
+    if (packet != filled) *packet = *filled;
+
+    BitWriter w = {(u8*)buffer, MAX_PACKET_SIZE};
+    writeBits(&w, packet->tick, 32);
+    writeBits(&w, age, 8);
+    encodeDelta(&w, packet, base);
+    return flushBits(&w);
+}
+
+static size_t packGameState(Game* game, SnapshotHistory* history,
+                            long baseTick, char* buffer) {
+    GameStatePacket* packet =
+        &history->packets[game->tick % SNAPSHOT_HISTORY_SIZE];
+    fillGameStatePacket(game, packet);
+    return encodeSnapshot(packet, history, baseTick, buffer);
 }
 
 static void unpackTank(Tank* tank, GameStateTank* gameStateTank) {
     tank->type = (TankType)gameStateTank->type;
     tank->pos.x = (float)gameStateTank->x;
     tank->pos.y = (float)gameStateTank->y;
+    if (tank->status != (TankStatus)gameStateTank->status) {
+        tank->prevPos = tank->pos;
+    }
     tank->direction = (Direction)gameStateTank->direction;
     tank->status = (TankStatus)gameStateTank->status;
     tank->spawningTime =
@@ -197,15 +600,23 @@ static void unpackTank(Tank* tank, GameStateTank* gameStateTank) {
 static void unpackBullet(Bullet* bullet, GameStateBullet* gameStateBullet) {
     bullet->pos.x = (float)gameStateBullet->x;
     bullet->pos.y = (float)gameStateBullet->y;
+    if (bullet->type == BTNone) {
+        bullet->prevPos = bullet->pos;
+    }
     bullet->direction = (Direction)gameStateBullet->direction;
     bullet->type = (BulletType)gameStateBullet->type;
 }
 
 static void unpackField(Cell field[FIELD_ROWS][FIELD_COLS],
-                        GameStateCell gameStateField[FIELD_ROWS][FIELD_COLS]) {
+                        GameStateCell gameStateField[FIELD_ROWS][FIELD_COLS],
+                        FieldMask* dirtyCells) {
     for (int y = 0; y < FIELD_ROWS; y++) {
         for (int x = 0; x < FIELD_COLS; x++) {
-            field[y][x].type = (CellType)gameStateField[y][x].type;
+            CellType type = (CellType)gameStateField[y][x].type;
+            if (field[y][x].type == type) continue;
+            field[y][x].type = type;
+            dirtyCells->rows[y] |= 1ULL << x;
+            dirtyCells->cols[x] |= 1ULL << y;
         }
     }
 }
@@ -235,51 +646,114 @@ static void unpackScorePopup(ScorePopup* scorePopup,
     scorePopup->ttl = (float)(gameStateScorePopup->ttl / 64.0);
 }
 
-static GameStatePacket unpackGameState(Game* game, char* buffer) {
-    GameStatePacket packet;
-    memcpy(&packet, buffer, sizeof(packet));
-
-    if (packet.tick <= game->tick) return packet;
-
-    game->tick = packet.tick;
+static void applyGameStatePacket(Game* game, GameStatePacket* packet) {
+    game->tick = packet->tick;
 
     for (int i = 0; i < MAX_TANK_COUNT; i++) {
-        unpackTank(&game->tanks[i], &packet.tanks[i]);
+        unpackTank(&game->tanks[i], &packet->tanks[i]);
     }
 
     for (int i = 0; i < MAX_BULLET_COUNT; i++) {
-        unpackBullet(&game->bullets[i], &packet.bullets[i]);
+        unpackBullet(&game->bullets[i], &packet->bullets[i]);
     }
 
     for (int i = 0; i < MAX_POWERUP_COUNT; i++) {
-        unpackPowerUp(&game->powerUps[i], &packet.powerUps[i]);
+        unpackPowerUp(&game->powerUps[i], &packet->powerUps[i]);
     }
 
     for (int i = 0; i < MAX_EXPLOSION_COUNT; i++) {
-        unpackExplosion(&game->explosions[i], &packet.explosions[i]);
+        unpackExplosion(&game->explosions[i], &packet->explosions[i]);
     }
 
     for (int i = 0; i < MAX_SCORE_POPUP_COUNT; i++) {
-        unpackScorePopup(&game->scorePopups[i], &packet.scorePopups[i]);
+        unpackScorePopup(&game->scorePopups[i], &packet->scorePopups[i]);
     }
 
-    unpackField(game->field, packet.field);
+    unpackField(game->field, packet->field, &game->dirtyCells);
 
-    game->stageCurtainTime = ((float)packet.stageCurtainTime) / 64.0;
-    game->gameOverTime = ((float)packet.gameOverTime) / 64.0;
-    game->pendingEnemyCount = packet.pendingEnemyCount;
-    game->tanks[0].lifes = packet.lifes[0];
-    game->tanks[1].lifes = packet.lifes[1];
-    game->hiScore = packet.hiScore;
-    game->stageSummary.time = packet.stageSummaryTime;
-    game->isPaused = packet.isPaused;
+    game->stageCurtainTime = ((float)packet->stageCurtainTime) / 64.0;
+    game->gameOverTime = ((float)packet->gameOverTime) / 64.0;
+    game->pendingEnemyCount = packet->pendingEnemyCount;
+    game->tanks[0].lifes = packet->lifes[0];
+    game->tanks[1].lifes = packet->lifes[1];
+    game->hiScore = packet->hiScore;
+    game->stageSummary.time = packet->stageSummaryTime;
+    game->isPaused = packet->isPaused;
 
-    game->playerScores[0] = packet.playerScores[0];
-    game->playerScores[1] = packet.playerScores[1];
+    game->playerScores[0] = packet->playerScores[0];
+    game->playerScores[1] = packet->playerScores[1];
 
     for (int i = 0; i < MAX_SFX_PLAYED; i++) {
-        game->sfxPlayed[i] = packet.sfxPlayed[i];
+        game->sfxPlayed[i] = packet->sfxPlayed[i];
+    }
+}
+
+static void interpolatePos(Vector2* pos, int fromX, int fromY, int toX,
+                           int toY, float t) {
+    if (abs(toX - fromX) + abs(toY - fromY) > MAX_INTERPOLATION_DISTANCE) {
+        return;
+    }
+    pos->x = fromX + (toX - fromX) * t;
+    pos->y = fromY + (toY - fromY) * t;
+}
+
+// Moves tanks, bullets and explosions part of the way from snapshot a to b.
+// Entities that appear, vanish or respawn in between keep their state in a.
+static void interpolateGameState(Game* game, GameStatePacket* a,
+                                 GameStatePacket* b, float t) {
+    for (int i = 0; i < MAX_TANK_COUNT; i++) {
+        GameStateTank* from = &a->tanks[i];
+        GameStateTank* to = &b->tanks[i];
+        if (from->status != TSActive || to->status != TSActive ||
+            from->type != to->type) {
+            continue;
+        }
+        interpolatePos(&game->tanks[i].pos, from->x, from->y, to->x, to->y, t);
+    }
+
+    for (int i = 0; i < MAX_BULLET_COUNT; i++) {
+        GameStateBullet* from = &a->bullets[i];
+        GameStateBullet* to = &b->bullets[i];
+        if (from->type == BTNone || to->type != from->type ||
+            to->direction != from->direction) {
+            continue;
+        }
+        interpolatePos(&game->bullets[i].pos, from->x, from->y, to->x, to->y,
+                       t);
+    }
+
+    for (int i = 0; i < MAX_EXPLOSION_COUNT; i++) {
+        GameStateExplosion* from = &a->explosions[i];
+        GameStateExplosion* to = &b->explosions[i];
+        if (!from->ttl || !to->ttl || to->ttl > from->ttl) continue;
+        game->explosions[i].ttl =
+            (from->ttl + (to->ttl - from->ttl) * t) / 64.0;
+    }
+}
+
+// Decodes a snapshot into the history and returns it, or NULL for unknown
+// delta bases, duplicates and snapshots too old to be played back.
+static GameStatePacket* unpackGameState(SnapshotHistory* history,
+                                        long latestTick, char* buffer,
+                                        size_t size) {
+    if (size < SNAPSHOT_HEADER_SIZE) return NULL;
+    BitReader r = {(const u8*)buffer, size};
+    long tick = readBits(&r, 32);
+    long age = readBits(&r, 8);
+    if (tick <= latestTick - SNAPSHOT_HISTORY_SIZE / 2) return NULL;
+    if (findSnapshot(history, tick)) return NULL;
+
+    GameStatePacket* packet = &history->packets[tick % SNAPSHOT_HISTORY_SIZE];
+    const GameStatePacket* base = &EMPTY_PACKET;
+    if (age) {
+        base = findSnapshot(history, tick - age);
+        if (!base || base == packet) return NULL;
+    }
+    if (!decodeDelta(&r, packet, base)) {
+        packet->tick = 0;
+        return NULL;
     }
+    packet->tick = tick;
 
     return packet;
 }
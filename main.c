@@ -1,10 +1,21 @@
+#ifdef __linux__
+#define _GNU_SOURCE  // recvmmsg and sendmmsg
+#endif
+
 #include <assert.h>
 #include <libgen.h>
 #include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <zstd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include "constants.h"
 #include "dataTypes.h"
@@ -24,29 +35,31 @@
 #define SOUND_EXT "ogg"
 #endif
 
-static void gameLogic();
-static void lanGameLogic();
-static void drawGame();
-static void stageSummaryLogic();
-static void lanStageSummaryLogic();
-static void drawStageSummary();
-static void titleLogic();
-static void drawTitle();
-static void gameOverCurtainLogic();
-static void drawGameOverCurtain();
-static void congratsLogic();
-static void drawCongrats();
-static void saveHiScore();
-static void lanMenuLogic();
-static void drawLanMenu();
-static void initHostGame();
-static void hostGameLogic();
-static void drawHostGame();
-static void initJoinGame();
-static void joinGameLogic();
-static void drawJoinGame();
-static void timedOutLogic();
-static void drawTimedOut();
+static void gameLogic(Game *game);
+static void lanGameLogic(Game *game);
+static void drawGame(Game *game);
+static void stageSummaryLogic(Game *game);
+static void lanStageSummaryLogic(Game *game);
+static void drawStageSummary(Game *game);
+static void titleLogic(Game *game);
+static void drawTitle(Game *game);
+static void gameOverCurtainLogic(Game *game);
+static void drawGameOverCurtain(Game *game);
+static void congratsLogic(Game *game);
+static void drawCongrats(Game *game);
+static void saveHiScore(Game *game);
+static void lanMenuLogic(Game *game);
+static void drawLanMenu(Game *game);
+static void initHostGame(Game *game);
+static void hostGameLogic(Game *game);
+static void drawHostGame(Game *game);
+static void initJoinGame(Game *game);
+static void joinGameLogic(Game *game);
+static void drawJoinGame(Game *game);
+static void timedOutLogic(Game *game);
+static void drawTimedOut(Game *game);
+static void startNetThread(Lan *lan);
+static void closeLanSocket(Lan *lan);
 
 static GameFunctions gameFunctions[] = {
     {.logic = titleLogic, .draw = drawTitle},
@@ -62,135 +75,209 @@ static GameFunctions gameFunctions[] = {
     {.logic = timedOutLogic, .draw = drawTimedOut},
 };
 
-static Game game;
+static Assets assets;
+static RenderTexture2D fieldLayers[FLMax];
+static FILE *snapshotRecording;
+static FILE *netStatsFile;
 
 static void drawText(const char *text, int x, int y, int fontSize,
                      Color color) {
-    DrawTextEx(game.font, text, (Vector2){x, y}, fontSize, 2, color);
+    DrawTextEx(assets.font, text, (Vector2){x, y}, fontSize, 2, color);
 }
 
 static int measureText(const char *text, int fontSize) {
-    return MeasureTextEx(game.font, text, fontSize, 2).x;
+    return MeasureTextEx(assets.font, text, fontSize, 2).x;
+}
+
+static bool isEnemy(Game *game, Tank *t) {
+    return game->tankSpecs[t->type].isEnemy;
+}
+
+// Position between the last two simulation ticks for the current frame.
+static Vector2 interpolate(Game *game, Vector2 prevPos, Vector2 pos) {
+    return (Vector2){prevPos.x + (pos.x - prevPos.x) * game->renderAlpha,
+                     prevPos.y + (pos.y - prevPos.y) * game->renderAlpha};
 }
 
-static bool isEnemy(Tank *t) { return game.tankSpecs[t->type].isEnemy; }
+// Same as DrawTexturePro, with src relative to the sprite's atlas region.
+static void drawSprite(Sprite *sprite, Rectangle src, Rectangle dst,
+                       Vector2 origin, float rotation, Color tint) {
+    src.x += sprite->x;
+    src.y += sprite->y;
+    DrawTexturePro(assets.atlas, src, dst, origin, rotation, tint);
+}
 
-static void drawCell(Cell *cell) {
-    Texture2D *tex = game.cellSpecs[cell->type].texture;
+static void drawCell(Cell *cell, Sprite *tex) {
     int w = tex->width / 4;
     int h = tex->height / 4;
-    DrawTexturePro(*tex, (Rectangle){cell->texCol * w, cell->texRow * h, w, h},
-                   (Rectangle){cell->pos.x, cell->pos.y, CELL_SIZE, CELL_SIZE},
-                   (Vector2){}, 0, WHITE);
+    drawSprite(tex, (Rectangle){cell->texCol * w, cell->texRow * h, w, h},
+               (Rectangle){cell->pos.x, cell->pos.y, CELL_SIZE, CELL_SIZE},
+               (Vector2){}, 0, WHITE);
 #ifdef DRAW_CELL_GRID
     DrawRectangleLines(cell->pos.x, cell->pos.y, CELL_SIZE, CELL_SIZE, BLUE);
 #endif
 }
 
-static void drawField() {
-    for (int i = 0; i < FIELD_ROWS; i++) {
-        for (int j = 0; j < FIELD_COLS; j++) {
-            if (game.field[i][j].type != CTForest) drawCell(&game.field[i][j]);
-        }
+static void loadFieldLayers() {
+    for (int i = 0; i < FLMax; i++) {
+        fieldLayers[i] = LoadRenderTexture(SCREEN_WIDTH, SCREEN_HEIGHT);
+        BeginTextureMode(fieldLayers[i]);
+        ClearBackground(BLANK);
+        EndTextureMode();
     }
 }
 
-static void drawForest() {
-    for (int i = 0; i < FIELD_ROWS; i++) {
-        for (int j = 0; j < FIELD_COLS; j++) {
-            if (game.field[i][j].type == CTForest) drawCell(&game.field[i][j]);
+// Texture a cell is drawn with in the given layer, NULL if it is not there.
+static Sprite *fieldLayerTexture(Game *game, FieldLayer layer, CellType type) {
+    switch (layer) {
+        case FLTerrain:
+            if (type == CTRiver || type == CTForest) return NULL;
+            return game->cellSpecs[type].texture;
+        case FLRiver1:
+        case FLRiver2:
+            if (type != CTRiver) return NULL;
+            return &assets.textures.river[layer - FLRiver1];
+        case FLForest:
+            if (type != CTForest) return NULL;
+            return game->cellSpecs[type].texture;
+        case FLMax:
+            break;
+    }
+    return NULL;
+}
+
+// Redraws only the dirty cells. Each run of dirty cells in a row is cleared
+// with a single scissored clear before its cells are drawn back.
+static void updateFieldLayers(Game *game) {
+    u64 anyDirty = 0;
+    for (int i = 0; i < FIELD_ROWS; i++) anyDirty |= game->dirtyCells.rows[i];
+    if (!anyDirty) return;
+    for (int l = 0; l < FLMax; l++) {
+        BeginTextureMode(fieldLayers[l]);
+        for (int i = 0; i < FIELD_ROWS; i++) {
+            u64 bits = game->dirtyCells.rows[i];
+            while (bits) {
+                int start = lowestBit(bits);
+                u64 rest = ~(bits >> start);
+                int len = rest ? lowestBit(rest) : 64 - start;
+                bits &= ~bitSpan(start, start + len - 1);
+                BeginScissorMode(start * CELL_SIZE, i * CELL_SIZE,
+                                 len * CELL_SIZE, CELL_SIZE);
+                ClearBackground(BLANK);
+                EndScissorMode();
+                for (int j = start; j < start + len; j++) {
+                    Cell *cell = &game->field[i][j];
+                    Sprite *tex = fieldLayerTexture(game, l, cell->type);
+                    if (tex) drawCell(cell, tex);
+                }
+            }
         }
+        EndTextureMode();
     }
+    memset(&game->dirtyCells, 0, sizeof(game->dirtyCells));
+}
+
+static void drawFieldLayer(FieldLayer layer) {
+    Texture2D *tex = &fieldLayers[layer].texture;
+    // Render textures are stored upside down.
+    DrawTextureRec(*tex, (Rectangle){0, 0, tex->width, -tex->height},
+                   (Vector2){}, WHITE);
+}
+
+static void drawField(Game *game) {
+    drawFieldLayer(FLTerrain);
+    drawFieldLayer(FLRiver1 + ((long)(game->totalTime * 2)) % 2);
 }
 
-static void drawTank(Tank *tank) {
-    if (tank->immobileTimeLeft > 0 && (long)(game.totalTime * 8) % 2) return;
+static void drawForest(Game *game) { drawFieldLayer(FLForest); }
+
+static void drawTank(Game *game, Tank *tank) {
+    if (tank->immobileTimeLeft > 0 && (long)(game->totalTime * 8) % 2) return;
     static char textureRows[4] = {1, 3, 0, 2};
-    Texture2D *tex = !tank->powerUp || ((long)(game.totalTime * 8)) % 2
-                         ? game.tankSpecs[tank->type].texture
-                         : game.tankSpecs[tank->type].powerUpTexture;
+    Sprite *tex = !tank->powerUp || ((long)(game->totalTime * 8)) % 2
+                         ? game->tankSpecs[tank->type].texture
+                         : game->tankSpecs[tank->type].powerUpTexture;
     int texX = (textureRows[tank->direction] * 2 + tank->texColOffset) *
                TANK_TEXTURE_SIZE;
-    int texY = game.tankSpecs[tank->type].texRow * TANK_TEXTURE_SIZE;
+    int texY = game->tankSpecs[tank->type].texRow * TANK_TEXTURE_SIZE;
     int drawSize = TANK_TEXTURE_SIZE * 4;
     int drawOffset = (TANK_SIZE - drawSize) / 2;
+    Vector2 pos = interpolate(game, tank->prevPos, tank->pos);
     Color texColor = WHITE;
     if (tank->type == TArmor && tank->lifes > 1) {
         Color full = (Color){180, 255, 200, 255};
-        float fullLifes = game.tankSpecs[tank->type].lifes;
+        float fullLifes = game->tankSpecs[tank->type].lifes;
         float k = (float)(tank->lifes - 1) / (fullLifes - 1);
         texColor = (Color){.r = WHITE.r - (WHITE.r - full.r) * k,
                            .g = WHITE.g - (WHITE.g - full.g) * k,
                            .b = WHITE.b - (WHITE.b - full.b) * k,
                            255};
     }
-    DrawTexturePro(
-        *tex, (Rectangle){texX, texY, TANK_TEXTURE_SIZE, TANK_TEXTURE_SIZE},
-        (Rectangle){tank->pos.x + drawOffset, tank->pos.y + drawOffset,
-                    drawSize, drawSize},
+    drawSprite(
+        tex, (Rectangle){texX, texY, TANK_TEXTURE_SIZE, TANK_TEXTURE_SIZE},
+        (Rectangle){pos.x + drawOffset, pos.y + drawOffset, drawSize,
+                    drawSize},
         (Vector2){}, 0, texColor);
     if (tank->shieldTimeLeft > 0) {
-        Texture2D *tex = &game.textures.shield;
-        int texY = (((long)(game.totalTime * 32)) % 2) * tex->width;
-        DrawTexturePro(
-            *tex, (Rectangle){0, texY, tex->width, tex->width},
-            (Rectangle){tank->pos.x, tank->pos.y, TANK_SIZE, TANK_SIZE},
-            (Vector2){}, 0, WHITE);
+        Sprite *tex = &assets.textures.shield;
+        int texY = (((long)(game->totalTime * 32)) % 2) * tex->width;
+        drawSprite(tex, (Rectangle){0, texY, tex->width, tex->width},
+                   (Rectangle){pos.x, pos.y, TANK_SIZE, TANK_SIZE},
+                   (Vector2){}, 0, WHITE);
     }
 }
 
 static void drawSpawningTank(Tank *tank) {
     static char textureCols[] = {3, 2, 1, 0, 1, 2, 3, 2, 1, 0, 1, 2, 3};
-    Texture2D *tex = &game.textures.spawningTank;
+    Sprite *tex = &assets.textures.spawningTank;
     int textureSize = tex->height;
     int i = tank->spawningTime / (SPAWNING_TIME / ASIZE(textureCols));
     if (i >= ASIZE(textureCols)) i = ASIZE(textureCols) - 1;
     int texX = textureCols[i] * textureSize;
     int drawSize = SPAWN_TEXTURE_SIZE * 2;
-    DrawTexturePro(*tex, (Rectangle){texX, 0, textureSize, textureSize},
-                   (Rectangle){tank->pos.x, tank->pos.y, drawSize, drawSize},
-                   (Vector2){}, 0, WHITE);
+    drawSprite(tex, (Rectangle){texX, 0, textureSize, textureSize},
+               (Rectangle){tank->pos.x, tank->pos.y, drawSize, drawSize},
+               (Vector2){}, 0, WHITE);
 }
 
-static void drawTanks() {
+static void drawTanks(Game *game) {
     for (int i = 0; i < MAX_TANK_COUNT; i++) {
-        if (game.tanks[i].status == TSActive) {
-            drawTank(&game.tanks[i]);
-        } else if (game.tanks[i].status == TSSpawning) {
-            drawSpawningTank(&game.tanks[i]);
+        if (game->tanks[i].status == TSActive) {
+            drawTank(game, &game->tanks[i]);
+        } else if (game->tanks[i].status == TSSpawning) {
+            drawSpawningTank(&game->tanks[i]);
         }
     }
 }
 
-static void drawFlag() {
-    Texture2D *tex =
-        game.isFlagDead ? &game.textures.deadFlag : &game.textures.flag;
-    DrawTexturePro(
-        *tex, (Rectangle){0, 0, tex->width, tex->height},
-        (Rectangle){game.flagPos.x, game.flagPos.y, FLAG_SIZE, FLAG_SIZE},
+static void drawFlag(Game *game) {
+    Sprite *tex =
+        game->isFlagDead ? &assets.textures.deadFlag : &assets.textures.flag;
+    drawSprite(
+        tex, (Rectangle){0, 0, tex->width, tex->height},
+        (Rectangle){game->flagPos.x, game->flagPos.y, FLAG_SIZE, FLAG_SIZE},
         (Vector2){}, 0, WHITE);
 }
 
-static void drawBullets() {
+static void drawBullets(Game *game) {
     static int x[4] = {24, 8, 0, 16};
-    Texture2D *tex = &game.textures.bullet;
-    for (int i = 0; i < MAX_BULLET_COUNT; i++) {
-        Bullet *b = &game.bullets[i];
-        if (b->type == BTNone) continue;
-        DrawTexturePro(
-            *tex, (Rectangle){x[b->direction], 0, 8, 8},
-            (Rectangle){b->pos.x, b->pos.y, BULLET_SIZE, BULLET_SIZE},
-            (Vector2){}, 0, WHITE);
+    Sprite *tex = &assets.textures.bullet;
+    for (int i = 0; i < game->activeBulletCount; i++) {
+        Bullet *b = &game->bullets[game->activeBullets[i]];
+        Vector2 pos = interpolate(game, b->prevPos, b->pos);
+        drawSprite(tex, (Rectangle){x[b->direction], 0, 8, 8},
+                   (Rectangle){pos.x, pos.y, BULLET_SIZE, BULLET_SIZE},
+                   (Vector2){}, 0, WHITE);
     }
 }
 
-static void drawScorePopups() {
+static void drawScorePopups(Game *game) {
     for (int i = 0; i < MAX_SCORE_POPUP_COUNT; i++) {
-        ScorePopup *s = &game.scorePopups[i];
+        ScorePopup *s = &game->scorePopups[i];
         if (s->ttl <= 0) continue;
-        Texture2D *tex = &game.textures.scores;
-        DrawTexturePro(
-            *tex,
+        Sprite *tex = &assets.textures.scores;
+        drawSprite(
+            tex,
             (Rectangle){s->texCol * SCORE_POPUP_TEXTURE_SIZE.x, 0,
                         SCORE_POPUP_TEXTURE_SIZE.x, SCORE_POPUP_TEXTURE_SIZE.y},
             (Rectangle){s->pos.x, s->pos.y, SCORE_POPUP_SIZE.x,
@@ -199,30 +286,30 @@ static void drawScorePopups() {
     }
 }
 
-static void drawExplosions() {
+static void drawExplosions(Game *game) {
     for (int i = 0; i < MAX_EXPLOSION_COUNT; i++) {
-        Explosion *e = &game.explosions[i];
+        Explosion *e = &game->explosions[i];
         if (e->ttl <= 0) continue;
-        int texCount = game.explosionAnimations[e->type].textureCount;
+        int texCount = game->explosionAnimations[e->type].textureCount;
         int index =
-            e->ttl / (game.explosionAnimations[e->type].duration / texCount);
+            e->ttl / (game->explosionAnimations[e->type].duration / texCount);
         if (index >= texCount) index = texCount - 1;
-        Texture2D *tex =
-            &game.explosionAnimations[e->type].textures[texCount - index - 1];
-        DrawTexturePro(
-            *tex, (Rectangle){0, 0, tex->width, tex->height},
+        Sprite *tex =
+            &game->explosionAnimations[e->type].textures[texCount - index - 1];
+        drawSprite(
+            tex, (Rectangle){0, 0, tex->width, tex->height},
             (Rectangle){e->pos.x, e->pos.y, tex->width * 2, tex->height * 2},
             (Vector2){}, 0, WHITE);
     }
 }
 
-static void drawUITanks() {
-    Texture2D *tex = &game.textures.ui;
+static void drawUITanks(Game *game) {
+    Sprite *tex = &assets.textures.ui;
     int drawSize = UI_TANK_TEXTURE_SIZE * 2;
     int drawOffset = (UI_TANK_SIZE - drawSize) / 2;
-    for (int i = 0; i < game.pendingEnemyCount; i++) {
-        DrawTexturePro(
-            *tex, (Rectangle){0, 0, UI_TANK_TEXTURE_SIZE, UI_TANK_TEXTURE_SIZE},
+    for (int i = 0; i < game->pendingEnemyCount; i++) {
+        drawSprite(
+            tex, (Rectangle){0, 0, UI_TANK_TEXTURE_SIZE, UI_TANK_TEXTURE_SIZE},
             (Rectangle){(14 * 4 + 2 + 2 * (i % 2)) * CELL_SIZE + drawOffset,
                         ((2 + 2) + (i / 2 * 2)) * CELL_SIZE + drawOffset,
                         drawSize, drawSize},
@@ -233,15 +320,15 @@ static void drawUITanks() {
 static void drawUIElement(UIElement *el) {
     int drawOffsetX = (el->size.x - el->drawSize.x) / 2;
     int drawOffsetY = (el->size.y - el->drawSize.y) / 2;
-    DrawTexturePro(*(el->texture), el->textureSrc,
-                   (Rectangle){el->pos.x + drawOffsetX, el->pos.y + drawOffsetY,
-                               el->drawSize.x, el->drawSize.y},
-                   (Vector2){}, 0, WHITE);
+    drawSprite(el->texture, el->textureSrc,
+               (Rectangle){el->pos.x + drawOffsetX, el->pos.y + drawOffsetY,
+                           el->drawSize.x, el->drawSize.y},
+               (Vector2){}, 0, WHITE);
 }
 
-static void drawUIElements() {
+static void drawUIElements(Game *game) {
     for (int i = 0; i < UIMax; i++) {
-        if (game.uiElements[i].isVisible) drawUIElement(&game.uiElements[i]);
+        if (game->uiElements[i].isVisible) drawUIElement(&game->uiElements[i]);
     }
 }
 
@@ -250,32 +337,32 @@ static Rectangle digitTextureRect(char digit) {
     return (Rectangle){(digit % 5) * w, (digit / 5) * w, w, w};
 }
 
-static void drawUI() {
-    drawUITanks();
-    drawUIElements();
+static void drawUI(Game *game) {
+    drawUITanks(game);
+    drawUIElements(game);
 }
 
-static void drawPowerUp(PowerUp *p) {
-    if (((long)(game.totalTime * 8)) % 2) return;
-    Texture2D *tex = game.powerUpSpecs[p->type].texture;
+static void drawPowerUp(Game *game, PowerUp *p) {
+    if (((long)(game->totalTime * 8)) % 2) return;
+    Sprite *tex = game->powerUpSpecs[p->type].texture;
     Vector2 drawSize = {POWER_UP_TEXTURE_SIZE.x * 2,
                         POWER_UP_TEXTURE_SIZE.y * 2};
     Vector2 drawOffset = {(POWER_UP_SIZE - drawSize.x) / 2,
                           (POWER_UP_SIZE - drawSize.y) / 2};
-    int texX = game.powerUpSpecs[p->type].texCol * POWER_UP_TEXTURE_SIZE.x;
-    DrawTexturePro(
-        *tex,
+    int texX = game->powerUpSpecs[p->type].texCol * POWER_UP_TEXTURE_SIZE.x;
+    drawSprite(
+        tex,
         (Rectangle){texX, 0, POWER_UP_TEXTURE_SIZE.x, POWER_UP_TEXTURE_SIZE.y},
         (Rectangle){p->pos.x + drawOffset.x, p->pos.y + drawOffset.y,
                     drawSize.x, drawSize.y},
         (Vector2){}, 0, WHITE);
 }
 
-static void drawPowerUps() {
+static void drawPowerUps(Game *game) {
     for (int i = 0; i < MAX_POWERUP_COUNT; i++) {
-        PowerUp *p = &game.powerUps[i];
+        PowerUp *p = &game->powerUps[i];
         if (p->state == PUSActive) {
-            drawPowerUp(p);
+            drawPowerUp(game, p);
         }
     }
 }
@@ -283,87 +370,126 @@ static void drawPowerUps() {
 static int centerX(int size) { return (SCREEN_WIDTH - size) / 2; }
 static int centerY(int size) { return (SCREEN_HEIGHT - size) / 2; }
 
-static void drawGameOver() {
-    if (!game.gameOverTime) return;
-    Texture2D *tex = &game.textures.gameOver;
+static void drawGameOver(Game *game) {
+    if (!game->gameOverTime) return;
+    Sprite *tex = &assets.textures.gameOver;
     int w = tex->width * 4;
     int h = tex->height * 4;
     int y =
         SCREEN_HEIGHT - (SCREEN_HEIGHT / 2 + h) *
-                            MIN(game.gameOverTime / GAME_OVER_SLIDE_TIME, 1);
-    DrawTexturePro(*tex, (Rectangle){0, 0, tex->width, tex->height},
-                   (Rectangle){centerX(w), y, w, h}, (Vector2){}, 0, WHITE);
+                            MIN(game->gameOverTime / GAME_OVER_SLIDE_TIME, 1);
+    drawSprite(tex, (Rectangle){0, 0, tex->width, tex->height},
+               (Rectangle){centerX(w), y, w, h}, (Vector2){}, 0, WHITE);
 }
 
-static void drawStageCurtain() {
-    if (game.stageCurtainTime >= STAGE_CURTAIN_TIME) return;
+static void drawStageCurtain(Game *game) {
+    if (game->stageCurtainTime >= STAGE_CURTAIN_TIME) return;
     float delayTime = STAGE_CURTAIN_TIME - 0.5;
     int visibleHeight =
-        SCREEN_HEIGHT * (MAX(game.stageCurtainTime - delayTime, 0) /
+        SCREEN_HEIGHT * (MAX(game->stageCurtainTime - delayTime, 0) /
                          (STAGE_CURTAIN_TIME - delayTime));
     int h = (SCREEN_HEIGHT - visibleHeight) / 2;
     DrawRectangle(0, 0, SCREEN_WIDTH, h, (Color){115, 117, 115, 255});
     DrawRectangle(0, SCREEN_HEIGHT - h, SCREEN_WIDTH, h,
                   (Color){115, 117, 115, 255});
-    if (game.stageCurtainTime < delayTime) {
+    if (game->stageCurtainTime < delayTime) {
         char text[20];
-        snprintf(text, 20, "STAGE %2d", game.stage);
+        snprintf(text, 20, "STAGE %2d", game->stage);
         int textSize = measureText(text, FONT_SIZE);
         drawText(text, centerX(textSize), (SCREEN_HEIGHT - FONT_SIZE) / 2,
                  FONT_SIZE, BLACK);
     }
 }
 
-static void drawPause() {
-    if (!game.isPaused || ((long)(game.totalTime * 2)) % 2) return;
-    Texture2D *tex = &game.textures.pause;
+static void drawPause(Game *game) {
+    if (!game->isPaused || ((long)(game->totalTime * 2)) % 2) return;
+    Sprite *tex = &assets.textures.pause;
     int w = tex->width * 4;
     int h = tex->height * 4;
-    DrawTexturePro(*tex, (Rectangle){0, 0, tex->width, tex->height},
-                   (Rectangle){centerX(w), centerY(h), w, h}, (Vector2){}, 0,
-                   WHITE);
-}
-
-static void updateCamera() {
-    game.camera.target = (Vector2){0, 0};
-    game.camera.zoom = MIN((float)game.screenHeight / SCREEN_HEIGHT,
-                           (float)game.screenWidth / SCREEN_WIDTH);
-    game.camera.offset =
-        (Vector2){(game.screenWidth - SCREEN_WIDTH * game.camera.zoom) / 2,
-                  (game.screenHeight - SCREEN_HEIGHT * game.camera.zoom) / 2};
-}
-
-static void drawGame() {
-    drawField();
-    drawBullets();
-    drawTanks();
-    drawFlag();
-    drawForest();
-    drawExplosions();
-    drawScorePopups();
-    drawPowerUps();
-    drawUI();
-    drawStageCurtain();
-    drawGameOver();
-    drawPause();
+    drawSprite(tex, (Rectangle){0, 0, tex->width, tex->height},
+               (Rectangle){centerX(w), centerY(h), w, h}, (Vector2){}, 0,
+               WHITE);
+}
+
+static void updateCamera(Game *game) {
+    game->camera.target = (Vector2){0, 0};
+    game->camera.zoom = MIN((float)game->screenHeight / SCREEN_HEIGHT,
+                            (float)game->screenWidth / SCREEN_WIDTH);
+    game->camera.offset =
+        (Vector2){(game->screenWidth - SCREEN_WIDTH * game->camera.zoom) / 2,
+                  (game->screenHeight - SCREEN_HEIGHT * game->camera.zoom) / 2};
+}
+
+static void drawNetStats(Game *game) {
+    if (game->mode != GMLan || !game->showNetStats) return;
+    Lan *lan = &game->lan;
+    NetStats *stats = &lan->stats;
+    const int fontSize = 14;
+    char lines[8][64];
+    int count = 0;
+    snprintf(lines[count++], 64, "RTT %.1f MS", stats->rtt);
+    snprintf(lines[count++], 64, "IN %ld PK %.1f KB/S", stats->packetsIn,
+             stats->bytesIn / 1e3);
+    snprintf(lines[count++], 64, "OUT %ld PK %.1f KB/S", stats->packetsOut,
+             stats->bytesOut / 1e3);
+    if (lan->lockstep) {
+        snprintf(lines[count++], 64, "%s DELAY %d",
+                 lan->rollback ? "ROLLBACK" : "LOCKSTEP", lan->inputDelay);
+        snprintf(lines[count++], 64, "ROLLBACKS %ld", lan->rollbacks);
+    } else {
+        snprintf(lines[count++], 64, "ZSTD %.1fX %s %.0f US",
+                 stats->compressionRatio,
+                 lan->lanMode == LServer ? "ENCODE" : "DECODE",
+                 stats->codecTime);
+        snprintf(lines[count++], 64, "LOSS %d%% LATE %ld/S",
+                 stats->lossPercent, stats->latePackets);
+        if (lan->lanMode == LServer) {
+            snprintf(lines[count++], 64, "MERGED %ld/S RATE %d HZ",
+                     stats->mergedInputs, TICK_RATE / lan->sendInterval);
+        } else {
+            snprintf(lines[count++], 64, "JITTER %.1f TICKS", lan->jitter);
+        }
+    }
+    int lineHeight = fontSize + 4;
+    DrawRectangle(0, 0, 240, count * lineHeight + 8, (Color){0, 0, 0, 160});
+    for (int i = 0; i < count; i++) {
+        drawText(lines[i], 6, 6 + i * lineHeight, fontSize, WHITE);
+    }
+}
+
+static void drawGame(Game *game) {
+    drawField(game);
+    drawBullets(game);
+    drawTanks(game);
+    drawFlag(game);
+    drawForest(game);
+    drawExplosions(game);
+    drawScorePopups(game);
+    drawPowerUps(game);
+    drawUI(game);
+    drawStageCurtain(game);
+    drawGameOver(game);
+    drawPause(game);
+    drawNetStats(game);
 }
 
 static void loadSounds() {
-    game.sounds.sfx[SFX_BIG_EXPLOSION] = LoadSound("sounds/big_explosion.ogg");
-    game.sounds.sfx[SFX_BULLET_EXPLOSION] =
+    assets.sounds.sfx[SFX_BIG_EXPLOSION] =
+        LoadSound("sounds/big_explosion.ogg");
+    assets.sounds.sfx[SFX_BULLET_EXPLOSION] =
         LoadSound("sounds/bullet_explosion.ogg");
-    game.sounds.sfx[SFX_BULLET_HIT_1] = LoadSound("sounds/bullet_hit_1.ogg");
-    game.sounds.sfx[SFX_BULLET_HIT_2] = LoadSound("sounds/bullet_hit_2.ogg");
-    game.sounds.sfx[SFX_GAME_OVER] = LoadSound("sounds/game_over.ogg");
-    game.sounds.sfx[SFX_GAME_PAUSE] = LoadSound("sounds/game_pause.ogg");
-    game.sounds.sfx[SFX_MODE_SWITCH] = LoadSound("sounds/mode_switch.ogg");
-    game.sounds.sfx[SFX_PLAYER_FIRE] = LoadSound("sounds/player_fire.ogg");
-    game.sounds.sfx[SFX_POWERUP_APPEAR] =
+    assets.sounds.sfx[SFX_BULLET_HIT_1] = LoadSound("sounds/bullet_hit_1.ogg");
+    assets.sounds.sfx[SFX_BULLET_HIT_2] = LoadSound("sounds/bullet_hit_2.ogg");
+    assets.sounds.sfx[SFX_GAME_OVER] = LoadSound("sounds/game_over.ogg");
+    assets.sounds.sfx[SFX_GAME_PAUSE] = LoadSound("sounds/game_pause.ogg");
+    assets.sounds.sfx[SFX_MODE_SWITCH] = LoadSound("sounds/mode_switch.ogg");
+    assets.sounds.sfx[SFX_PLAYER_FIRE] = LoadSound("sounds/player_fire.ogg");
+    assets.sounds.sfx[SFX_POWERUP_APPEAR] =
         LoadSound("sounds/powerup_appear.ogg");
 
-    game.sounds.sfx[SFX_POWERUP_PICK] =
+    assets.sounds.sfx[SFX_POWERUP_PICK] =
         LoadSound("sounds/" ASSETDIR "/powerup_pick." SOUND_EXT);
-    game.sounds.sfx[SFX_START_MENU] =
+    assets.sounds.sfx[SFX_START_MENU] =
         LoadSound("sounds/" ASSETDIR "/start_menu." SOUND_EXT);
 
 #ifdef ALT_ASSETS
@@ -372,96 +498,176 @@ static void loadSounds() {
             char filename[50];
             snprintf(filename, 50, "sounds/soundtrack/soundtrack%d_%d.wav",
                      track, phase);
-            game.sounds.soundtrack[track * 4 + phase] = LoadSound(filename);
+            assets.sounds.soundtrack[track * 4 + phase] = LoadSound(filename);
         }
     }
-    game.sounds.soundtrack[ASIZE(game.sounds.soundtrack) - 1] =
+    assets.sounds.soundtrack[ASIZE(assets.sounds.soundtrack) - 1] =
         LoadSound("sounds/soundtrack/soundtrackDie.wav");
 #endif
 }
 
-static void playSound(Sound sound) {
-    if (!game.mute) PlaySound(sound);
+static void playSound(Game *game, Sound sound) {
+    if (!game->mute) PlaySound(sound);
 }
 
-static void playSfx(SfxType sfx) {
-    playSound(game.sounds.sfx[sfx]);
+static void playSfx(Game *game, SfxType sfx) {
+    playSound(game, assets.sounds.sfx[sfx]);
     for (int i = 0; i < MAX_SFX_PLAYED; i++) {
-        if (game.sfxPlayed[i] == SFX_MAX) {
-            game.sfxPlayed[i] = sfx;
+        if (game->sfxPlayed[i] == SFX_MAX) {
+            game->sfxPlayed[i] = sfx;
             break;
         }
     }
 }
 
+static Sprite packSprite(AtlasPacker *packer, const char *filename) {
+    assert(packer->count < MAX_ATLAS_SPRITES);
+    Image image = LoadImage(filename);
+    if (packer->x + image.width > ATLAS_WIDTH) {
+        packer->x = 0;
+        packer->y += packer->shelfHeight + ATLAS_PADDING;
+        packer->shelfHeight = 0;
+    }
+    Sprite sprite = {packer->x, packer->y, image.width, image.height};
+    packer->x += image.width + ATLAS_PADDING;
+    packer->shelfHeight = MAX(packer->shelfHeight, image.height);
+    packer->images[packer->count] = image;
+    packer->sprites[packer->count++] = sprite;
+    return sprite;
+}
+
+static Texture2D buildAtlas(AtlasPacker *packer) {
+    Image atlas =
+        GenImageColor(ATLAS_WIDTH, packer->y + packer->shelfHeight, BLANK);
+    for (int i = 0; i < packer->count; i++) {
+        Image *image = &packer->images[i];
+        Sprite *sprite = &packer->sprites[i];
+        ImageDraw(&atlas, *image,
+                  (Rectangle){0, 0, image->width, image->height},
+                  (Rectangle){sprite->x, sprite->y, sprite->width,
+                              sprite->height},
+                  WHITE);
+        UnloadImage(*image);
+    }
+    Texture2D tex = LoadTextureFromImage(atlas);
+    UnloadImage(atlas);
+    return tex;
+}
+
+// Every sprite goes into a single atlas texture so consecutive draws batch.
 static void loadTextures() {
-    game.textures.flag = LoadTexture("textures/" ASSETDIR "/flag.png");
-    game.textures.scores = LoadTexture("textures/" ASSETDIR "/scores.png");
-    game.textures.pause = LoadTexture("textures/" ASSETDIR "/pause.png");
-    game.textures.deadFlag = LoadTexture("textures/" ASSETDIR "/deadFlag.png");
-    game.textures.gameOver = LoadTexture("textures/" ASSETDIR "/gameOver.png");
-    game.textures.gameOverCurtain =
-        LoadTexture("textures/" ASSETDIR "/gameOverCurtain.png");
-    game.textures.leftArrow =
-        LoadTexture("textures/" ASSETDIR "/leftArrow.png");
-    game.textures.rightArrow =
-        LoadTexture("textures/" ASSETDIR "/rightArrow.png");
-    game.textures.title = LoadTexture("textures/" ASSETDIR "/title.png");
-    game.textures.shield = LoadTexture("textures/" ASSETDIR "/shield.png");
-    game.textures.powerups = LoadTexture("textures/" ASSETDIR "/powerup.png");
-    game.textures.ui = LoadTexture("textures/" ASSETDIR "/ui.png");
-    game.textures.digits = LoadTexture("textures/" ASSETDIR "/digits.png");
-    game.textures.uiFlag = LoadTexture("textures/" ASSETDIR "/uiFlag.png");
-    game.textures.spawningTank = LoadTexture("textures/" ASSETDIR "/born.png");
-    game.textures.enemies = LoadTexture("textures/" ASSETDIR "/enemies.png");
-    game.textures.enemiesWithPowerUps =
-        LoadTexture("textures/" ASSETDIR "/enemies_with_powerups.png");
-    game.textures.border = LoadTexture("textures/" ASSETDIR "/border.png");
-    game.cellSpecs[CTBorder] =
-        (CellSpec){.texture = &game.textures.border, .isSolid = true};
-    game.textures.brick = LoadTexture("textures/" ASSETDIR "/brick.png");
-    game.cellSpecs[CTBrick] =
-        (CellSpec){.texture = &game.textures.brick, .isSolid = true};
-    game.textures.ice = LoadTexture("textures/" ASSETDIR "/ice.png");
-    game.cellSpecs[CTIce] =
-        (CellSpec){.texture = &game.textures.ice, .isPassable = true};
-    game.textures.concrete = LoadTexture("textures/" ASSETDIR "/concrete.png");
-    game.cellSpecs[CTConcrete] =
-        (CellSpec){.texture = &game.textures.concrete, .isSolid = true};
-    game.textures.forest = LoadTexture("textures/" ASSETDIR "/forest.png");
-    game.cellSpecs[CTForest] =
-        (CellSpec){.texture = &game.textures.forest, .isPassable = true};
-    game.textures.river[0] = LoadTexture("textures/" ASSETDIR "/river1.png");
-    game.textures.river[1] = LoadTexture("textures/" ASSETDIR "/river2.png");
-    game.cellSpecs[CTRiver] = (CellSpec){.texture = &game.textures.river[0]};
-    game.textures.blank = LoadTexture("textures/" ASSETDIR "/blank.png");
-    game.cellSpecs[CTBlank] =
-        (CellSpec){.texture = &game.textures.blank, .isPassable = true};
-    game.textures.player1Tank =
-        LoadTexture("textures/" ASSETDIR "/player1.png");
-    game.textures.player2Tank =
-        LoadTexture("textures/" ASSETDIR "/player2.png");
-    game.textures.bullet = LoadTexture("textures/" ASSETDIR "/bullet.png");
-    game.textures.bulletExplosions[0] =
-        LoadTexture("textures/" ASSETDIR "/bullet_explosion_1.png");
-    game.textures.bulletExplosions[1] =
-        LoadTexture("textures/" ASSETDIR "/bullet_explosion_2.png");
-    game.textures.bulletExplosions[2] =
-        LoadTexture("textures/" ASSETDIR "/bullet_explosion_3.png");
-    game.textures.bigExplosions[0] =
-        LoadTexture("textures/" ASSETDIR "/big_explosion_1.png");
-    game.textures.bigExplosions[1] =
-        LoadTexture("textures/" ASSETDIR "/big_explosion_2.png");
-    game.textures.bigExplosions[2] =
-        LoadTexture("textures/" ASSETDIR "/big_explosion_3.png");
-    game.textures.bigExplosions[3] =
-        LoadTexture("textures/" ASSETDIR "/big_explosion_4.png");
-    game.textures.bigExplosions[4] =
-        LoadTexture("textures/" ASSETDIR "/big_explosion_5.png");
-    game.textures.lan = LoadTexture("textures/" ASSETDIR "/lan.png");
-}
-
-static void loadStage(int stage) {
+    static AtlasPacker packer;
+    packer = (AtlasPacker){};
+    assets.textures.flag =
+        packSprite(&packer, "textures/" ASSETDIR "/flag.png");
+    assets.textures.scores =
+        packSprite(&packer, "textures/" ASSETDIR "/scores.png");
+    assets.textures.pause =
+        packSprite(&packer, "textures/" ASSETDIR "/pause.png");
+    assets.textures.deadFlag =
+        packSprite(&packer, "textures/" ASSETDIR "/deadFlag.png");
+    assets.textures.gameOver =
+        packSprite(&packer, "textures/" ASSETDIR "/gameOver.png");
+    assets.textures.gameOverCurtain =
+        packSprite(&packer, "textures/" ASSETDIR "/gameOverCurtain.png");
+    assets.textures.leftArrow =
+        packSprite(&packer, "textures/" ASSETDIR "/leftArrow.png");
+    assets.textures.rightArrow =
+        packSprite(&packer, "textures/" ASSETDIR "/rightArrow.png");
+    assets.textures.title =
+        packSprite(&packer, "textures/" ASSETDIR "/title.png");
+    assets.textures.shield =
+        packSprite(&packer, "textures/" ASSETDIR "/shield.png");
+    assets.textures.powerups =
+        packSprite(&packer, "textures/" ASSETDIR "/powerup.png");
+    assets.textures.ui = packSprite(&packer, "textures/" ASSETDIR "/ui.png");
+    assets.textures.digits =
+        packSprite(&packer, "textures/" ASSETDIR "/digits.png");
+    assets.textures.uiFlag =
+        packSprite(&packer, "textures/" ASSETDIR "/uiFlag.png");
+    assets.textures.spawningTank =
+        packSprite(&packer, "textures/" ASSETDIR "/born.png");
+    assets.textures.enemies =
+        packSprite(&packer, "textures/" ASSETDIR "/enemies.png");
+    assets.textures.enemiesWithPowerUps =
+        packSprite(&packer, "textures/" ASSETDIR "/enemies_with_powerups.png");
+    assets.textures.border =
+        packSprite(&packer, "textures/" ASSETDIR "/border.png");
+    assets.textures.brick =
+        packSprite(&packer, "textures/" ASSETDIR "/brick.png");
+    assets.textures.ice = packSprite(&packer, "textures/" ASSETDIR "/ice.png");
+    assets.textures.concrete =
+        packSprite(&packer, "textures/" ASSETDIR "/concrete.png");
+    assets.textures.forest =
+        packSprite(&packer, "textures/" ASSETDIR "/forest.png");
+    assets.textures.river[0] =
+        packSprite(&packer, "textures/" ASSETDIR "/river1.png");
+    assets.textures.river[1] =
+        packSprite(&packer, "textures/" ASSETDIR "/river2.png");
+    assets.textures.blank =
+        packSprite(&packer, "textures/" ASSETDIR "/blank.png");
+    assets.textures.player1Tank =
+        packSprite(&packer, "textures/" ASSETDIR "/player1.png");
+    assets.textures.player2Tank =
+        packSprite(&packer, "textures/" ASSETDIR "/player2.png");
+    assets.textures.bullet =
+        packSprite(&packer, "textures/" ASSETDIR "/bullet.png");
+    assets.textures.bulletExplosions[0] =
+        packSprite(&packer, "textures/" ASSETDIR "/bullet_explosion_1.png");
+    assets.textures.bulletExplosions[1] =
+        packSprite(&packer, "textures/" ASSETDIR "/bullet_explosion_2.png");
+    assets.textures.bulletExplosions[2] =
+        packSprite(&packer, "textures/" ASSETDIR "/bullet_explosion_3.png");
+    assets.textures.bigExplosions[0] =
+        packSprite(&packer, "textures/" ASSETDIR "/big_explosion_1.png");
+    assets.textures.bigExplosions[1] =
+        packSprite(&packer, "textures/" ASSETDIR "/big_explosion_2.png");
+    assets.textures.bigExplosions[2] =
+        packSprite(&packer, "textures/" ASSETDIR "/big_explosion_3.png");
+    assets.textures.bigExplosions[3] =
+        packSprite(&packer, "textures/" ASSETDIR "/big_explosion_4.png");
+    assets.textures.bigExplosions[4] =
+        packSprite(&packer, "textures/" ASSETDIR "/big_explosion_5.png");
+    assets.textures.lan = packSprite(&packer, "textures/" ASSETDIR "/lan.png");
+    assets.atlas = buildAtlas(&packer);
+}
+
+static void setMaskBit(FieldMask *mask, int row, int col, bool isSet) {
+    if (isSet) {
+        mask->rows[row] |= 1ULL << col;
+        mask->cols[col] |= 1ULL << row;
+    } else {
+        mask->rows[row] &= ~(1ULL << col);
+        mask->cols[col] &= ~(1ULL << row);
+    }
+}
+
+static void updateCellMasks(Game *game, int row, int col) {
+    CellType type = game->field[row][col].type;
+    setMaskBit(&game->solidCells, row, col, game->cellSpecs[type].isSolid);
+    setMaskBit(&game->passableCells, row, col,
+               game->cellSpecs[type].isPassable);
+    setMaskBit(&game->iceCells, row, col, type == CTIce);
+    setMaskBit(&game->forestCells, row, col, type == CTForest);
+}
+
+// All cell type changes go through here to keep the field masks in sync and
+// get the cell redrawn.
+static void setCellType(Game *game, int row, int col, CellType type) {
+    game->field[row][col].type = type;
+    updateCellMasks(game, row, col);
+    setMaskBit(&game->dirtyCells, row, col, true);
+}
+
+static void rebuildFieldMasks(Game *game) {
+    for (int i = 0; i < FIELD_ROWS; i++) {
+        for (int j = 0; j < FIELD_COLS; j++) {
+            updateCellMasks(game, i, j);
+        }
+    }
+}
+
+static void loadStage(Game *game, int stage) {
     char filename[50];
     snprintf(filename, 50, "levels/stage%.2d", stage);
     Buffer buf = readFile(filename);
@@ -470,37 +676,39 @@ static void loadStage(int stage) {
         for (int j = 0; j < FIELD_COLS; j++) {
             if (i <= 1 || i >= FIELD_ROWS - 2 || j <= 3 ||
                 j >= FIELD_COLS - 8) {
-                game.field[i][j].type = CTBorder;
-                game.field[i][j].texRow = 0;
-                game.field[i][j].texCol = 0;
+                setCellType(game, i, j, CTBorder);
+                game->field[i][j].texRow = 0;
+                game->field[i][j].texCol = 0;
                 continue;
             }
-            game.field[i][j].type = buf.bytes[ci];
+            setCellType(game, i, j, buf.bytes[ci]);
             char texNumber = buf.bytes[ci + 1];
-            game.field[i][j].texRow = texNumber < 2 ? 0 : 1;
-            game.field[i][j].texCol = texNumber % 2;
+            game->field[i][j].texRow = texNumber < 2 ? 0 : 1;
+            game->field[i][j].texCol = texNumber % 2;
             ci += 2;
         }
     }
+    free(buf.bytes);
 }
 
-static void initUIElements() {
-    game.uiElements[UIFlag] =
+static void initUIElements(Game *game) {
+    game->uiElements[UIFlag] =
         (UIElement){.isVisible = true,
-                    .texture = &game.textures.uiFlag,
-                    .textureSrc = (Rectangle){0, 0, game.textures.uiFlag.width,
-                                              game.textures.uiFlag.height},
+                    .texture = &assets.textures.uiFlag,
+                    .textureSrc =
+                        (Rectangle){0, 0, assets.textures.uiFlag.width,
+                                    assets.textures.uiFlag.height},
                     .pos =
                         (Vector2){
                             (14 * 4 + 2) * CELL_SIZE,
                             (11 * 4 * CELL_SIZE),
                         },
                     .size = (Vector2){CELL_SIZE * 4, CELL_SIZE * 4},
-                    .drawSize = (Vector2){game.textures.uiFlag.width * 2,
-                                          game.textures.uiFlag.height * 2}};
-    game.uiElements[UIPlayer1] =
+                    .drawSize = (Vector2){assets.textures.uiFlag.width * 2,
+                                          assets.textures.uiFlag.height * 2}};
+    game->uiElements[UIPlayer1] =
         (UIElement){.isVisible = true,
-                    .texture = &game.textures.ui,
+                    .texture = &assets.textures.ui,
                     .textureSrc = (Rectangle){28, 0, 28, 14},
                     .pos =
                         (Vector2){
@@ -509,9 +717,9 @@ static void initUIElements() {
                         },
                     .size = (Vector2){14 * 4, 14 * 2},
                     .drawSize = (Vector2){14 * 4, 14 * 2}};
-    game.uiElements[UIP1Tank] =
+    game->uiElements[UIP1Tank] =
         (UIElement){.isVisible = true,
-                    .texture = &game.textures.ui,
+                    .texture = &assets.textures.ui,
                     .textureSrc = (Rectangle){14, 0, 14, 14},
                     .pos =
                         (Vector2){
@@ -520,10 +728,10 @@ static void initUIElements() {
                         },
                     .size = (Vector2){CELL_SIZE * 2, CELL_SIZE * 2},
                     .drawSize = (Vector2){14 * 2, 14 * 2}};
-    game.uiElements[UIP1Lifes] =
+    game->uiElements[UIP1Lifes] =
         (UIElement){.isVisible = true,
-                    .texture = &game.textures.digits,
-                    .textureSrc = digitTextureRect(game.tanks[0].lifes),
+                    .texture = &assets.textures.digits,
+                    .textureSrc = digitTextureRect(game->tanks[0].lifes),
                     .pos =
                         (Vector2){
                             (15 * 4) * CELL_SIZE,
@@ -531,10 +739,10 @@ static void initUIElements() {
                         },
                     .size = (Vector2){CELL_SIZE * 2, CELL_SIZE * 2},
                     .drawSize = (Vector2){CELL_SIZE * 2, CELL_SIZE * 2}};
-    game.uiElements[UIStageLowDigit] =
+    game->uiElements[UIStageLowDigit] =
         (UIElement){.isVisible = true,
-                    .texture = &game.textures.digits,
-                    .textureSrc = digitTextureRect(game.stage % 10),
+                    .texture = &assets.textures.digits,
+                    .textureSrc = digitTextureRect(game->stage % 10),
                     .pos =
                         (Vector2){
                             (16 * 4 - 4) * CELL_SIZE,
@@ -542,11 +750,11 @@ static void initUIElements() {
                         },
                     .size = (Vector2){CELL_SIZE * 2, CELL_SIZE * 2},
                     .drawSize = (Vector2){CELL_SIZE * 2, CELL_SIZE * 2}};
-    if (game.stage / 10) {
-        game.uiElements[UIStageHiDigit] =
+    if (game->stage / 10) {
+        game->uiElements[UIStageHiDigit] =
             (UIElement){.isVisible = true,
-                        .texture = &game.textures.digits,
-                        .textureSrc = digitTextureRect(game.stage / 10),
+                        .texture = &assets.textures.digits,
+                        .textureSrc = digitTextureRect(game->stage / 10),
                         .pos =
                             (Vector2){
                                 (16 * 4 - 6) * CELL_SIZE,
@@ -555,10 +763,10 @@ static void initUIElements() {
                         .size = (Vector2){CELL_SIZE * 2, CELL_SIZE * 2},
                         .drawSize = (Vector2){CELL_SIZE * 2, CELL_SIZE * 2}};
     }
-    if (game.mode == GMTwoPlayers || game.mode == GMLan) {
-        game.uiElements[UIPlayer2] =
+    if (game->mode == GMTwoPlayers || game->mode == GMLan) {
+        game->uiElements[UIPlayer2] =
             (UIElement){.isVisible = true,
-                        .texture = &game.textures.ui,
+                        .texture = &assets.textures.ui,
                         .textureSrc = (Rectangle){56, 0, 28, 14},
                         .pos =
                             (Vector2){
@@ -567,9 +775,9 @@ static void initUIElements() {
                             },
                         .size = (Vector2){14 * 4, 14 * 2},
                         .drawSize = (Vector2){14 * 4, 14 * 2}};
-        game.uiElements[UIP2Tank] =
+        game->uiElements[UIP2Tank] =
             (UIElement){.isVisible = true,
-                        .texture = &game.textures.ui,
+                        .texture = &assets.textures.ui,
                         .textureSrc = (Rectangle){14, 0, 14, 14},
                         .pos =
                             (Vector2){
@@ -578,10 +786,10 @@ static void initUIElements() {
                             },
                         .size = (Vector2){CELL_SIZE * 2, CELL_SIZE * 2},
                         .drawSize = (Vector2){14 * 2, 14 * 2}};
-        game.uiElements[UIP2Lifes] =
+        game->uiElements[UIP2Lifes] =
             (UIElement){.isVisible = true,
-                        .texture = &game.textures.digits,
-                        .textureSrc = digitTextureRect(game.tanks[1].lifes),
+                        .texture = &assets.textures.digits,
+                        .textureSrc = digitTextureRect(game->tanks[1].lifes),
                         .pos =
                             (Vector2){
                                 (15 * 4) * CELL_SIZE,
@@ -592,8 +800,65 @@ static void initUIElements() {
     }
 }
 
-static void spawnPlayer(Tank *t, bool resetTier) {
+static GridSpan gridSpan(int x, int y, int w, int h) {
+    return (GridSpan){
+        .minRow = MAX(0, MIN(y / TANK_GRID_CELL_SIZE, TANK_GRID_ROWS - 1)),
+        .minCol = MAX(0, MIN(x / TANK_GRID_CELL_SIZE, TANK_GRID_COLS - 1)),
+        .maxRow =
+            MAX(0, MIN((y + h - 1) / TANK_GRID_CELL_SIZE, TANK_GRID_ROWS - 1)),
+        .maxCol =
+            MAX(0, MIN((x + w - 1) / TANK_GRID_CELL_SIZE, TANK_GRID_COLS - 1))};
+}
+
+static void setTankGridBits(Game *game, GridSpan span, u64 bit, bool isSet) {
+    for (int r = span.minRow; r <= span.maxRow; r++) {
+        for (int c = span.minCol; c <= span.maxCol; c++) {
+            if (isSet) {
+                game->tankGrid[r][c] |= bit;
+            } else {
+                game->tankGrid[r][c] &= ~bit;
+            }
+        }
+    }
+}
+
+// Tanks are kept in the grid whatever their status; queries filter on it.
+static void updateTankGrid(Game *game, Tank *t) {
+    int i = t - game->tanks;
+    GridSpan old = game->tankGridSpans[i];
+    GridSpan span = gridSpan(t->pos.x, t->pos.y, TANK_SIZE, TANK_SIZE);
+    if (!memcmp(&old, &span, sizeof(span))) return;
+    setTankGridBits(game, old, 1ULL << i, false);
+    setTankGridBits(game, span, 1ULL << i, true);
+    game->tankGridSpans[i] = span;
+}
+
+static void rebuildTankGrid(Game *game) {
+    memset(game->tankGrid, 0, sizeof(game->tankGrid));
+    for (int i = 0; i < MAX_TANK_COUNT; i++) {
+        Tank *t = &game->tanks[i];
+        game->tankGridSpans[i] =
+            gridSpan(t->pos.x, t->pos.y, TANK_SIZE, TANK_SIZE);
+        setTankGridBits(game, game->tankGridSpans[i], 1ULL << i, true);
+    }
+}
+
+// Tanks in the buckets overlapped by the box, as a mask of tank indices.
+static u64 tanksNear(Game *game, int x, int y, int w, int h) {
+    GridSpan span = gridSpan(x, y, w, h);
+    u64 res = 0;
+    for (int r = span.minRow; r <= span.maxRow; r++) {
+        for (int c = span.minCol; c <= span.maxCol; c++) {
+            res |= game->tankGrid[r][c];
+        }
+    }
+    return res;
+}
+
+static void spawnPlayer(Game *game, Tank *t, bool resetTier) {
     t->pos = t->type == TPlayer1 ? PLAYER1_START_POS : PLAYER2_START_POS;
+    t->prevPos = t->pos;
+    updateTankGrid(game, t);
     t->direction = DUp;
     t->status = TSSpawning;
     t->shieldTimeLeft = 4;
@@ -602,9 +867,9 @@ static void spawnPlayer(Tank *t, bool resetTier) {
     t->isMoving = false;
     if (resetTier) {
         t->tier = 0;
-        game.tankSpecs[t->type].bulletSpeed = BULLET_SPEEDS[0];
-        game.tankSpecs[t->type].maxBulletCount = 1;
-        game.tankSpecs[t->type].texRow = 0;
+        game->tankSpecs[t->type].bulletSpeed = BULLET_SPEEDS[0];
+        game->tankSpecs[t->type].maxBulletCount = 1;
+        game->tankSpecs[t->type].texRow = 0;
     }
 }
 
@@ -648,64 +913,83 @@ static TankType levelTanks[LEVEL_COUNT][MAX_ENEMY_COUNT] = {
     // clang-format on
 };
 
-static void initStage(char stage) {
-    game.stage = stage;
-    game.gameOverTime = 0;
-    game.stageEndTime = 0;
-    game.timerPowerUpTimeLeft = 0;
-    game.shovelPowerUpTimeLeft = 0;
-    game.stageCurtainTime = 0;
-    game.isStageCurtainSoundPlayed = false;
+// Rebuilds the active and free lists from the slots, e.g. after a snapshot
+// has overwritten them.
+static void rebuildBulletLists(Game *game) {
+    game->activeBulletCount = 0;
+    game->freeBulletCount = 0;
+    for (int i = MAX_BULLET_COUNT - 1; i >= 0; i--) {
+        if (game->bullets[i].type == BTNone) {
+            game->freeBullets[game->freeBulletCount++] = i;
+        } else {
+            game->activeBullets[game->activeBulletCount++] = i;
+        }
+    }
+}
+
+static void initStage(Game *game, char stage) {
+    game->stage = stage;
+    game->gameOverTime = 0;
+    game->stageEndTime = 0;
+    game->timerPowerUpTimeLeft = 0;
+    game->shovelPowerUpTimeLeft = 0;
+    game->stageCurtainTime = 0;
+    game->isStageCurtainSoundPlayed = false;
     for (int i = 0; i < FIELD_ROWS; i++) {
         for (int j = 0; j < FIELD_COLS; j++) {
-            game.field[i][j] =
+            game->field[i][j] =
                 (Cell){.type = CTBlank,
                        .pos = (Vector2){j * CELL_SIZE, i * CELL_SIZE}};
         }
     }
-    loadStage(game.stage);
-    spawnPlayer(&game.tanks[TPlayer1], false);
-    if (game.mode == GMTwoPlayers || game.mode == GMLan) {
-        spawnPlayer(&game.tanks[TPlayer2], false);
+    loadStage(game, game->stage);
+    spawnPlayer(game, &game->tanks[TPlayer1], false);
+    if (game->mode == GMTwoPlayers || game->mode == GMLan) {
+        spawnPlayer(game, &game->tanks[TPlayer2], false);
     }
     static char startingCols[3] = {4, 4 + (FIELD_COLS - 12) / 4 / 2 * 4,
                                    FIELD_COLS - 8 - 4};
     for (int i = 0; i < MAX_ENEMY_COUNT; i++) {
         TankType type = levelTanks[stage - 1][i];
-        game.tanks[i + 2] = (Tank){
+        Vector2 pos = {CELL_SIZE * startingCols[i % 3], CELL_SIZE * 2};
+        game->tanks[i + 2] = (Tank){
             .type = type,
-            .pos = (Vector2){CELL_SIZE * startingCols[i % 3], CELL_SIZE * 2},
+            .pos = pos,
+            .prevPos = pos,
             .direction = DDown,
             .status = TSPending,
             .isMoving = true,
-            .lifes = game.tankSpecs[type].lifes};
+            .lifes = game->tankSpecs[type].lifes};
         if (i + 1 == 4)
-            game.tanks[i + 2].powerUp = &game.powerUps[0];
+            game->tanks[i + 2].powerUp = &game->powerUps[0];
         else if (i + 1 == 11)
-            game.tanks[i + 2].powerUp = &game.powerUps[1];
+            game->tanks[i + 2].powerUp = &game->powerUps[1];
         else if (i + 1 == 18)
-            game.tanks[i + 2].powerUp = &game.powerUps[2];
+            game->tanks[i + 2].powerUp = &game->powerUps[2];
     }
     for (int i = 0; i < MAX_POWERUP_COUNT; i++) {
-        game.powerUps[i] = (PowerUp){
-            .type = rand() % PUMax,
-            .pos = POWERUP_POSITIONS[rand() % POWERUP_POSITIONS_COUNT],
+        game->powerUps[i] = (PowerUp){
+            .type = nextRandom(&game->rng) % PUMax,
+            .pos = POWERUP_POSITIONS[nextRandom(&game->rng) %
+                                     POWERUP_POSITIONS_COUNT],
             .state = PUSPending};
     }
-    memset(game.bullets, 0, sizeof(game.bullets));
-    memset(game.explosions, 0, sizeof(game.explosions));
-    game.pendingEnemyCount = MAX_ENEMY_COUNT;
-    game.maxActiveEnemyCount = 8;
-    game.timeSinceSpawn = ENEMY_SPAWN_INTERVAL;
-    game.activeEnemyCount = 0;
-    initUIElements();
+    memset(game->bullets, 0, sizeof(game->bullets));
+    rebuildBulletLists(game);
+    rebuildTankGrid(game);
+    memset(game->explosions, 0, sizeof(game->explosions));
+    game->pendingEnemyCount = MAX_ENEMY_COUNT;
+    game->maxActiveEnemyCount = 8;
+    game->timeSinceSpawn = ENEMY_SPAWN_INTERVAL;
+    game->activeEnemyCount = 0;
+    initUIElements(game);
 }
 
-static void loadHiScore() {
+static void loadHiScore(Game *game) {
     const char *filename = "hiscore";
     FILE *f = fopen(filename, "rb");
     if (!f) {
-        game.hiScore = 0;
+        game->hiScore = 0;
         return;
     }
     fclose(f);
@@ -714,49 +998,114 @@ static void loadHiScore() {
         fprintf(stderr, "Cannot read hiscore");
         exit(1);
     }
-    game.hiScore = (u32)b.bytes[0] | ((u32)b.bytes[1] << 8) |
-                   ((u32)b.bytes[2] << 16) | ((u32)b.bytes[3] << 24);
-}
-
-static void initGameRun() {
-    saveHiScore();
-    game.isFlagDead = false;
-    game.tick = 0;
-    game.lan.timeout = 0;
-    game.tanks[TPlayer1] = (Tank){.type = TPlayer1, .lifes = 2};
-    game.tanks[TPlayer2] = (Tank){.type = TPlayer2, .lifes = 2};
-    game.tankSpecs[TPlayer1] = (TankSpec){.texture = &game.textures.player1Tank,
-                                          .texRow = 0,
-                                          .bulletSpeed = BULLET_SPEEDS[0],
-                                          .maxBulletCount = 1,
-                                          .speed = PLAYER_SPEED};
-    game.tankSpecs[TPlayer2] = (TankSpec){.texture = &game.textures.player2Tank,
-                                          .texRow = 0,
-                                          .bulletSpeed = BULLET_SPEEDS[0],
-                                          .maxBulletCount = 1,
-                                          .speed = PLAYER_SPEED};
-    game.isDieSoundtrackPlayed = false;
-    memset(game.playerScores, 0, sizeof(game.playerScores));
-}
-
-static void initGame() {
-    loadHiScore();
-    loadTextures();
-    loadSounds();
-    game.font = LoadFontEx("fonts/7x7.ttf", 56, NULL, 0);
-    game.explosionAnimations[ETBullet] =
+    game->hiScore = (u32)b.bytes[0] | ((u32)b.bytes[1] << 8) |
+                    ((u32)b.bytes[2] << 16) | ((u32)b.bytes[3] << 24);
+}
+
+// Per session state of one LAN connection, on either side.
+static void resetLanSession(Lan *lan) {
+    lan->ackedTick = 0;
+    lan->streamSequence = 0;
+    lan->streamSynced = false;
+    lan->inputTick = 0;
+    lan->receivedInputTick = 0;
+    lan->minInputBacklog = 0;
+    lan->clientInput = (InputFrame){};
+    memset(lan->inputHistory, 0, sizeof(lan->inputHistory));
+    lan->latestTick = 0;
+    lan->clientTick = 0;
+    lan->transit = 0;
+    lan->jitter = 0;
+    lan->snapshotInterval = 1;
+    lan->renderTick = 0;
+    int netRate = lan->netRate ? lan->netRate : NET_TICK_RATE;
+    lan->minSendInterval =
+        MAX(1, MIN(TICK_RATE / netRate, TICK_RATE / MIN_NET_RATE));
+    lan->sendInterval = lan->minSendInterval;
+    lan->nextSendTick = 0;
+    lan->lastRateChangeTick = 0;
+    lan->reportedLoss = 0;
+    for (int i = 0; i < MAX_SFX_PLAYED; i++) {
+        lan->pendingSfx[i] = SFX_MAX;
+    }
+    lan->hasSequence = false;
+    lan->windowExpected = 0;
+    lan->windowReceived = 0;
+    lan->lossPercent = 0;
+    lan->pendingInput = (InputFrame){};
+    memset(lan->peerInputHistory, 0, sizeof(lan->peerInputHistory));
+    lan->hashTick = 0;
+    lan->hash = 0;
+    lan->peerHashTick = 0;
+    lan->peerHash = 0;
+    lan->peerAckTick = 0;
+    memset(lan->predictedInput, 0, sizeof(lan->predictedInput));
+    lan->confirmedTick = 0;
+    lan->rollbackTick = LONG_MAX;
+    lan->pendingHashTick = 0;
+    lan->rollbacks = 0;
+    lan->replayedTicks = 0;
+    lan->timeout = 0;
+}
+
+static void initGameRun(Game *game) {
+    saveHiScore(game);
+    game->isFlagDead = false;
+    game->tick = 0;
+    resetLanSession(&game->lan);
+    game->tanks[TPlayer1] = (Tank){.type = TPlayer1, .lifes = 2};
+    game->tanks[TPlayer2] = (Tank){.type = TPlayer2, .lifes = 2};
+    game->tankSpecs[TPlayer1] =
+        (TankSpec){.texture = &assets.textures.player1Tank,
+                   .texRow = 0,
+                   .bulletSpeed = BULLET_SPEEDS[0],
+                   .maxBulletCount = 1,
+                   .speed = PLAYER_SPEED};
+    game->tankSpecs[TPlayer2] =
+        (TankSpec){.texture = &assets.textures.player2Tank,
+                   .texRow = 0,
+                   .bulletSpeed = BULLET_SPEEDS[0],
+                   .maxBulletCount = 1,
+                   .speed = PLAYER_SPEED};
+    game->isDieSoundtrackPlayed = false;
+    memset(game->playerScores, 0, sizeof(game->playerScores));
+}
+
+static void initGame(Game *game) {
+    game->frameTime = TICK_TIME;
+    loadHiScore(game);
+    if (!game->headless) {
+        loadTextures();
+        loadSounds();
+        assets.font = LoadFontEx("fonts/7x7.ttf", 56, NULL, 0);
+        loadFieldLayers();
+    }
+    game->cellSpecs[CTBorder] =
+        (CellSpec){.texture = &assets.textures.border, .isSolid = true};
+    game->cellSpecs[CTBrick] =
+        (CellSpec){.texture = &assets.textures.brick, .isSolid = true};
+    game->cellSpecs[CTIce] =
+        (CellSpec){.texture = &assets.textures.ice, .isPassable = true};
+    game->cellSpecs[CTConcrete] =
+        (CellSpec){.texture = &assets.textures.concrete, .isSolid = true};
+    game->cellSpecs[CTForest] =
+        (CellSpec){.texture = &assets.textures.forest, .isPassable = true};
+    game->cellSpecs[CTRiver] = (CellSpec){.texture = &assets.textures.river[0]};
+    game->cellSpecs[CTBlank] =
+        (CellSpec){.texture = &assets.textures.blank, .isPassable = true};
+    game->explosionAnimations[ETBullet] =
         (Animation){.duration = BULLET_EXPLOSION_TTL,
-                    .textureCount = ASIZE(game.textures.bulletExplosions),
-                    .textures = &game.textures.bulletExplosions[0]};
-    game.explosionAnimations[ETBig] =
+                    .textureCount = ASIZE(assets.textures.bulletExplosions),
+                    .textures = &assets.textures.bulletExplosions[0]};
+    game->explosionAnimations[ETBig] =
         (Animation){.duration = BIG_EXPLOSION_TTL,
-                    .textureCount = ASIZE(game.textures.bigExplosions),
-                    .textures = &game.textures.bigExplosions[0]};
-    game.flagPos = (Vector2){CELL_SIZE * ((FIELD_COLS - 12) / 2 - 2 + 4),
-                             CELL_SIZE * (FIELD_ROWS - 4 - 2)};
-    game.tankSpecs[TBasic] =
-        (TankSpec){.texture = &game.textures.enemies,
-                   .powerUpTexture = &game.textures.enemiesWithPowerUps,
+                    .textureCount = ASIZE(assets.textures.bigExplosions),
+                    .textures = &assets.textures.bigExplosions[0]};
+    game->flagPos = (Vector2){CELL_SIZE * ((FIELD_COLS - 12) / 2 - 2 + 4),
+                              CELL_SIZE * (FIELD_ROWS - 4 - 2)};
+    game->tankSpecs[TBasic] =
+        (TankSpec){.texture = &assets.textures.enemies,
+                   .powerUpTexture = &assets.textures.enemiesWithPowerUps,
                    .texRow = 0,
                    .speed = ENEMY_SPEEDS[0],
                    .bulletSpeed = BULLET_SPEEDS[0],
@@ -764,9 +1113,9 @@ static void initGame() {
                    .points = 100,
                    .lifes = 1,
                    .isEnemy = true};
-    game.tankSpecs[TFast] =
-        (TankSpec){.texture = &game.textures.enemies,
-                   .powerUpTexture = &game.textures.enemiesWithPowerUps,
+    game->tankSpecs[TFast] =
+        (TankSpec){.texture = &assets.textures.enemies,
+                   .powerUpTexture = &assets.textures.enemiesWithPowerUps,
                    .texRow = 1,
                    .speed = ENEMY_SPEEDS[2],
                    .maxBulletCount = 1,
@@ -774,9 +1123,9 @@ static void initGame() {
                    .points = 200,
                    .lifes = 1,
                    .isEnemy = true};
-    game.tankSpecs[TPower] =
-        (TankSpec){.texture = &game.textures.enemies,
-                   .powerUpTexture = &game.textures.enemiesWithPowerUps,
+    game->tankSpecs[TPower] =
+        (TankSpec){.texture = &assets.textures.enemies,
+                   .powerUpTexture = &assets.textures.enemiesWithPowerUps,
                    .texRow = 2,
                    .speed = ENEMY_SPEEDS[1],
                    .bulletSpeed = BULLET_SPEEDS[2],
@@ -784,9 +1133,9 @@ static void initGame() {
                    .points = 300,
                    .lifes = 1,
                    .isEnemy = true};
-    game.tankSpecs[TArmor] =
-        (TankSpec){.texture = &game.textures.enemies,
-                   .powerUpTexture = &game.textures.enemiesWithPowerUps,
+    game->tankSpecs[TArmor] =
+        (TankSpec){.texture = &assets.textures.enemies,
+                   .powerUpTexture = &assets.textures.enemiesWithPowerUps,
                    .texRow = 3,
                    .speed = ENEMY_SPEEDS[1],
                    .bulletSpeed = BULLET_SPEEDS[1],
@@ -794,71 +1143,69 @@ static void initGame() {
                    .points = 400,
                    .lifes = 4,
                    .isEnemy = true};
-    game.powerUpSpecs[PUTank] =
-        (PowerUpSpec){.texture = &game.textures.powerups, .texCol = 0};
-    game.powerUpSpecs[PUTimer] =
-        (PowerUpSpec){.texture = &game.textures.powerups, .texCol = 1};
-    game.powerUpSpecs[PUShovel] =
-        (PowerUpSpec){.texture = &game.textures.powerups, .texCol = 2};
-    game.powerUpSpecs[PUGrenade] =
-        (PowerUpSpec){.texture = &game.textures.powerups, .texCol = 3};
-    game.powerUpSpecs[PUStar] =
-        (PowerUpSpec){.texture = &game.textures.powerups, .texCol = 4};
-    game.powerUpSpecs[PUShield] =
-        (PowerUpSpec){.texture = &game.textures.powerups, .texCol = 5};
-}
-
-static void fireBullet(Tank *t) {
-    if (t->firedBulletCount >= game.tankSpecs[t->type].maxBulletCount) return;
+    game->powerUpSpecs[PUTank] =
+        (PowerUpSpec){.texture = &assets.textures.powerups, .texCol = 0};
+    game->powerUpSpecs[PUTimer] =
+        (PowerUpSpec){.texture = &assets.textures.powerups, .texCol = 1};
+    game->powerUpSpecs[PUShovel] =
+        (PowerUpSpec){.texture = &assets.textures.powerups, .texCol = 2};
+    game->powerUpSpecs[PUGrenade] =
+        (PowerUpSpec){.texture = &assets.textures.powerups, .texCol = 3};
+    game->powerUpSpecs[PUStar] =
+        (PowerUpSpec){.texture = &assets.textures.powerups, .texCol = 4};
+    game->powerUpSpecs[PUShield] =
+        (PowerUpSpec){.texture = &assets.textures.powerups, .texCol = 5};
+}
+
+static void fireBullet(Game *game, Tank *t) {
+    if (t->firedBulletCount >= game->tankSpecs[t->type].maxBulletCount) return;
     t->firedBulletCount++;
-    if (!isEnemy(t)) {
-        playSfx(SFX_PLAYER_FIRE);
+    if (!isEnemy(game, t)) {
+        playSfx(game, SFX_PLAYER_FIRE);
     }
-    for (int i = 0; i < MAX_BULLET_COUNT; i++) {
-        Bullet *b = &game.bullets[i];
-        if (b->type != BTNone) {
-            assert(i != MAX_BULLET_COUNT - 1);
-            continue;
-        }
-        b->type = BTTank;
-        b->direction = t->direction;
-        b->tank = t;
-        short bulletSpeed = game.tankSpecs[t->type].bulletSpeed;
-        switch (b->direction) {
-            case DRight:
-                b->pos = (Vector2){t->pos.x + TANK_SIZE - BULLET_SIZE,
-                                   t->pos.y + TANK_SIZE / 2 - BULLET_SIZE / 2};
-                b->speed = (Vector2){bulletSpeed, 0};
-                break;
-            case DLeft:
-                b->pos = (Vector2){t->pos.x,
-                                   t->pos.y + TANK_SIZE / 2 - BULLET_SIZE / 2};
-                b->speed = (Vector2){-bulletSpeed, 0};
-                break;
-            case DUp:
-                b->pos = (Vector2){t->pos.x + TANK_SIZE / 2 - BULLET_SIZE / 2,
-                                   t->pos.y};
-                b->speed = (Vector2){0, -bulletSpeed};
-                break;
-            case DDown:
-                b->pos = (Vector2){t->pos.x + TANK_SIZE / 2 - BULLET_SIZE / 2,
-                                   t->pos.y + TANK_SIZE - BULLET_SIZE};
-                b->speed = (Vector2){0, bulletSpeed};
-                break;
-        }
-        break;
+    assert(game->freeBulletCount > 0);
+    u8 slot = game->freeBullets[--game->freeBulletCount];
+    game->activeBullets[game->activeBulletCount++] = slot;
+    Bullet *b = &game->bullets[slot];
+    b->type = BTTank;
+    b->direction = t->direction;
+    b->tank = t;
+    short bulletSpeed = game->tankSpecs[t->type].bulletSpeed;
+    switch (b->direction) {
+        case DRight:
+            b->pos = (Vector2){t->pos.x + TANK_SIZE - BULLET_SIZE,
+                               t->pos.y + TANK_SIZE / 2 - BULLET_SIZE / 2};
+            b->speed = (Vector2){bulletSpeed, 0};
+            break;
+        case DLeft:
+            b->pos = (Vector2){t->pos.x,
+                               t->pos.y + TANK_SIZE / 2 - BULLET_SIZE / 2};
+            b->speed = (Vector2){-bulletSpeed, 0};
+            break;
+        case DUp:
+            b->pos = (Vector2){t->pos.x + TANK_SIZE / 2 - BULLET_SIZE / 2,
+                               t->pos.y};
+            b->speed = (Vector2){0, -bulletSpeed};
+            break;
+        case DDown:
+            b->pos = (Vector2){t->pos.x + TANK_SIZE / 2 - BULLET_SIZE / 2,
+                               t->pos.y + TANK_SIZE - BULLET_SIZE};
+            b->speed = (Vector2){0, bulletSpeed};
+            break;
     }
+    b->prevPos = b->pos;
 }
 
-static bool checkTankToFlagCollision(Tank *t) {
-    return collision(t->pos.x, t->pos.y, TANK_SIZE, TANK_SIZE, game.flagPos.x,
-                     game.flagPos.y, FLAG_SIZE, FLAG_SIZE);
+static bool checkTankToFlagCollision(Game *game, Tank *t) {
+    return collision(t->pos.x, t->pos.y, TANK_SIZE, TANK_SIZE, game->flagPos.x,
+                     game->flagPos.y, FLAG_SIZE, FLAG_SIZE);
 }
 
-static bool checkTankToTankCollision(Tank *t) {
+static bool checkTankToTankCollision(Game *game, Tank *t) {
     int hitboxOffset = 4;
-    for (int i = 0; i < MAX_TANK_COUNT; i++) {
-        Tank *tank = &game.tanks[i];
+    u64 near = tanksNear(game, t->pos.x, t->pos.y, TANK_SIZE, TANK_SIZE);
+    for (; near; near &= near - 1) {
+        Tank *tank = &game->tanks[lowestBit(near)];
         if (t == tank || tank->status != TSActive) continue;
         if (collision(
                 t->pos.x + hitboxOffset, t->pos.y + hitboxOffset,
@@ -870,71 +1217,64 @@ static bool checkTankToTankCollision(Tank *t) {
     return false;
 }
 
-static bool checkTankCollision(Tank *tank) {
+// Returns the first impassable cell of the span (a bit index into the mask
+// line) or -1. Ice ahead of the first blocker starts a player's slide.
+static int checkTankSpan(Game *game, Tank *tank, u64 passable, u64 ice,
+                         u64 span) {
+    u64 blocked = ~passable & span;
+    u64 reached = blocked ? (blocked & -blocked) - 1 : span;
+    if ((ice & span & reached) && !isEnemy(game, tank) &&
+        tank->slidingTimeLeft <= 0) {
+        tank->slidingTimeLeft = SLIDING_TIME;
+    }
+    return blocked ? lowestBit(blocked) : -1;
+}
+
+static bool checkTankCollision(Game *game, Tank *tank) {
     switch (tank->direction) {
         case DRight: {
             int startRow = ((int)tank->pos.y) / CELL_SIZE;
             int endRow = ((int)tank->pos.y + TANK_SIZE - 1) / CELL_SIZE;
             int col = ((int)tank->pos.x + TANK_SIZE - 1) / CELL_SIZE;
-            for (int r = startRow; r <= endRow; r++) {
-                CellType cellType = game.field[r][col].type;
-                if (!game.cellSpecs[cellType].isPassable) {
-                    tank->pos.x = game.field[r][col].pos.x - TANK_SIZE;
-                    return true;
-                } else if (cellType == CTIce && !isEnemy(tank) &&
-                           tank->slidingTimeLeft <= 0) {
-                    tank->slidingTimeLeft = SLIDING_TIME;
-                }
-            }
-            return false;
+            int r = checkTankSpan(game, tank, game->passableCells.cols[col],
+                                  game->iceCells.cols[col],
+                                  bitSpan(startRow, endRow));
+            if (r < 0) return false;
+            tank->pos.x = game->field[r][col].pos.x - TANK_SIZE;
+            return true;
         }
         case DLeft: {
             int startRow = ((int)tank->pos.y) / CELL_SIZE;
             int endRow = ((int)tank->pos.y + TANK_SIZE - 1) / CELL_SIZE;
             int col = ((int)tank->pos.x) / CELL_SIZE;
-            for (int r = startRow; r <= endRow; r++) {
-                CellType cellType = game.field[r][col].type;
-                if (!game.cellSpecs[cellType].isPassable) {
-                    tank->pos.x = game.field[r][col].pos.x + CELL_SIZE;
-                    return true;
-                } else if (cellType == CTIce && !isEnemy(tank) &&
-                           tank->slidingTimeLeft <= 0) {
-                    tank->slidingTimeLeft = SLIDING_TIME;
-                }
-            }
-            return false;
+            int r = checkTankSpan(game, tank, game->passableCells.cols[col],
+                                  game->iceCells.cols[col],
+                                  bitSpan(startRow, endRow));
+            if (r < 0) return false;
+            tank->pos.x = game->field[r][col].pos.x + CELL_SIZE;
+            return true;
         }
         case DUp: {
             int startCol = ((int)tank->pos.x) / CELL_SIZE;
             int endCol = ((int)tank->pos.x + TANK_SIZE - 1) / CELL_SIZE;
             int row = ((int)(tank->pos.y)) / CELL_SIZE;
-            for (int c = startCol; c <= endCol; c++) {
-                CellType cellType = game.field[row][c].type;
-                if (!game.cellSpecs[cellType].isPassable) {
-                    tank->pos.y = game.field[row][c].pos.y + CELL_SIZE;
-                    return true;
-                } else if (cellType == CTIce && !isEnemy(tank) &&
-                           tank->slidingTimeLeft <= 0) {
-                    tank->slidingTimeLeft = SLIDING_TIME;
-                }
-            }
-            return false;
+            int c = checkTankSpan(game, tank, game->passableCells.rows[row],
+                                  game->iceCells.rows[row],
+                                  bitSpan(startCol, endCol));
+            if (c < 0) return false;
+            tank->pos.y = game->field[row][c].pos.y + CELL_SIZE;
+            return true;
         }
         case DDown: {
             int startCol = ((int)tank->pos.x) / CELL_SIZE;
             int endCol = ((int)tank->pos.x + TANK_SIZE - 1) / CELL_SIZE;
             int row = ((int)tank->pos.y + TANK_SIZE - 1) / CELL_SIZE;
-            for (int c = startCol; c <= endCol; c++) {
-                CellType cellType = game.field[row][c].type;
-                if (!game.cellSpecs[cellType].isPassable) {
-                    tank->pos.y = game.field[row][c].pos.y - TANK_SIZE;
-                    return true;
-                } else if (cellType == CTIce && !isEnemy(tank) &&
-                           tank->slidingTimeLeft <= 0) {
-                    tank->slidingTimeLeft = SLIDING_TIME;
-                }
-            }
-            return false;
+            int c = checkTankSpan(game, tank, game->passableCells.rows[row],
+                                  game->iceCells.rows[row],
+                                  bitSpan(startCol, endCol));
+            if (c < 0) return false;
+            tank->pos.y = game->field[row][c].pos.y - TANK_SIZE;
+            return true;
         }
     }
 }
@@ -945,74 +1285,75 @@ static int snap(int x) {
     return (x - x1 < x2 - x) ? x1 : x2;
 }
 
-static void updatePlayerLifesUI() {
-    game.uiElements[UIP1Lifes].textureSrc =
-        digitTextureRect(game.tanks[0].lifes);
-    game.uiElements[UIP2Lifes].textureSrc =
-        digitTextureRect(game.tanks[1].lifes);
+static void updatePlayerLifesUI(Game *game) {
+    game->uiElements[UIP1Lifes].textureSrc =
+        digitTextureRect(game->tanks[0].lifes);
+    game->uiElements[UIP2Lifes].textureSrc =
+        digitTextureRect(game->tanks[1].lifes);
 }
 
-static void createScorePopup(int texCol, Vector2 targetPos, int targetSize) {
+static void createScorePopup(Game *game, int texCol, Vector2 targetPos,
+                             int targetSize) {
     Vector2 offset = {(SCORE_POPUP_SIZE.x - targetSize) / 2,
                       (SCORE_POPUP_SIZE.y - targetSize) / 2};
     for (int i = 0; i < MAX_SCORE_POPUP_COUNT; i++) {
-        if (game.scorePopups[i].ttl <= 0) {
-            game.scorePopups[i].ttl = SCORE_POPUP_TTL;
-            game.scorePopups[i].pos =
+        if (game->scorePopups[i].ttl <= 0) {
+            game->scorePopups[i].ttl = SCORE_POPUP_TTL;
+            game->scorePopups[i].pos =
                 (Vector2){targetPos.x - offset.x, targetPos.y - offset.y};
-            game.scorePopups[i].texCol = texCol;
+            game->scorePopups[i].texCol = texCol;
             break;
         }
     }
 }
 
-static void createExplosion(ExplosionType type, Vector2 targetPos,
-                            int targetSize, int scorePopupTexCol) {
-    int explosionSize = game.explosionAnimations[type].textures[0].width * 2;
+static void createExplosion(Game *game, ExplosionType type, Vector2 targetPos,
+                                        int targetSize, int scorePopupTexCol) {
+    int explosionSize = game->explosionAnimations[type].textures[0].width * 2;
     int offset = (explosionSize - targetSize) / 2;
     for (int i = 0; i < MAX_EXPLOSION_COUNT; i++) {
-        if (game.explosions[i].ttl <= 0) {
-            game.explosions[i].ttl = game.explosionAnimations[type].duration;
-            game.explosions[i].type = type;
-            game.explosions[i].pos =
+        if (game->explosions[i].ttl <= 0) {
+            game->explosions[i].ttl = game->explosionAnimations[type].duration;
+            game->explosions[i].type = type;
+            game->explosions[i].pos =
                 (Vector2){targetPos.x - offset, targetPos.y - offset};
-            game.explosions[i].scorePopupTexCol = scorePopupTexCol;
+            game->explosions[i].scorePopupTexCol = scorePopupTexCol;
             break;
         }
     }
 }
 
-static void destroyTank(Tank *t, bool scorePopup) {
+static void destroyTank(Game *game, Tank *t, bool scorePopup) {
     t->status = TSDead;
     t->lifes--;
-    if (isEnemy(t)) {
-        game.activeEnemyCount--;
+    if (isEnemy(game, t)) {
+        game->activeEnemyCount--;
     }
-    int scorePopupTexCol = scorePopup && isEnemy(t)
-                               ? game.tankSpecs[t->type].points / 100 - 1
+    int scorePopupTexCol = scorePopup && isEnemy(game, t)
+                               ? game->tankSpecs[t->type].points / 100 - 1
                                : -1;
-    createExplosion(ETBig, t->pos, TANK_SIZE, scorePopupTexCol);
+    createExplosion(game, ETBig, t->pos, TANK_SIZE, scorePopupTexCol);
 }
 
-static void destroyAllTanks() {
+static void destroyAllTanks(Game *game) {
     for (int i = 0; i < MAX_TANK_COUNT; i++) {
-        Tank *t = &game.tanks[i + 2];
-        if (t->status == TSActive) destroyTank(t, false);
+        Tank *t = &game->tanks[i + 2];
+        if (t->status == TSActive) destroyTank(game, t, false);
     }
-    playSfx(SFX_BULLET_EXPLOSION);
+    playSfx(game, SFX_BULLET_EXPLOSION);
 }
 
-static void addScore(TankType type, int score) {
-    game.playerScores[type].totalScore += score;
-    game.hiScore = MAX(game.hiScore, game.playerScores[type].totalScore);
+static void addScore(Game *game, TankType type, int score) {
+    game->playerScores[type].totalScore += score;
+    game->hiScore = MAX(game->hiScore, game->playerScores[type].totalScore);
 }
 
-static void handlePowerUpHit(Tank *t) {
-    if (isEnemy(t)) return;
+static void handlePowerUpHit(Game *game, Tank *t) {
+    if (isEnemy(game, t)) return;
     int tankHitboxOffset = 4;
     int powerUpHitboxOffset = 6;
     for (int i = 0; i < MAX_POWERUP_COUNT; i++) {
-        PowerUp *p = &game.powerUps[i];
+        PowerUp *p = &game->powerUps[i];
         if (p->state == PUSActive &&
             collision(t->pos.x + tankHitboxOffset, t->pos.y + tankHitboxOffset,
                       TANK_SIZE - (tankHitboxOffset * 2),
@@ -1022,47 +1363,47 @@ static void handlePowerUpHit(Tank *t) {
                       POWER_UP_SIZE - (powerUpHitboxOffset * 2),
                       POWER_UP_SIZE - (powerUpHitboxOffset * 2))) {
             p->state = PUSPickedUp;
-            playSfx(SFX_POWERUP_PICK);
-            createScorePopup(4, p->pos, POWER_UP_SIZE);
-            addScore(t->type, POWERUP_SCORE);
+            playSfx(game, SFX_POWERUP_PICK);
+            createScorePopup(game, 4, p->pos, POWER_UP_SIZE);
+            addScore(game, t->type, POWERUP_SCORE);
             switch (p->type) {
                 case PUTank:
                     t->lifes++;
-                    updatePlayerLifesUI();
+                    updatePlayerLifesUI(game);
                     break;
                 case PUStar:
                     if (t->tier == 3) return;
                     t->tier++;
-                    game.tankSpecs[t->type].texRow++;
+                    game->tankSpecs[t->type].texRow++;
                     switch (t->tier) {
                         case 1:
-                            game.tankSpecs[t->type].bulletSpeed =
+                            game->tankSpecs[t->type].bulletSpeed =
                                 BULLET_SPEEDS[2];
                             break;
                         case 2:
-                            game.tankSpecs[t->type].maxBulletCount = 2;
+                            game->tankSpecs[t->type].maxBulletCount = 2;
                             break;
                         case 3:
                             break;
                     }
                     break;
                 case PUGrenade:
-                    destroyAllTanks();
+                    destroyAllTanks(game);
                     break;
                 case PUTimer:
-                    game.timerPowerUpTimeLeft = TIMER_TIME;
+                    game->timerPowerUpTimeLeft = TIMER_TIME;
                     break;
                 case PUShield:
                     t->shieldTimeLeft = SHIELD_TIME;
                     break;
                 case PUShovel:
-                    game.shovelPowerUpTimeLeft = SHOVEL_TIME;
+                    game->shovelPowerUpTimeLeft = SHOVEL_TIME;
                     for (int i = 0; i < ASIZE(fortressWall); i++) {
-                        game.field[fortressWall[i].row][fortressWall[i].col]
-                            .type = CTConcrete;
-                        game.field[fortressWall[i].row][fortressWall[i].col]
+                        setCellType(game, fortressWall[i].row,
+                                    fortressWall[i].col, CTConcrete);
+                        game->field[fortressWall[i].row][fortressWall[i].col]
                             .texRow = fortressWall[i].row % 2;
-                        game.field[fortressWall[i].row][fortressWall[i].col]
+                        game->field[fortressWall[i].row][fortressWall[i].col]
                             .texCol = fortressWall[i].col % 2;
                     }
                     break;
@@ -1074,11 +1415,9 @@ static void handlePowerUpHit(Tank *t) {
     }
 }
 
-static void handleCommand(Tank *t, Command cmd) {
-    if (t->status != TSActive) return;
-    if (cmd.fire) {
-        fireBullet(t);
-    }
+// LAN clients also call this to predict their own tank, with
+// pickUpPowerUps off so only the host hands out power-ups.
+static void moveTank(Game *game, Tank *t, Command cmd, bool pickUpPowerUps) {
     if (t->immobileTimeLeft > 0) return;
     if (t->slidingTimeLeft > 0) {
         if (!cmd.move) {
@@ -1092,9 +1431,9 @@ static void handleCommand(Tank *t, Command cmd) {
     if (!cmd.move) return;
     t->texColOffset = (t->texColOffset + 1) % 2;
     Vector2 prevPos = t->pos;
-    bool isAlreadyCollided = checkTankToTankCollision(t);
+    bool isAlreadyCollided = checkTankToTankCollision(game, t);
     if (t->direction == cmd.direction) {
-        int delta = game.frameTime * game.tankSpecs[t->type].speed;
+        float delta = game->frameTime * game->tankSpecs[t->type].speed;
         switch (t->direction) {
             case DLeft:
                 t->pos.x -= delta;
@@ -1127,43 +1466,63 @@ static void handleCommand(Tank *t, Command cmd) {
                 break;
         }
     }
-    handlePowerUpHit(t);
-    if ((!isAlreadyCollided && checkTankToTankCollision(t)) ||
-        checkTankToFlagCollision(t)) {
+    if (pickUpPowerUps) handlePowerUpHit(game, t);
+    if ((!isAlreadyCollided && checkTankToTankCollision(game, t)) ||
+        checkTankToFlagCollision(game, t)) {
         t->pos = prevPos;
         t->isMoving = false;
     } else {
-        if (checkTankCollision(t)) {
+        if (checkTankCollision(game, t)) {
             t->isMoving = false;
         }
     }
     t->direction = cmd.direction;
+    updateTankGrid(game, t);
+}
+
+static void handleCommand(Game *game, Tank *t, Command cmd) {
+    if (t->status != TSActive) return;
+    if (cmd.fire) {
+        fireBullet(game, t);
+    }
+    moveTank(game, t, cmd, true);
+}
+
+static float randomFloat(Game *game) {
+    return (nextRandom(&game->rng) >> 8) / (float)(1 << 24);
 }
 
-static float randomFloat() { return (float)rand() / (float)RAND_MAX; }
+static bool randomTrue(Game *game, float trueChance) {
+    return randomFloat(game) < trueChance;
+}
 
-static bool randomTrue(float trueChance) { return randomFloat() < trueChance; }
+// AI chances are tuned per 60 Hz frame, rescale them to the tick rate so the
+// enemies behave the same at any TICK_RATE.
+static bool randomEvent(Game *game, float frameChance) {
+    return randomTrue(game, 1 - powf(1 - frameChance, 60.0f / TICK_RATE));
+}
 
-static void handleTankAI(Tank *t) {
+static void handleTankAI(Game *game, Tank *t) {
     static Direction dirs[] = {DDown,  DDown, DDown, DDown, DRight,
                                DRight, DLeft, DLeft, DUp};
     Command cmd = {};
-    cmd.fire = randomTrue(0.03f);
-    cmd.move = t->isMoving ? randomTrue(0.999f) : randomTrue(0.50f);
+    cmd.fire = randomEvent(game, 0.03f);
+    cmd.move =
+        t->isMoving ? !randomEvent(game, 0.001f) : randomEvent(game, 0.50f);
     if (cmd.move) {
-        cmd.direction = (t->isMoving && randomTrue(0.999f))
+        cmd.direction = (t->isMoving && !randomEvent(game, 0.001f))
                             ? t->direction
-                            : dirs[rand() % ASIZE(dirs)];
+                            : dirs[nextRandom(&game->rng) % ASIZE(dirs)];
     }
-    handleCommand(t, cmd);
+    handleCommand(game, t, cmd);
 }
 
-static void handleAI() {
-    if (game.timerPowerUpTimeLeft > 0) return;
+static void handleAI(Game *game) {
+    if (game->timerPowerUpTimeLeft > 0) return;
     for (int i = 2; i < MAX_TANK_COUNT; i++) {
-        Tank *t = &game.tanks[i];
+        Tank *t = &game->tanks[i];
         if (t->status != TSActive) continue;
-        handleTankAI(t);
+        handleTankAI(game, t);
     }
 }
 
@@ -1180,7 +1539,7 @@ static Controls controls[2] = {
     {KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_COMMA},
 };
 
-static void handlePlayerInput(TankType type) {
+static Command readKeyboardCommand(TankType type) {
     Command cmd = {};
     if (IsKeyDown(controls[type].right)) {
         cmd.move = true;
@@ -1198,86 +1557,73 @@ static void handlePlayerInput(TankType type) {
     if (IsKeyPressed(controls[type].fire)) {
         cmd.fire = true;
     }
-    handleCommand(&game.tanks[type], cmd);
+    return cmd;
 }
 
-static void handleClientInput(TankType type) {
-    Command cmd = {};
-    if (game.lan.clientInput[0]) {
-        cmd.move = true;
-        cmd.direction = DRight;
-    } else if (game.lan.clientInput[1]) {
-        cmd.move = true;
-        cmd.direction = DLeft;
-    } else if (game.lan.clientInput[2]) {
-        cmd.move = true;
-        cmd.direction = DUp;
-    } else if (game.lan.clientInput[3]) {
-        cmd.move = true;
-        cmd.direction = DDown;
-    }
-    if (game.lan.clientInput[4]) {
-        cmd.fire = true;
-    }
-    handleCommand(&game.tanks[type], cmd);
+static void handlePlayerInput(Game *game, TankType type) {
+    handleCommand(game, &game->tanks[type], game->playerCommands[type]);
+}
+
+static void handleClientInput(Game *game, TankType type) {
+    handleCommand(game, &game->tanks[type], game->lan.clientInput.command);
 }
 
-static void setScreen(GameScreen s) {
-    game.screen = s;
-    game.logic = gameFunctions[s].logic;
-    game.draw = gameFunctions[s].draw;
+static void setScreen(Game *game, GameScreen s) {
+    game->screen = s;
+    game->logic = gameFunctions[s].logic;
+    game->draw = gameFunctions[s].draw;
 }
 
-static void handleInput() {
-    if (game.gameOverTime > 0 && game.proceed) {
-        if (game.screen == GSPlayLan)
-            setScreen(GSScoreLan);
+static void handleInput(Game *game) {
+    if (game->gameOverTime > 0 && game->proceed) {
+        if (game->screen == GSPlayLan)
+            setScreen(game, GSScoreLan);
         else
-            setScreen(GSScore);
+            setScreen(game, GSScore);
         return;
     }
-    if (game.gameOverTime > 0) return;
-    handlePlayerInput(TPlayer1);
-    if (game.mode == GMTwoPlayers) {
-        handlePlayerInput(TPlayer2);
-    } else if (game.mode == GMLan) {
-        handleClientInput(TPlayer2);
+    if (game->gameOverTime > 0) return;
+    handlePlayerInput(game, TPlayer1);
+    if (game->mode == GMTwoPlayers) {
+        handlePlayerInput(game, TPlayer2);
+    } else if (game->mode == GMLan) {
+        handleClientInput(game, TPlayer2);
     }
 }
 
-static void destroyBullet(Bullet *b, bool explosion) {
+static void destroyBullet(Game *game, Bullet *b, bool explosion) {
     b->type = BTNone;
     if (b->tank->firedBulletCount > 0) {
         b->tank->firedBulletCount--;
     }
     if (explosion) {
-        createExplosion(ETBullet, b->pos, BULLET_SIZE, -1);
+        createExplosion(game, ETBullet, b->pos, BULLET_SIZE, -1);
     }
 }
 
-static void destroyBrick(int row, int col, bool destroyConcrete,
-                         bool playSound) {
-    switch (game.field[row][col].type) {
+static void destroyBrick(Game *game, int row, int col, bool destroyConcrete,
+                                     bool playSound) {
+    switch (game->field[row][col].type) {
         case CTBorder:
             if (playSound) {
-                playSfx(SFX_BULLET_HIT_1);
+                playSfx(game, SFX_BULLET_HIT_1);
             }
             break;
         case CTBrick:
-            game.field[row][col].type = CTBlank;
+            setCellType(game, row, col, CTBlank);
             if (playSound) {
-                playSfx(SFX_BULLET_HIT_2);
+                playSfx(game, SFX_BULLET_HIT_2);
             }
             break;
         case CTConcrete:
             if (destroyConcrete) {
-                game.field[row][col].type = CTBlank;
+                setCellType(game, row, col, CTBlank);
                 if (playSound) {
-                    playSfx(SFX_BULLET_HIT_2);
+                    playSfx(game, SFX_BULLET_HIT_2);
                 }
             } else {
                 if (playSound) {
-                    playSfx(SFX_BULLET_HIT_1);
+                    playSfx(game, SFX_BULLET_HIT_1);
                 }
             }
             break;
@@ -1286,250 +1632,264 @@ static void destroyBrick(int row, int col, bool destroyConcrete,
     }
 }
 
-static void checkBulletRows(Bullet *b, int startRow, int endRow, int col,
-                            int nextCol) {
-    for (int r = startRow; r <= endRow; r++) {
-        CellType cellType = game.field[r][col].type;
-        if (game.cellSpecs[cellType].isSolid) {
-            destroyBullet(b, true);
-            bool destroyConcrete = b->tank->tier == 3;
-            for (int rr = startRow - 1; rr <= endRow + 1; rr++) {
-                destroyBrick(rr, col, destroyConcrete, !isEnemy(b->tank));
-                if (destroyConcrete) {
-                    destroyBrick(rr, nextCol, destroyConcrete, false);
-                }
-            }
-            return;
-        }
+static void checkBulletRows(Game *game, Bullet *b, int startRow, int endRow,
+                            int col, int nextCol) {
+    if (!(game->solidCells.cols[col] & bitSpan(startRow, endRow))) return;
+    destroyBullet(game, b, true);
+    bool destroyConcrete = b->tank->tier == 3;
+    bool playSound = !isEnemy(game, b->tank);
+    u64 span = bitSpan(MAX(startRow - 1, 0), MIN(endRow + 1, FIELD_ROWS - 1));
+    for (u64 hits = game->solidCells.cols[col] & span; hits;
+         hits &= hits - 1) {
+        destroyBrick(game, lowestBit(hits), col, destroyConcrete, playSound);
+    }
+    if (!destroyConcrete) return;
+    for (u64 hits = game->solidCells.cols[nextCol] & span; hits;
+         hits &= hits - 1) {
+        destroyBrick(game, lowestBit(hits), nextCol, destroyConcrete, false);
     }
 }
 
-static void checkBulletCols(Bullet *b, int startCol, int endCol, int row,
-                            int nextRow) {
-    for (int c = startCol; c <= endCol; c++) {
-        CellType cellType = game.field[row][c].type;
-        if (game.cellSpecs[cellType].isSolid) {
-            destroyBullet(b, true);
-            bool destroyConcrete = b->tank->tier == 3;
-            for (int cc = startCol - 1; cc <= endCol + 1; cc++) {
-                destroyBrick(row, cc, destroyConcrete, !isEnemy(b->tank));
-                if (destroyConcrete) {
-                    destroyBrick(nextRow, cc, destroyConcrete, false);
-                }
-            }
-            return;
-        }
+static void checkBulletCols(Game *game, Bullet *b, int startCol, int endCol,
+                            int row, int nextRow) {
+    if (!(game->solidCells.rows[row] & bitSpan(startCol, endCol))) return;
+    destroyBullet(game, b, true);
+    bool destroyConcrete = b->tank->tier == 3;
+    bool playSound = !isEnemy(game, b->tank);
+    u64 span = bitSpan(MAX(startCol - 1, 0), MIN(endCol + 1, FIELD_COLS - 1));
+    for (u64 hits = game->solidCells.rows[row] & span; hits;
+         hits &= hits - 1) {
+        destroyBrick(game, row, lowestBit(hits), destroyConcrete, playSound);
+    }
+    if (!destroyConcrete) return;
+    for (u64 hits = game->solidCells.rows[nextRow] & span; hits;
+         hits &= hits - 1) {
+        destroyBrick(game, nextRow, lowestBit(hits), destroyConcrete, false);
     }
 }
 
-static void gameOver() { game.gameOverTime = 0.001; }
+static void gameOver(Game *game) { game->gameOverTime = 0.001; }
 
-static void handlePlayerKill(Tank *t) {
-    if (game.gameOverTime > 0) return;
-    if (isEnemy(t)) return;
+static void handlePlayerKill(Game *game, Tank *t) {
+    if (game->gameOverTime > 0) return;
+    if (isEnemy(game, t)) return;
     if (t->lifes < 0) {
-        gameOver();
+        gameOver(game);
         return;
     }
-    spawnPlayer(t, true);
-    updatePlayerLifesUI();
+    spawnPlayer(game, t, true);
+    updatePlayerLifesUI(game);
 }
 
-static void checkStageEnd() {
-    if (game.pendingEnemyCount + game.activeEnemyCount == 0) {
-        game.stageEndTime += game.frameTime;
+static void checkStageEnd(Game *game) {
+    if (game->pendingEnemyCount + game->activeEnemyCount == 0) {
+        game->stageEndTime += game->frameTime;
     }
-    if (game.stageEndTime >= STAGE_END_TIME ||
-        game.gameOverTime >= GAME_OVER_SLIDE_TIME + GAME_OVER_DELAY) {
-        if (game.screen == GSPlayLan) {
-            setScreen(GSScoreLan);
+    if (game->stageEndTime >= STAGE_END_TIME ||
+        game->gameOverTime >= GAME_OVER_SLIDE_TIME + GAME_OVER_DELAY) {
+        if (game->screen == GSPlayLan) {
+            setScreen(game, GSScoreLan);
         } else
-            setScreen(GSScore);
+            setScreen(game, GSScore);
     }
 }
 
-static void checkBulletHit(Bullet *b) {
+static void checkBulletHit(Game *game, Bullet *b) {
     int tankHitboxOffset = 4;
-    for (int i = 0; i < MAX_TANK_COUNT; i++) {
-        Tank *t = &game.tanks[i];
+    u64 near = tanksNear(game, b->pos.x, b->pos.y, BULLET_SIZE, BULLET_SIZE);
+    for (; near; near &= near - 1) {
+        Tank *t = &game->tanks[lowestBit(near)];
         if (t->status != TSActive || b->tank == t ||
-            (isEnemy(b->tank) && isEnemy(t)) ||
+            (isEnemy(game, b->tank) && isEnemy(game, t)) ||
             !collision(b->pos.x, b->pos.y, BULLET_SIZE, BULLET_SIZE,
                        t->pos.x + tankHitboxOffset, t->pos.y + tankHitboxOffset,
                        TANK_SIZE - (tankHitboxOffset * 2),
                        TANK_SIZE - (tankHitboxOffset * 2))) {
             continue;
         }
-        destroyBullet(b, true);
+        destroyBullet(game, b, true);
         if (t->shieldTimeLeft > 0) break;
-        if (!isEnemy(b->tank) && !isEnemy(t)) {
+        if (!isEnemy(game, b->tank) && !isEnemy(game, t)) {
             t->immobileTimeLeft = IMMOBILE_TIME;
             break;
         }
         if (t->powerUp && t->powerUp->state == PUSPending) {
             t->powerUp->state = PUSActive;
             t->powerUp = NULL;
-            playSfx(SFX_POWERUP_APPEAR);
+            playSfx(game, SFX_POWERUP_APPEAR);
         }
-        if (isEnemy(t) && t->lifes > 1) {
-            playSfx(SFX_BULLET_HIT_1);
+        if (isEnemy(game, t) && t->lifes > 1) {
+            playSfx(game, SFX_BULLET_HIT_1);
             t->lifes--;
             break;
         }
-        destroyTank(t, true);
-        handlePlayerKill(t);
-        if (!isEnemy(b->tank)) {
-            addScore(b->tank->type, game.tankSpecs[t->type].points);
-            game.playerScores[b->tank->type].kills[t->type]++;
+        destroyTank(game, t, true);
+        handlePlayerKill(game, t);
+        if (!isEnemy(game, b->tank)) {
+            addScore(game, b->tank->type, game->tankSpecs[t->type].points);
+            game->playerScores[b->tank->type].kills[t->type]++;
         }
-        playSfx(isEnemy(t) ? SFX_BULLET_EXPLOSION : SFX_BIG_EXPLOSION);
+        playSfx(game,
+                isEnemy(game, t) ? SFX_BULLET_EXPLOSION : SFX_BIG_EXPLOSION);
     }
 }
 
-static bool checkBulletToBulletCollision(Bullet *b) {
-    for (int i = 0; i < MAX_BULLET_COUNT; i++) {
-        Bullet *b2 = &game.bullets[i];
+static bool checkBulletToBulletCollision(Game *game, Bullet *b) {
+    for (int i = 0; i < game->activeBulletCount; i++) {
+        Bullet *b2 = &game->bullets[game->activeBullets[i]];
         if (b == b2 || b2->type == BTNone) continue;
         if (collision(b->pos.x, b->pos.y, BULLET_SIZE, BULLET_SIZE, b2->pos.x,
                       b2->pos.y, BULLET_SIZE, BULLET_SIZE)) {
-            destroyBullet(b, false);
-            destroyBullet(b2, false);
+            destroyBullet(game, b, false);
+            destroyBullet(game, b2, false);
             return true;
         }
     }
     return false;
 }
 
-static void destroyFlag() {
-    createExplosion(ETBig, game.flagPos, FLAG_SIZE, -1);
-    game.isFlagDead = true;
+static void destroyFlag(Game *game) {
+    createExplosion(game, ETBig, game->flagPos, FLAG_SIZE, -1);
+    game->isFlagDead = true;
 }
 
-static bool checkFlagHit(Bullet *b) {
-    if (!game.gameOverTime &&
-        collision(b->pos.x, b->pos.y, BULLET_SIZE, BULLET_SIZE, game.flagPos.x,
-                  game.flagPos.y, FLAG_SIZE, FLAG_SIZE)) {
-        destroyBullet(b, true);
-        destroyFlag();
-        playSfx(SFX_BIG_EXPLOSION);
+static bool checkFlagHit(Game *game, Bullet *b) {
+    if (!game->gameOverTime &&
+        collision(b->pos.x, b->pos.y, BULLET_SIZE, BULLET_SIZE, game->flagPos.x,
+                  game->flagPos.y, FLAG_SIZE, FLAG_SIZE)) {
+        destroyBullet(game, b, true);
+        destroyFlag(game);
+        playSfx(game, SFX_BIG_EXPLOSION);
         return true;
     }
     return false;
 }
 
-static void checkBulletCollision(Bullet *b) {
-    if (checkFlagHit(b)) {
-        gameOver();
+static void checkBulletCollision(Game *game, Bullet *b) {
+    if (checkFlagHit(game, b)) {
+        gameOver(game);
         return;
     }
-    if (checkBulletToBulletCollision(b)) return;
-    checkBulletHit(b);
+    if (checkBulletToBulletCollision(game, b)) return;
+    checkBulletHit(game, b);
     switch (b->direction) {
         case DRight: {
             int startRow = ((int)b->pos.y) / CELL_SIZE;
             int endRow = ((int)b->pos.y + BULLET_SIZE - 1) / CELL_SIZE;
             int col = ((int)b->pos.x + BULLET_SIZE - 1) / CELL_SIZE;
-            checkBulletRows(b, startRow, endRow, col, col + 1);
+            checkBulletRows(game, b, startRow, endRow, col, col + 1);
             return;
         }
         case DLeft: {
             int startRow = ((int)b->pos.y) / CELL_SIZE;
             int endRow = ((int)b->pos.y + BULLET_SIZE - 1) / CELL_SIZE;
             int col = ((int)b->pos.x) / CELL_SIZE;
-            checkBulletRows(b, startRow, endRow, col, col - 1);
+            checkBulletRows(game, b, startRow, endRow, col, col - 1);
             return;
         }
         case DUp: {
             int startCol = ((int)b->pos.x) / CELL_SIZE;
             int endCol = ((int)b->pos.x + BULLET_SIZE - 1) / CELL_SIZE;
             int row = ((int)(b->pos.y)) / CELL_SIZE;
-            checkBulletCols(b, startCol, endCol, row, row - 1);
+            checkBulletCols(game, b, startCol, endCol, row, row - 1);
             return;
         }
         case DDown: {
             int startCol = ((int)b->pos.x) / CELL_SIZE;
             int endCol = ((int)b->pos.x + BULLET_SIZE - 1) / CELL_SIZE;
             int row = ((int)b->pos.y + BULLET_SIZE - 1) / CELL_SIZE;
-            checkBulletCols(b, startCol, endCol, row, row + 1);
+            checkBulletCols(game, b, startCol, endCol, row, row + 1);
             return;
         }
     }
 }
 
-static void updateBulletsState() {
-    for (int i = 0; i < MAX_BULLET_COUNT; i++) {
-        Bullet *b = &game.bullets[i];
+static void removeDestroyedBullets(Game *game) {
+    for (int i = 0; i < game->activeBulletCount;) {
+        u8 slot = game->activeBullets[i];
+        if (game->bullets[slot].type != BTNone) {
+            i++;
+            continue;
+        }
+        game->freeBullets[game->freeBulletCount++] = slot;
+        game->activeBullets[i] = game->activeBullets[--game->activeBulletCount];
+    }
+}
+
+static void updateBulletsState(Game *game) {
+    for (int i = 0; i < game->activeBulletCount; i++) {
+        Bullet *b = &game->bullets[game->activeBullets[i]];
+        // Already destroyed by a bullet earlier in this pass.
         if (b->type == BTNone) continue;
-        b->pos.x += (b->speed.x * game.frameTime);
-        b->pos.y += (b->speed.y * game.frameTime);
-        checkBulletCollision(b);
+        b->pos.x += (b->speed.x * game->frameTime);
+        b->pos.y += (b->speed.y * game->frameTime);
+        checkBulletCollision(game, b);
     }
+    removeDestroyedBullets(game);
 }
 
-static void updateExplosionsState() {
+static void updateExplosionsState(Game *game) {
     for (int i = 0; i < MAX_EXPLOSION_COUNT; i++) {
-        Explosion *e = &game.explosions[i];
+        Explosion *e = &game->explosions[i];
         if (e->ttl > 0) {
-            e->ttl -= game.frameTime;
+            e->ttl -= game->frameTime;
             if (e->ttl <= 0 && e->scorePopupTexCol != -1) {
-                createScorePopup(
+                createScorePopup(game, 
                     e->scorePopupTexCol, e->pos,
-                    game.explosionAnimations[ETBig].textures[0].width * 2);
+                    game->explosionAnimations[ETBig].textures[0].width * 2);
             }
         }
     }
 }
 
-static void updateScorePopupsState() {
+static void updateScorePopupsState(Game *game) {
     for (int i = 0; i < MAX_SCORE_POPUP_COUNT; i++) {
-        if (game.scorePopups[i].ttl > 0) {
-            game.scorePopups[i].ttl -= game.frameTime;
+        if (game->scorePopups[i].ttl > 0) {
+            game->scorePopups[i].ttl -= game->frameTime;
         }
     }
 }
 
-static void spawnTanks() {
-    if (game.timeSinceSpawn < ENEMY_SPAWN_INTERVAL ||
-        game.activeEnemyCount >= game.maxActiveEnemyCount)
+static void spawnTanks(Game *game) {
+    if (game->timeSinceSpawn < ENEMY_SPAWN_INTERVAL ||
+        game->activeEnemyCount >= game->maxActiveEnemyCount)
         return;
-    game.timeSinceSpawn = 0;
+    game->timeSinceSpawn = 0;
     for (int i = 2; i < MAX_TANK_COUNT; i++) {
-        if (game.tanks[i].status == TSPending) {
-            game.tanks[i].status = TSSpawning;
-            game.activeEnemyCount++;
-            game.pendingEnemyCount--;
+        if (game->tanks[i].status == TSPending) {
+            game->tanks[i].status = TSSpawning;
+            game->activeEnemyCount++;
+            game->pendingEnemyCount--;
             return;
         }
     }
 }
 
-static void updateGameState() {
-    game.cellSpecs[CTRiver].texture =
-        &game.textures.river[((long)(game.totalTime * 2)) % 2];
-    updateExplosionsState();
-    updateScorePopupsState();
-    updateBulletsState();
+static void updateGameState(Game *game) {
+    updateExplosionsState(game);
+    updateScorePopupsState(game);
+    updateBulletsState(game);
     for (int i = 0; i < MAX_TANK_COUNT; i++) {
-        Tank *tank = &game.tanks[i];
+        Tank *tank = &game->tanks[i];
         if (tank->status == TSActive) {
-            // updateTankState(&game.tanks[i]);
+            // updateTankState(&game->tanks[i]);
         } else if (tank->status == TSSpawning) {
-            tank->spawningTime += game.frameTime;
+            tank->spawningTime += game->frameTime;
             if (tank->spawningTime >= SPAWNING_TIME) {
                 tank->spawningTime = 0;
                 tank->status = TSActive;
                 if (tank->powerUp) {
                     for (int k = 0; k < MAX_POWERUP_COUNT; k++) {
-                        if (game.powerUps[k].state == PUSActive) {
-                            game.powerUps[k].state = PUSPickedUp;
+                        if (game->powerUps[k].state == PUSActive) {
+                            game->powerUps[k].state = PUSPickedUp;
                         }
                     }
                 }
             }
         }
     }
-    spawnTanks();
-    checkStageEnd();
+    spawnTanks(game);
+    checkStageEnd(game);
 }
 
 // static void drawFloat(float d, int x, int y) {
@@ -1538,36 +1898,35 @@ static void updateGameState() {
 //     drawText(buffer, x, y, 10, WHITE);
 // }
 
-static void gameOverCurtainLogic() {
-    if (game.proceed) {
-        setScreen(GSTitle);
-        close(game.lan.socket);
+static void gameOverCurtainLogic(Game *game) {
+    if (game->proceed) {
+        setScreen(game, GSTitle);
+        closeLanSocket(&game->lan);
     }
 }
 
-static void drawGameOverCurtain() {
-    Texture2D *tex = &game.textures.gameOverCurtain;
+static void drawGameOverCurtain(Game *game) {
+    Sprite *tex = &assets.textures.gameOverCurtain;
     int drawWidth = tex->width * 2;
     int drawHeight = tex->height * 2;
     int x = (SCREEN_WIDTH - drawWidth) / 2;
     int y = (SCREEN_HEIGHT - drawHeight) / 2;
-    DrawTexturePro(*tex, (Rectangle){0, 0, tex->width, tex->height},
-                   (Rectangle){x, y, drawWidth, drawHeight}, (Vector2){}, 0,
-                   WHITE);
+    drawSprite(tex, (Rectangle){0, 0, tex->width, tex->height},
+               (Rectangle){x, y, drawWidth, drawHeight}, (Vector2){}, 0, WHITE);
 }
 
-static void congratsLogic() {
-    if (game.proceed) {
-        setScreen(GSTitle);
+static void congratsLogic(Game *game) {
+    if (game->proceed) {
+        setScreen(game, GSTitle);
     }
 }
 
-static void drawCongrats() {
+static void drawCongrats(Game *game) {
     int topY = SCREEN_HEIGHT / 3;
     static const int N = 256;
     char text[N];
-    int score = MAX(game.playerScores[TPlayer1].totalScore,
-                    game.playerScores[TPlayer2].totalScore);
+    int score = MAX(game->playerScores[TPlayer1].totalScore,
+                    game->playerScores[TPlayer2].totalScore);
     char *congratsText = "CONGRATULATIONS!";
 
     drawText(congratsText, centerX(measureText(congratsText, FONT_SIZE * 2)),
@@ -1583,43 +1942,43 @@ static void drawCongrats() {
              (Color){241, 159, 80, 255});
 }
 
-static void stageSummaryLogic() {
-    game.stageSummary.time += game.frameTime;
-    if (game.proceed) {
-        if (game.gameOverTime) {
+static void stageSummaryLogic(Game *game) {
+    game->stageSummary.time += game->frameTime;
+    if (game->proceed) {
+        if (game->gameOverTime) {
 #ifndef ALT_ASSETS
-            playSfx(SFX_GAME_OVER);
+            playSfx(game, SFX_GAME_OVER);
 #endif
-            setScreen(GSGameOver);
-        } else if (game.stage == LEVEL_COUNT) {
-            setScreen(GSCongrats);
+            setScreen(game, GSGameOver);
+        } else if (game->stage == LEVEL_COUNT) {
+            setScreen(game, GSCongrats);
         } else {
-            initStage(game.stage + 1);
-            if (game.mode == GMLan)
-                setScreen(GSPlayLan);
+            initStage(game, game->stage + 1);
+            if (game->mode == GMLan)
+                setScreen(game, GSPlayLan);
             else
-                setScreen(GSPlay);
+                setScreen(game, GSPlay);
         }
     }
 }
 
-static void drawStageSummary() {
+static void drawStageSummary(Game *game) {
     int topY = SCREEN_HEIGHT -
                (SCREEN_HEIGHT - 30) *
-                   (MIN(game.stageSummary.time, STAGE_SUMMARY_SLIDE_TIME) /
+                   (MIN(game->stageSummary.time, STAGE_SUMMARY_SLIDE_TIME) /
                     STAGE_SUMMARY_SLIDE_TIME);
     static const int N = 256;
     char text[N];
 
-    snprintf(text, N, "HI-SCORE  %7d", game.hiScore);
+    snprintf(text, N, "HI-SCORE  %7d", game->hiScore);
     int x = centerX(measureText(text, FONT_SIZE));
     drawText("HI-SCORE", x, topY, FONT_SIZE, (Color){205, 62, 26, 255});
-    snprintf(text, N, "%7d", game.hiScore);
+    snprintf(text, N, "%7d", game->hiScore);
     drawText(text, x + measureText("HI-SCORE  ", FONT_SIZE), topY, FONT_SIZE,
              (Color){241, 159, 80, 255});
     topY += 70;
 
-    snprintf(text, N, "STAGE %2d", game.stage);
+    snprintf(text, N, "STAGE %2d", game->stage);
     drawText(text, centerX(measureText(text, FONT_SIZE)), topY, FONT_SIZE,
              WHITE);
 
@@ -1630,72 +1989,73 @@ static void drawStageSummary() {
              (Color){205, 62, 26, 255});
 
     // Player score
-    snprintf(text, N, "%d", game.playerScores[TPlayer1].totalScore);
+    snprintf(text, N, "%d", game->playerScores[TPlayer1].totalScore);
     drawText(text, (halfWidth - measureText(text, FONT_SIZE) - pX),
              topY + (FONT_SIZE + linePadding) * 2, FONT_SIZE,
              (Color){241, 159, 80, 255});
 
-    if (game.mode == GMTwoPlayers || game.mode == GMLan) {
+    if (game->mode == GMTwoPlayers || game->mode == GMLan) {
         int pX = (halfWidth - measureText("II-PLAYER", FONT_SIZE)) / 2;
         drawText("II-PLAYER", halfWidth + pX, topY + FONT_SIZE + linePadding,
                  FONT_SIZE, (Color){205, 62, 26, 255});
 
         // Player score
-        snprintf(text, N, "%d", game.playerScores[TPlayer2].totalScore);
+        snprintf(text, N, "%d", game->playerScores[TPlayer2].totalScore);
         drawText(text, (halfWidth + pX), topY + (FONT_SIZE + linePadding) * 2,
                  FONT_SIZE, (Color){241, 159, 80, 255});
     }
-    int arrowWidth = game.textures.leftArrow.width;
+    int arrowWidth = assets.textures.leftArrow.width;
     int arrowDrawWidth = arrowWidth * 4;
-    int arrowHeight = game.textures.leftArrow.height;
+    int arrowHeight = assets.textures.leftArrow.height;
     int arrowDrawHeight = arrowHeight * 4;
     int player1TotalKills = 0;
     int player2TotalKills = 0;
     for (int i = 2; i < TMax; i++) {
         int y = topY + (FONT_SIZE + linePadding) * (i + 1);
-        Texture2D *tex = game.tankSpecs[i].texture;
+        Sprite *tex = game->tankSpecs[i].texture;
         int texX = 0;
-        int texY = game.tankSpecs[i].texRow * TANK_TEXTURE_SIZE;
+        int texY = game->tankSpecs[i].texRow * TANK_TEXTURE_SIZE;
         int drawSize = TANK_TEXTURE_SIZE * 4;
         int drawOffset = (TANK_SIZE - drawSize) / 2;
-        DrawTexturePro(
-            *tex, (Rectangle){texX, texY, TANK_TEXTURE_SIZE, TANK_TEXTURE_SIZE},
+        drawSprite(
+            tex, (Rectangle){texX, texY, TANK_TEXTURE_SIZE, TANK_TEXTURE_SIZE},
             (Rectangle){halfWidth - (drawSize / 2) + drawOffset,
                         y - (drawSize - FONT_SIZE) / 2 + drawOffset, drawSize,
                         drawSize},
             (Vector2){}, 0, WHITE);
-        DrawTexturePro(
-            game.textures.leftArrow, (Rectangle){0, 0, arrowWidth, arrowHeight},
+        drawSprite(
+            &assets.textures.leftArrow,
+            (Rectangle){0, 0, arrowWidth, arrowHeight},
             (Rectangle){halfWidth - (drawSize / 2) - 10 - arrowDrawWidth,
                         y - (arrowDrawHeight - FONT_SIZE) / 2, arrowDrawWidth,
                         arrowDrawHeight},
             (Vector2){}, 0, WHITE);
 
-        int kills = game.playerScores[TPlayer1].kills[i];
+        int kills = game->playerScores[TPlayer1].kills[i];
         player1TotalKills += kills;
-        snprintf(text, N, "%4d PTS  %2d", kills * game.tankSpecs[i].points,
+        snprintf(text, N, "%4d PTS  %2d", kills * game->tankSpecs[i].points,
                  kills);
         drawText(text, halfWidth - measureText(text, FONT_SIZE) - 100, y,
                  FONT_SIZE, WHITE);
-        if (game.mode == GMTwoPlayers || game.mode == GMLan) {
-            DrawTexturePro(game.textures.rightArrow,
-                           (Rectangle){0, 0, arrowWidth, arrowHeight},
-                           (Rectangle){halfWidth + (drawSize / 2) + 10,
-                                       y - (arrowDrawHeight - FONT_SIZE) / 2,
-                                       arrowDrawWidth, arrowDrawHeight},
-                           (Vector2){}, 0, WHITE);
-
-            kills = game.playerScores[TPlayer2].kills[i];
+        if (game->mode == GMTwoPlayers || game->mode == GMLan) {
+            drawSprite(&assets.textures.rightArrow,
+                       (Rectangle){0, 0, arrowWidth, arrowHeight},
+                       (Rectangle){halfWidth + (drawSize / 2) + 10,
+                                   y - (arrowDrawHeight - FONT_SIZE) / 2,
+                                   arrowDrawWidth, arrowDrawHeight},
+                       (Vector2){}, 0, WHITE);
+
+            kills = game->playerScores[TPlayer2].kills[i];
             player2TotalKills += kills;
             snprintf(text, N, "%2d  %4d PTS", kills,
-                     kills * game.tankSpecs[i].points);
+                     kills * game->tankSpecs[i].points);
             drawText(text, halfWidth + 100, y, FONT_SIZE, WHITE);
         }
     }
     snprintf(text, N, "TOTAL %2d", player1TotalKills);
     drawText(text, halfWidth - measureText(text, FONT_SIZE) - 100,
              topY + (FONT_SIZE + linePadding) * (TMax + 1), FONT_SIZE, WHITE);
-    if (game.mode == GMTwoPlayers || game.mode == GMLan) {
+    if (game->mode == GMTwoPlayers || game->mode == GMLan) {
         snprintf(text, N, "%2d", player2TotalKills);
         drawText(text, halfWidth + 100,
                  topY + (FONT_SIZE + linePadding) * (TMax + 1), FONT_SIZE,
@@ -1703,95 +2063,95 @@ static void drawStageSummary() {
     }
 }
 
-static void titleLogic() {
-    game.title.time += game.frameTime;
-    if (game.title.time > TITLE_SLIDE_TIME &&
-        game.title.menuSelecteItem == MNone) {
-        game.title.menuSelecteItem = MOnePlayer;
+static void titleLogic(Game *game) {
+    game->title.time += game->frameTime;
+    if (game->title.time > TITLE_SLIDE_TIME &&
+        game->title.menuSelecteItem == MNone) {
+        game->title.menuSelecteItem = MOnePlayer;
     }
-    if (IsKeyPressed(KEY_LEFT_SHIFT)) {
-        playSfx(SFX_MODE_SWITCH);
-        game.title.time = TITLE_SLIDE_TIME;
-        game.title.menuSelecteItem =
-            game.title.menuSelecteItem % (MMax - 1) + 1;
-    } else if (game.proceed) {
-        switch (game.title.menuSelecteItem) {
+    if (game->switchMode) {
+        playSfx(game, SFX_MODE_SWITCH);
+        game->title.time = TITLE_SLIDE_TIME;
+        game->title.menuSelecteItem =
+            game->title.menuSelecteItem % (MMax - 1) + 1;
+    } else if (game->proceed) {
+        switch (game->title.menuSelecteItem) {
             case MOnePlayer:
-                game.mode = GMOnePlayer;
+                game->mode = GMOnePlayer;
                 break;
             case MTwoPlayers:
-                game.mode = GMTwoPlayers;
+                game->mode = GMTwoPlayers;
                 break;
             case MLan:
-                game.mode = GMLan;
+                game->mode = GMLan;
                 printf("Gamemode set to LAN\n");
                 break;
             default:
-                game.title.time = TITLE_SLIDE_TIME;
+                game->title.time = TITLE_SLIDE_TIME;
                 return;
         }
-        game.title = (Title){0};
-        if (game.mode == GMLan) {
-            setScreen(GSLan);
+        game->title = (Title){0};
+        if (game->mode == GMLan) {
+            setScreen(game, GSLan);
         } else {
-            setScreen(GSPlay);
-            initGameRun();
-            initStage(1);
+            setScreen(game, GSPlay);
+            initGameRun(game);
+            initStage(game, 1);
         }
     }
 }
 
-static void drawTitle() {
+static void drawTitle(Game *game) {
     int topY = 150;
-    Texture2D *tex = &game.textures.title;
+    Sprite *tex = &assets.textures.title;
     int titleTexHeight = tex->height;
     int x = (SCREEN_WIDTH - tex->width * 2) / 2;
     int y = SCREEN_HEIGHT -
             (SCREEN_HEIGHT - topY) *
-                (MIN(game.title.time, TITLE_SLIDE_TIME) / TITLE_SLIDE_TIME);
+                (MIN(game->title.time, TITLE_SLIDE_TIME) / TITLE_SLIDE_TIME);
     static const int N = 256;
     char text[N];
-    snprintf(text, N, "HI-SCORE   %7d", game.hiScore);
+    snprintf(text, N, "HI-SCORE   %7d", game->hiScore);
     drawText(text, centerX(measureText(text, FONT_SIZE)), y - 70, FONT_SIZE,
              WHITE);
-    DrawTexturePro(*tex, (Rectangle){0, 0, tex->width, titleTexHeight},
-                   (Rectangle){x, y, tex->width * 2, titleTexHeight * 2},
-                   (Vector2){}, 0, WHITE);
-    if (game.title.menuSelecteItem != MNone) {
-        tex = &game.textures.player1Tank;
+    drawSprite(tex, (Rectangle){0, 0, tex->width, titleTexHeight},
+               (Rectangle){x, y, tex->width * 2, titleTexHeight * 2},
+               (Vector2){}, 0, WHITE);
+    if (game->title.menuSelecteItem != MNone) {
+        tex = &assets.textures.player1Tank;
         int texX =
-            (3 * 2 + ((long)(game.totalTime * 16) % 2)) * TANK_TEXTURE_SIZE;
-        DrawTexturePro(
-            *tex, (Rectangle){texX, 0, TANK_TEXTURE_SIZE, TANK_TEXTURE_SIZE},
+            (3 * 2 + ((long)(game->totalTime * 16) % 2)) * TANK_TEXTURE_SIZE;
+        drawSprite(
+            tex, (Rectangle){texX, 0, TANK_TEXTURE_SIZE, TANK_TEXTURE_SIZE},
             (Rectangle){x + 150,
                         topY + titleTexHeight * 2 - 174 +
-                            (game.title.menuSelecteItem - 1) * 60,
+                            (game->title.menuSelecteItem - 1) * 60,
                         TANK_TEXTURE_SIZE * 4, TANK_TEXTURE_SIZE * 4},
             (Vector2){}, 0, WHITE);
     }
 }
 
-static void lanMenuLogic() {
-    if (IsKeyPressed(KEY_LEFT_SHIFT)) {
-        playSfx(SFX_MODE_SWITCH);
-        game.lanMenu.lanMenuSelectedItem =
-            game.lanMenu.lanMenuSelectedItem % (LMMax - 1) + 1;
+static void lanMenuLogic(Game *game) {
+    if (game->switchMode) {
+        playSfx(game, SFX_MODE_SWITCH);
+        game->lanMenu.lanMenuSelectedItem =
+            game->lanMenu.lanMenuSelectedItem % (LMMax - 1) + 1;
     }
 
-    if (game.proceed) {
-        switch (game.lanMenu.lanMenuSelectedItem) {
+    if (game->proceed) {
+        switch (game->lanMenu.lanMenuSelectedItem) {
             case LMHostGame:
-                game.lan.lanMode = LServer;
-                setScreen(GSHostGame);
-                initHostGame();
+                game->lan.lanMode = LServer;
+                setScreen(game, GSHostGame);
+                initHostGame(game);
                 break;
             case LMJoinGame:
-                game.lan.lanMode = LClient;
-                setScreen(GSJoinGame);
-                initJoinGame();
+                game->lan.lanMode = LClient;
+                setScreen(game, GSJoinGame);
+                initJoinGame(game);
                 break;
             case LMBack:
-                setScreen(GSTitle);
+                setScreen(game, GSTitle);
                 break;
             default:
                 return;
@@ -1799,7 +2159,7 @@ static void lanMenuLogic() {
     }
 }
 
-static void drawLanMenu() {
+static void drawLanMenu(Game *game) {
 #ifndef ALT_ASSETS
     static const int N = 256;
     char text[N];
@@ -1809,61 +2169,206 @@ static void drawLanMenu() {
 
     snprintf(text, N, "HOST GAME");
     drawText(text, centerX(measureText(text, FONT_SIZE)), 450, FONT_SIZE,
-             game.lanMenu.lanMenuSelectedItem == LMHostGame ? RED : WHITE);
+             game->lanMenu.lanMenuSelectedItem == LMHostGame ? RED : WHITE);
 
     snprintf(text, N, "JOIN GAME");
     drawText(text, centerX(measureText(text, FONT_SIZE)), 550, FONT_SIZE,
-             game.lanMenu.lanMenuSelectedItem == LMJoinGame ? RED : WHITE);
+             game->lanMenu.lanMenuSelectedItem == LMJoinGame ? RED : WHITE);
 
     snprintf(text, N, "BACK");
     drawText(text, centerX(measureText(text, FONT_SIZE)), 650, FONT_SIZE,
-             game.lanMenu.lanMenuSelectedItem == LMBack ? RED : WHITE);
+             game->lanMenu.lanMenuSelectedItem == LMBack ? RED : WHITE);
 #else
     int topY = 150;
-    Texture2D *tex = &game.textures.lan;
+    Sprite *tex = &assets.textures.lan;
     int titleTexHeight = tex->height;
     int x = (SCREEN_WIDTH - tex->width * 2) / 2;
     int y = topY;
-    DrawTexturePro(*tex, (Rectangle){0, 0, tex->width, titleTexHeight},
-                   (Rectangle){x, y, tex->width * 2, titleTexHeight * 2},
-                   (Vector2){}, 0, WHITE);
-    if (game.lanMenu.lanMenuSelectedItem != LMNone) {
-        tex = &game.textures.player1Tank;
+    drawSprite(tex, (Rectangle){0, 0, tex->width, titleTexHeight},
+               (Rectangle){x, y, tex->width * 2, titleTexHeight * 2},
+               (Vector2){}, 0, WHITE);
+    if (game->lanMenu.lanMenuSelectedItem != LMNone) {
+        tex = &assets.textures.player1Tank;
         int texX =
-            (3 * 2 + ((long)(game.totalTime * 16) % 2)) * TANK_TEXTURE_SIZE;
-        DrawTexturePro(
-            *tex, (Rectangle){texX, 0, TANK_TEXTURE_SIZE, TANK_TEXTURE_SIZE},
+            (3 * 2 + ((long)(game->totalTime * 16) % 2)) * TANK_TEXTURE_SIZE;
+        drawSprite(
+            tex, (Rectangle){texX, 0, TANK_TEXTURE_SIZE, TANK_TEXTURE_SIZE},
             (Rectangle){x + 150,
                         topY + titleTexHeight * 2 - 174 +
-                            (game.lanMenu.lanMenuSelectedItem - 1) * 60,
+                            (game->lanMenu.lanMenuSelectedItem - 1) * 60,
                         TANK_TEXTURE_SIZE * 4, TANK_TEXTURE_SIZE * 4},
             (Vector2){}, 0, WHITE);
     }
 #endif
 }
 
-static void initHostGame() {
-    game.lan.addressLength = sizeof(struct sockaddr_in);
+// The dictionary is optional: without it snapshots are compressed as is.
+static void loadSnapshotDict(Lan *lan) {
+    FILE *f = fopen(SNAPSHOT_DICT_FILE, "rb");
+    if (!f) return;
+    fclose(f);
+    Buffer b = readFile(SNAPSHOT_DICT_FILE);
+    u32 dictId = ZSTD_getDictID_fromDict(b.bytes, b.size);
+    if (dictId) {
+        lan->cdict = ZSTD_createCDict(b.bytes, b.size, COMPRESSION_LEVEL);
+        lan->ddict = ZSTD_createDDict(b.bytes, b.size);
+        lan->dictId = dictId;
+    } else {
+        fprintf(stderr, "Invalid snapshot dictionary: %s\n",
+                SNAPSHOT_DICT_FILE);
+    }
+    free(b.bytes);
+}
+
+static void initLanCompression(Lan *lan) {
+    if (!lan->snapshots) lan->snapshots = calloc(1, sizeof(SnapshotHistory));
+    if (!lan->cctx) {
+        lan->cctx = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(lan->cctx, ZSTD_c_compressionLevel,
+                               COMPRESSION_LEVEL);
+        lan->dctx = ZSTD_createDCtx();
+        loadSnapshotDict(lan);
+    }
+    lan->dictMismatch = false;
+}
+
+// The server compresses with its dictionary only if the client has the same
+// one. zstd writes the dictionary ID into every frame header.
+static void useSnapshotDict(Lan *lan, u32 peerDictId) {
+    bool useDict = lan->dictId && lan->dictId == peerDictId;
+    ZSTD_CCtx_refCDict(lan->cctx, useDict ? lan->cdict : NULL);
+}
+
+// Picks the dictionary for a frame from the ID in its header.
+static bool selectSnapshotDict(Lan *lan, char *frame, size_t size) {
+    u32 dictId = ZSTD_getDictID_fromFrame(frame, size);
+    if (dictId && dictId != lan->dictId) {
+        if (!lan->dictMismatch) {
+            fprintf(stderr, "Snapshot dictionary mismatch: %u, have %u\n",
+                    dictId, lan->dictId);
+        }
+        lan->dictMismatch = true;
+        return false;
+    }
+    ZSTD_DCtx_refDDict(lan->dctx, dictId ? lan->ddict : NULL);
+    return true;
+}
+
+static void recordSnapshot(char *snapshot, size_t size) {
+    if (!snapshotRecording) return;
+    u8 header[4] = {size & 0xFF, (size >> 8) & 0xFF, (size >> 16) & 0xFF,
+                    (size >> 24) & 0xFF};
+    fwrite(header, sizeof(header), 1, snapshotRecording);
+    fwrite(snapshot, size, 1, snapshotRecording);
+}
+
+// Every snapshot gets a COMPRESSION_HEADER_SIZE header with the flags and a
+// sequence number. In stream mode a new frame starts every
+// STREAM_KEYFRAME_INTERVAL snapshots so clients can resync after a loss.
+static size_t compressSnapshot(Lan *lan, char *src, size_t srcSize,
+                               char *dst, size_t dstSize) {
+    u8 flags = 0;
+    u16 sequence = lan->streamSequence++;
+    char *out = dst + COMPRESSION_HEADER_SIZE;
+    size_t outSize = dstSize - COMPRESSION_HEADER_SIZE;
+    size_t size;
+    if (lan->compression == CMStream) {
+        flags |= CFStream;
+        if (sequence % STREAM_KEYFRAME_INTERVAL == 0) {
+            flags |= CFStreamStart;
+            ZSTD_CCtx_reset(lan->cctx, ZSTD_reset_session_only);
+        }
+        ZSTD_inBuffer in = {src, srcSize, 0};
+        ZSTD_outBuffer outBuffer = {out, outSize, 0};
+        size_t remaining =
+            ZSTD_compressStream2(lan->cctx, &outBuffer, &in, ZSTD_e_flush);
+        if (ZSTD_isError(remaining)) return remaining;
+        assert(remaining == 0);
+        size = outBuffer.pos;
+    } else {
+        size = ZSTD_compress2(lan->cctx, out, outSize, src, srcSize);
+        if (ZSTD_isError(size)) return size;
+        // Small deltas come out larger than they went in.
+        if (size >= srcSize) {
+            flags |= CFRaw;
+            memcpy(out, src, srcSize);
+            size = srcSize;
+        }
+    }
+    dst[0] = flags;
+    dst[1] = sequence & 0xFF;
+    dst[2] = sequence >> 8;
+    return COMPRESSION_HEADER_SIZE + size;
+}
+
+// Returns 0 for streamed snapshots that cannot be decoded until the next
+// frame starts.
+static size_t decompressSnapshot(Lan *lan, char *src, size_t srcSize,
+                                 char *dst, size_t dstSize) {
+    if (srcSize < COMPRESSION_HEADER_SIZE) return 0;
+    u8 flags = src[0];
+    u16 sequence = (u8)src[1] | ((u8)src[2] << 8);
+    char *in = src + COMPRESSION_HEADER_SIZE;
+    size_t inSize = srcSize - COMPRESSION_HEADER_SIZE;
+    if (flags & CFRaw) {
+        if (inSize > dstSize) return 0;
+        memcpy(dst, in, inSize);
+        return inSize;
+    }
+    if (!(flags & CFStream)) {
+        if (!selectSnapshotDict(lan, in, inSize)) return 0;
+        return ZSTD_decompressDCtx(lan->dctx, dst, dstSize, in, inSize);
+    }
+
+    if (flags & CFStreamStart) {
+        ZSTD_DCtx_reset(lan->dctx, ZSTD_reset_session_only);
+        lan->streamSynced = selectSnapshotDict(lan, in, inSize);
+        if (!lan->streamSynced) return 0;
+    } else if (!lan->streamSynced || sequence != lan->streamSequence) {
+        lan->streamSynced = false;
+        return 0;
+    }
+    lan->streamSequence = sequence + 1;
+
+    ZSTD_inBuffer inBuffer = {in, inSize, 0};
+    ZSTD_outBuffer outBuffer = {dst, dstSize, 0};
+    while (inBuffer.pos < inBuffer.size && outBuffer.pos < outBuffer.size) {
+        size_t result = ZSTD_decompressStream(lan->dctx, &outBuffer, &inBuffer);
+        if (ZSTD_isError(result)) {
+            lan->streamSynced = false;
+            return result;
+        }
+    }
+    return outBuffer.pos;
+}
+
+static void initHostGame(Game *game) {
+    game->lan.addressLength = sizeof(struct sockaddr_in);
+    game->lan.lockstep = game->lan.useLockstep;
+    game->lan.rollback = game->lan.useRollback;
+    initLanCompression(&game->lan);
+    initPacketBatch(&game->lan.received, MAX_COMPRESSED_PACKET_SIZE);
+    initPacketBatch(&game->lan.outgoing, MAX_COMPRESSED_PACKET_SIZE);
 
-    if ((game.lan.socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    if ((game->lan.socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("Socket failed");
         exit(1);
     }
 
-    fcntl(game.lan.socket, F_SETFL,
-          fcntl(game.lan.socket, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(game->lan.socket, F_SETFL,
+          fcntl(game->lan.socket, F_GETFL, 0) | O_NONBLOCK);
 
     int opt = 1;
-    setsockopt(game.lan.socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    setsockopt(game.lan.socket, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt));
+    setsockopt(game->lan.socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(game->lan.socket, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt));
 
-    memset(&game.lan.serverAddress, 0, sizeof(game.lan.serverAddress));
-    game.lan.serverAddress.sin_family = AF_INET;
-    game.lan.serverAddress.sin_addr.s_addr = INADDR_ANY;
-    game.lan.serverAddress.sin_port = htons(PORT);
+    memset(&game->lan.serverAddress, 0, sizeof(game->lan.serverAddress));
+    game->lan.serverAddress.sin_family = AF_INET;
+    game->lan.serverAddress.sin_addr.s_addr = INADDR_ANY;
+    game->lan.serverAddress.sin_port = htons(PORT);
 
-    if (bind(game.lan.socket, (struct sockaddr *)&game.lan.serverAddress,
-             sizeof(game.lan.serverAddress)) < 0) {
+    if (bind(game->lan.socket, (struct sockaddr *)&game->lan.serverAddress,
+             sizeof(game->lan.serverAddress)) < 0) {
         perror("Bind failed");
         exit(1);
     }
@@ -1871,50 +2376,69 @@ static void initHostGame() {
     printf("Server is running on port %d\n", PORT);
 }
 
-static void hostGameLogic() {
-    if (game.proceed) {
-        close(game.lan.socket);
-        setScreen(GSLan);
-        return;
-    }
-
-    char buffer[BUFFER_SIZE];
+// Host and client go through the same steps here, so a lockstep game
+// starts from the same state on both.
+static void startLanGame(Game *game) {
+    if (game->lan.lockstep) seedRng(&game->rng, game->lan.lockstepSeed);
+    game->isPaused = false;
+    setScreen(game, GSPlayLan);
+    initGameRun(game);
+    initStage(game, 1);
+    startNetThread(&game->lan);
+}
 
-    // checks all new packets in order.
-    while (true) {
-        int n = recvfrom(game.lan.socket, buffer, BUFFER_SIZE - 1, 0,
-                         (struct sockaddr *)&game.lan.clientAddress,
-                         &game.lan.addressLength);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            perror("recvfrom");
-            break;
+static void hostLobbyMessage(Game *game, char *buffer) {
+    if (strcmp(buffer, "DISCOVER") == 0) {
+        char reply[] = "AVAILABLE";
+        sendto(game->lan.socket, reply, strlen(reply), 0,
+               (struct sockaddr *)&game->lan.clientAddress,
+               game->lan.addressLength);
+        printf("Sent GAME_AVAILABLE to %s\n",
+               inet_ntoa(game->lan.clientAddress.sin_addr));
+    } else if (strncmp(buffer, "JOIN_REQUEST", 12) == 0) {
+        u32 clientDictId = 0;
+        sscanf(buffer + 12, "%u", &clientDictId);
+        useSnapshotDict(&game->lan, clientDictId);
+        char reply[64] = "JOIN_ACCEPT";
+        if (game->lan.lockstep) {
+            game->lan.lockstepSeed = game->seed;
+            snprintf(reply, sizeof(reply), "JOIN_ACCEPT %d %s %d %llu",
+                     TPlayer2, game->lan.rollback ? "ROLLBACK" : "LOCKSTEP",
+                     game->lan.inputDelay,
+                     (unsigned long long)game->lan.lockstepSeed);
         }
+        sendto(game->lan.socket, reply, strlen(reply), 0,
+               (struct sockaddr *)&game->lan.clientAddress,
+               game->lan.addressLength);
+        printf("%s wants to join your game, sending join accept message\n",
+               inet_ntoa(game->lan.clientAddress.sin_addr));
+        startLanGame(game);
+    }
+}
 
-        buffer[n] = '\0';
+static void hostGameLogic(Game *game) {
+    if (game->proceed) {
+        closeLanSocket(&game->lan);
+        setScreen(game, GSLan);
+        return;
+    }
 
-        if (strcmp(buffer, "DISCOVER") == 0) {
-            char reply[] = "AVAILABLE";
-            sendto(game.lan.socket, reply, strlen(reply), 0,
-                   (struct sockaddr *)&game.lan.clientAddress,
-                   game.lan.addressLength);
-            printf("Sent GAME_AVAILABLE to %s\n",
-                   inet_ntoa(game.lan.clientAddress.sin_addr));
-        } else if (strcmp(buffer, "JOIN_REQUEST") == 0) {
-            char reply[] = "JOIN_ACCEPT";
-            sendto(game.lan.socket, reply, strlen(reply), 0,
-                   (struct sockaddr *)&game.lan.clientAddress,
-                   game.lan.addressLength);
-            printf("%s wants to join your game, sending join accept message\n",
-                   inet_ntoa(game.lan.clientAddress.sin_addr));
-            setScreen(GSPlayLan);
-            initGameRun();
-            initStage(1);
+    // checks all new packets in order.
+    PacketBatch *batch = &game->lan.received;
+    while (receivePackets(game->lan.socket, batch) > 0) {
+        for (int i = 0; i < batch->count; i++) {
+            char *buffer = packetBuffer(batch, i);
+            buffer[batch->sizes[i]] = '\0';
+            game->lan.clientAddress = batch->addresses[i];
+            hostLobbyMessage(game, buffer);
+            // The network thread owns the socket once the game starts.
+            if (game->screen != GSHostGame) return;
         }
+        if (batch->count < PACKET_BATCH_SIZE) break;
     }
 }
 
-static void drawHostGame() {
+static void drawHostGame(Game *game) {
     static const int N = 256;
     char text[N];
     snprintf(text, N, "WAITING FOR PLAYER...");
@@ -1925,144 +2449,174 @@ static void drawHostGame() {
              SCREEN_HEIGHT / 2 + 50, FONT_SIZE * 1, RED);
 }
 
-static void discoverGames() {
-    memset(game.lan.joinableAddresses, 0, sizeof(game.lan.joinableAddresses));
-    game.lan.availableGames = 0;
-    game.lan.selectedAddressIndex = -1;
+static void discoverGames(Game *game) {
+    memset(game->lan.joinableAddresses, 0, sizeof(game->lan.joinableAddresses));
+    game->lan.availableGames = 0;
+    game->lan.selectedAddressIndex = -1;
 
     char msg[] = "DISCOVER";
-    sendto(game.lan.socket, msg, strlen(msg), 0,
-           (struct sockaddr *)&game.lan.broadcastAddress,
-           game.lan.addressLength);
+    sendto(game->lan.socket, msg, strlen(msg), 0,
+           (struct sockaddr *)&game->lan.broadcastAddress,
+           game->lan.addressLength);
 
     printf("Discovering joinable games...\n");
 }
 
-static void initJoinGame() {
-    game.lan.addressLength = sizeof(struct sockaddr_in);
-    if ((game.lan.socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+static void initJoinGame(Game *game) {
+    game->lan.addressLength = sizeof(struct sockaddr_in);
+    initLanCompression(&game->lan);
+    initPacketBatch(&game->lan.received, MAX_COMPRESSED_PACKET_SIZE);
+    initPacketBatch(&game->lan.outgoing, MAX_COMPRESSED_PACKET_SIZE);
+    if ((game->lan.socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         perror("Socket failed");
         exit(1);
     }
 
-    fcntl(game.lan.socket, F_SETFL,
-          fcntl(game.lan.socket, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(game->lan.socket, F_SETFL,
+          fcntl(game->lan.socket, F_GETFL, 0) | O_NONBLOCK);
 
     int opt = 1;
-    setsockopt(game.lan.socket, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt));
+    setsockopt(game->lan.socket, SOL_SOCKET, SO_BROADCAST, &opt, sizeof(opt));
 
-    memset(&game.lan.broadcastAddress, 0, sizeof(game.lan.broadcastAddress));
-    game.lan.broadcastAddress.sin_family = AF_INET;
-    game.lan.broadcastAddress.sin_port = htons(PORT);
-    inet_pton(AF_INET, BROADCAST_IP, &game.lan.broadcastAddress.sin_addr);
+    memset(&game->lan.broadcastAddress, 0, sizeof(game->lan.broadcastAddress));
+    game->lan.broadcastAddress.sin_family = AF_INET;
+    game->lan.broadcastAddress.sin_port = htons(PORT);
+    inet_pton(AF_INET, BROADCAST_IP, &game->lan.broadcastAddress.sin_addr);
 
-    discoverGames();
+    discoverGames(game);
 }
 
-static bool foundGame() {
-    if (game.lan.availableGames < MAX_AVAILABLE_GAMES) {
-        game.lan.availableGames++;
+static bool foundGame(Game *game) {
+    if (game->lan.availableGames < MAX_AVAILABLE_GAMES) {
+        game->lan.availableGames++;
         return true;
     } else {
         return false;
     }
 }
 
-static void joinGameLogic() {
-    char buffer[BUFFER_SIZE];
-
-    // checks all new packets in order.
-    while (true) {
-        int n = recvfrom(game.lan.socket, buffer, BUFFER_SIZE - 1, 0,
-                         (struct sockaddr *)&game.lan.serverAddress,
-                         &game.lan.addressLength);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            perror("recvfrom");
-            break;
+static void joinLobbyMessage(Game *game, char *buffer) {
+    if (strcmp(buffer, "AVAILABLE") == 0) {
+        printf("Found available game from %s\n",
+               inet_ntoa(game->lan.serverAddress.sin_addr));
+        if (foundGame(game)) {
+            game->lan.joinableAddresses[game->lan.availableGames - 1] =
+                game->lan.serverAddress;
         }
+    } else if (strncmp(buffer, "JOIN_ACCEPT", 11) == 0 ||
+               strcmp(buffer, "SPECTATE_ACCEPT") == 0) {
+        // A dedicated server says which tank is ours, a host always gives
+        // player 2.
+        // A lockstep or rollback host adds the input delay and the seed.
+        int tank = TPlayer2;
+        char mode[16] = "";
+        unsigned long long seed = 0;
+        game->lan.isSpectator = buffer[0] == 'S';
+        game->lan.lockstep =
+            !game->lan.isSpectator &&
+            sscanf(buffer + 11, "%d %15s %d %llu", &tank, mode,
+                   &game->lan.inputDelay, &seed) == 4;
+        game->lan.rollback =
+            game->lan.lockstep && strcmp(mode, "ROLLBACK") == 0;
+        game->lan.lockstepSeed = seed;
+        game->lan.localTank = tank == TPlayer1 ? TPlayer1 : TPlayer2;
+        printf("%s has accepted your join request, joining game now\n",
+               inet_ntoa(game->lan.serverAddress.sin_addr));
+        startLanGame(game);
+    }
+}
 
-        buffer[n] = '\0';
-
-        if (strcmp(buffer, "AVAILABLE") == 0) {
-            printf("Found available game from %s\n",
-                   inet_ntoa(game.lan.serverAddress.sin_addr));
-            if (foundGame()) {
-                game.lan.joinableAddresses[game.lan.availableGames - 1] =
-                    game.lan.serverAddress;
-            }
-        } else if (strcmp(buffer, "JOIN_ACCEPT") == 0) {
-            printf("%s has accepted your join request, joining game now\n",
-                   inet_ntoa(game.lan.serverAddress.sin_addr));
-            setScreen(GSPlayLan);
-            initGameRun();
-            initStage(1);
+static void joinGameLogic(Game *game) {
+    // checks all new packets in order.
+    PacketBatch *batch = &game->lan.received;
+    while (receivePackets(game->lan.socket, batch) > 0) {
+        for (int i = 0; i < batch->count; i++) {
+            char *buffer = packetBuffer(batch, i);
+            buffer[batch->sizes[i]] = '\0';
+            game->lan.serverAddress = batch->addresses[i];
+            joinLobbyMessage(game, buffer);
+            // The network thread owns the socket once the game starts.
+            if (game->screen != GSJoinGame) return;
         }
+        if (batch->count < PACKET_BATCH_SIZE) break;
     }
 
-    if (IsKeyPressed(KEY_LEFT_SHIFT)) {
-        game.lan.selectedAddressIndex++;
-        if (game.lan.selectedAddressIndex >= game.lan.availableGames)
-            game.lan.selectedAddressIndex = -2;
+    // Menu order: refresh (-1), play or watch (-3), the games, back (-2).
+    if (game->switchMode) {
+        int *item = &game->lan.selectedAddressIndex;
+        *item = *item == -1 ? -3 : *item == -3 ? 0 : *item + 1;
+        if (*item >= game->lan.availableGames) *item = -2;
     }
 
-    if (game.proceed) {
-        if (game.lan.selectedAddressIndex == -2) {
-            setScreen(GSLan);
-        }
-        if (game.lan.selectedAddressIndex == -1) {
-            discoverGames();
+    if (game->proceed) {
+        if (game->lan.selectedAddressIndex == -2) {
+            setScreen(game, GSLan);
+        } else if (game->lan.selectedAddressIndex == -1) {
+            discoverGames(game);
+        } else if (game->lan.selectedAddressIndex == -3) {
+            game->lan.isSpectator = !game->lan.isSpectator;
         } else {
-            char msg[] = "JOIN_REQUEST";
-            sendto(game.lan.socket, msg, strlen(msg), 0,
-                   (struct sockaddr *)&game.lan
-                       .joinableAddresses[game.lan.selectedAddressIndex],
-                   game.lan.addressLength);
+            char msg[32];
+            snprintf(msg, sizeof(msg), "%s %u",
+                     game->lan.isSpectator ? "SPECTATE_REQUEST"
+                                           : "JOIN_REQUEST",
+                     game->lan.dictId);
+            sendto(game->lan.socket, msg, strlen(msg), 0,
+                   (struct sockaddr *)&game->lan
+                       .joinableAddresses[game->lan.selectedAddressIndex],
+                   game->lan.addressLength);
         }
     }
 }
 
-static void drawJoinGame() {
+static void drawJoinGame(Game *game) {
     static const int N = 256;
     char text[N];
     snprintf(text, N, "FINDING GAMES");
     drawText(text, centerX(measureText(text, FONT_SIZE * 1.5)), 80,
              FONT_SIZE * 1.5, WHITE);
 
-    int y = 400;
+    int y = 320;
     snprintf(text, N, "REFRESH");
     drawText(text, centerX(measureText(text, FONT_SIZE)), y, FONT_SIZE,
-             game.lan.selectedAddressIndex == -1 ? RED : WHITE);
+             game->lan.selectedAddressIndex == -1 ? RED : WHITE);
 
-    for (int i = 0; i < game.lan.availableGames; i++) {
+    y += 80;
+    snprintf(text, N, game->lan.isSpectator ? "WATCH" : "PLAY");
+    drawText(text, centerX(measureText(text, FONT_SIZE)), y, FONT_SIZE,
+             game->lan.selectedAddressIndex == -3 ? RED : WHITE);
+
+    for (int i = 0; i < game->lan.availableGames; i++) {
         y += 80;
         snprintf(text, N, "GAME: %s",
-                 inet_ntoa(game.lan.joinableAddresses[i].sin_addr));
+                 inet_ntoa(game->lan.joinableAddresses[i].sin_addr));
         drawText(text, centerX(measureText(text, FONT_SIZE)), y, FONT_SIZE,
-                 game.lan.selectedAddressIndex == i ? RED : WHITE);
+                 game->lan.selectedAddressIndex == i ? RED : WHITE);
     }
 
     y += 100;
     snprintf(text, N, "BACK");
     drawText(text, centerX(measureText(text, FONT_SIZE)), y, FONT_SIZE,
-             game.lan.selectedAddressIndex == -2 ? RED : WHITE);
+             game->lan.selectedAddressIndex == -2 ? RED : WHITE);
 }
 
-static void checkTimeout() {
-    game.lan.timeout += game.frameTime;
-    if (game.lan.timeout > TIMEOUT) {
-        close(game.lan.socket);
+static void checkTimeout(Game *game) {
+    game->lan.timeout += game->frameTime;
+    if (game->lan.timeout > TIMEOUT) {
+        closeLanSocket(&game->lan);
         printf("Connection timed out!");
-        setScreen(GSTimedOut);
+        setScreen(game, GSTimedOut);
     }
 }
 
-static void timedOutLogic() {
-    game.lan.timeoutScreenTime += game.frameTime;
-    if (game.lan.timeoutScreenTime > TIMEOUT_SCREEN_TIME) setScreen(GSTitle);
+static void timedOutLogic(Game *game) {
+    game->lan.timeoutScreenTime += game->frameTime;
+    if (game->lan.timeoutScreenTime > TIMEOUT_SCREEN_TIME) {
+        setScreen(game, GSTitle);
+    }
 }
 
-static void drawTimedOut() {
+static void drawTimedOut(Game *game) {
     static const int N = 64;
     char text[N];
     snprintf(text, N, "CONNECTION TIMED OUT!");
@@ -2070,145 +2624,365 @@ static void drawTimedOut() {
              SCREEN_HEIGHT / 2, FONT_SIZE * 1.5, RED);
 }
 
-static void gameLogic() {
-    if (!game.stageCurtainTime) {
-        if (game.proceed) {
-            game.stageCurtainTime = 0.001;
+static void gameLogic(Game *game) {
+    if (!game->stageCurtainTime) {
+        if (game->proceed) {
+            game->stageCurtainTime = 0.001;
         }
     }
-    if (game.stageCurtainTime && !game.isStageCurtainSoundPlayed) {
-        playSfx(SFX_START_MENU);
-        game.isStageCurtainSoundPlayed = true;
+    if (game->stageCurtainTime && !game->isStageCurtainSoundPlayed) {
+        playSfx(game, SFX_START_MENU);
+        game->isStageCurtainSoundPlayed = true;
     }
-    if (game.stageCurtainTime && game.stageCurtainTime < STAGE_CURTAIN_TIME) {
-        game.stageCurtainTime += game.frameTime;
+    if (game->stageCurtainTime && game->stageCurtainTime < STAGE_CURTAIN_TIME) {
+        game->stageCurtainTime += game->frameTime;
     }
-    if (game.stageCurtainTime < STAGE_CURTAIN_TIME) return;
-    if (game.proceed) {
-        game.isPaused = !game.isPaused;
-        if (game.isPaused) {
-            playSfx(SFX_GAME_PAUSE);
+    if (game->stageCurtainTime < STAGE_CURTAIN_TIME) return;
+    if (game->proceed) {
+        game->isPaused = !game->isPaused;
+        if (game->isPaused) {
+            playSfx(game, SFX_GAME_PAUSE);
         }
     }
-    if (game.isPaused) return;
-    if (game.gameOverTime &&
-        game.gameOverTime < GAME_OVER_SLIDE_TIME + GAME_OVER_DELAY) {
-        game.gameOverTime += game.frameTime;
+    if (game->isPaused) return;
+    if (game->gameOverTime &&
+        game->gameOverTime < GAME_OVER_SLIDE_TIME + GAME_OVER_DELAY) {
+        game->gameOverTime += game->frameTime;
     }
-    game.timeSinceSpawn += game.frameTime;
-    if (game.timerPowerUpTimeLeft > 0) {
-        game.timerPowerUpTimeLeft -= game.frameTime;
+    game->timeSinceSpawn += game->frameTime;
+    if (game->timerPowerUpTimeLeft > 0) {
+        game->timerPowerUpTimeLeft -= game->frameTime;
     }
-    if (game.shovelPowerUpTimeLeft > 0) {
-        game.shovelPowerUpTimeLeft -= game.frameTime;
-        if (game.shovelPowerUpTimeLeft <= 0) {
+    if (game->shovelPowerUpTimeLeft > 0) {
+        game->shovelPowerUpTimeLeft -= game->frameTime;
+        if (game->shovelPowerUpTimeLeft <= 0) {
             for (int i = 0; i < ASIZE(fortressWall); i++) {
-                game.field[fortressWall[i].row][fortressWall[i].col].type =
-                    CTBrick;
+                setCellType(game, fortressWall[i].row, fortressWall[i].col,
+                            CTBrick);
             }
         }
     }
-    if (game.tanks[TPlayer1].shieldTimeLeft > 0) {
-        game.tanks[TPlayer1].shieldTimeLeft -= game.frameTime;
+    if (game->tanks[TPlayer1].shieldTimeLeft > 0) {
+        game->tanks[TPlayer1].shieldTimeLeft -= game->frameTime;
     }
-    if (game.tanks[TPlayer2].shieldTimeLeft > 0) {
-        game.tanks[TPlayer2].shieldTimeLeft -= game.frameTime;
+    if (game->tanks[TPlayer2].shieldTimeLeft > 0) {
+        game->tanks[TPlayer2].shieldTimeLeft -= game->frameTime;
     }
-    if (game.tanks[TPlayer1].immobileTimeLeft > 0) {
-        game.tanks[TPlayer1].immobileTimeLeft -= game.frameTime;
+    if (game->tanks[TPlayer1].immobileTimeLeft > 0) {
+        game->tanks[TPlayer1].immobileTimeLeft -= game->frameTime;
     }
-    if (game.tanks[TPlayer2].immobileTimeLeft > 0) {
-        game.tanks[TPlayer2].immobileTimeLeft -= game.frameTime;
+    if (game->tanks[TPlayer2].immobileTimeLeft > 0) {
+        game->tanks[TPlayer2].immobileTimeLeft -= game->frameTime;
     }
-    if (game.tanks[TPlayer1].slidingTimeLeft > 0) {
-        game.tanks[TPlayer1].slidingTimeLeft -= game.frameTime;
+    if (game->tanks[TPlayer1].slidingTimeLeft > 0) {
+        game->tanks[TPlayer1].slidingTimeLeft -= game->frameTime;
     }
-    if (game.tanks[TPlayer2].slidingTimeLeft > 0) {
-        game.tanks[TPlayer2].slidingTimeLeft -= game.frameTime;
+    if (game->tanks[TPlayer2].slidingTimeLeft > 0) {
+        game->tanks[TPlayer2].slidingTimeLeft -= game->frameTime;
     }
-    handleInput();
-    handleAI();
-    updateGameState();
+    handleInput(game);
+    handleAI(game);
+    updateGameState(game);
 }
 
-static void lanGameClient() {
-    struct sockaddr_in recvAddress;
+// Replays the inputs from fromInputTick on, on top of the last snapshot, so
+// the client's tank moves without waiting for the host.
+static void predictClientTank(Game *game, long fromInputTick) {
+    Tank *t = &game->tanks[game->lan.localTank];
+    if (t->status != TSActive || game->stageCurtainTime < STAGE_CURTAIN_TIME ||
+        game->isPaused || game->gameOverTime > 0) {
+        return;
+    }
+    fromInputTick =
+        MAX(fromInputTick, game->lan.inputTick - INPUT_HISTORY_SIZE + 1);
+    for (long i = fromInputTick; i <= game->lan.inputTick; i++) {
+        moveTank(game, t,
+                 game->lan.inputHistory[i % INPUT_HISTORY_SIZE].command,
+                 false);
+    }
+}
 
-    char buffer[MAX_PACKET_SIZE + 1];
-    while (true) {
-        int n =
-            recvfrom(game.lan.socket, buffer, MAX_PACKET_SIZE, 0,
-                     (struct sockaddr *)&recvAddress, &game.lan.addressLength);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            perror("recvfrom");
-            break;
-        }
+// Counts snapshots lost between the sequence numbers the host stamps on
+// them. Late and duplicate packets count as received but not as expected.
+static void trackSnapshotLoss(Lan *lan, u16 sequence) {
+    u16 gap = sequence - lan->lastSequence;
+    if (!lan->hasSequence) {
+        lan->hasSequence = true;
+        gap = 1;
+    } else if (gap == 0 || gap > 0x8000) {
+        gap = 0;
+    }
+    if (gap) lan->lastSequence = sequence;
+    lan->windowExpected += gap;
+    lan->windowReceived++;
+    if (lan->windowExpected >= LOSS_WINDOW) {
+        int lost = MAX(0, lan->windowExpected - lan->windowReceived);
+        atomic_store_explicit(&lan->lossPercent,
+                              lost * 100 / lan->windowExpected,
+                              memory_order_relaxed);
+        lan->windowExpected = 0;
+        lan->windowReceived = 0;
+    }
+}
 
-        if (recvAddress.sin_addr.s_addr !=
-                game.lan.serverAddress.sin_addr.s_addr ||
-            recvAddress.sin_port != game.lan.serverAddress.sin_port) {
-            continue;
-        }
+// RFC 3550 interarrival jitter and the spacing of snapshots, both in ticks.
+static void updateSnapshotTiming(Lan *lan, long tick) {
+    long transit = lan->clientTick - tick;
+    if (lan->latestTick) {
+        lan->jitter += (labs(transit - lan->transit) - lan->jitter) / 16;
+        lan->snapshotInterval +=
+            (tick - lan->latestTick - lan->snapshotInterval) / 16;
+    }
+    lan->transit = transit;
+    lan->latestTick = tick;
+}
 
-        game.lan.timeout = 0;
+// Plays back one tick, running slightly fast or slow to keep the buffered
+// delay near its target.
+static void advanceRenderTick(Lan *lan) {
+    float delay = lan->snapshotInterval + 2 * lan->jitter + 1;
+    if (lan->isSpectator) delay += SPECTATOR_DELAY;
+    double lag = lan->latestTick - lan->renderTick;
+    if (lan->renderTick == 0 || lag > SNAPSHOT_HISTORY_SIZE / 2) {
+        lan->renderTick = lan->latestTick - delay;
+    } else if (lag > delay + 1) {
+        lan->renderTick += 1.05;
+    } else if (lag < delay - 1) {
+        lan->renderTick += 0.95;
+    } else {
+        lan->renderTick += 1;
+    }
+    lan->renderTick = MIN(lan->renderTick, lan->latestTick);
+}
 
-        buffer[n] = '\0';
+static void playSnapshotSfx(Game *game, GameStatePacket *packet) {
+    for (int i = 0; i < MAX_SFX_PLAYED; i++) {
+        if (packet->sfxPlayed[i] == SFX_MAX) break;
+        playSound(game, assets.sounds.sfx[packet->sfxPlayed[i]]);
+    }
+}
 
-        char decompressed[MAX_PACKET_SIZE];
-        size_t decompressedSize =
-            ZSTD_decompress(decompressed, sizeof(decompressed), buffer, n);
+// Applies the newest buffered snapshot at renderTick and interpolates
+// towards the next one. The client's own tank is predicted from the newest
+// snapshot instead.
+static void playBufferedSnapshots(Game *game) {
+    Lan *lan = &game->lan;
+    if (!lan->latestTick) return;
+    advanceRenderTick(lan);
+
+    GameStatePacket *from = NULL, *to = NULL;
+    long oldestTick = lan->latestTick - SNAPSHOT_HISTORY_SIZE / 2;
+    for (long tick = lan->renderTick; !from && tick > oldestTick; tick--) {
+        from = findSnapshot(lan->snapshots, tick);
+    }
+    if (!from) return;
+    for (long tick = from->tick + 1; !to && tick <= lan->latestTick; tick++) {
+        to = findSnapshot(lan->snapshots, tick);
+    }
 
-        if (ZSTD_isError(decompressedSize)) {
-            fprintf(stderr, "ZSTD decompression failed: %s\n",
-                    ZSTD_getErrorName(decompressedSize));
-            return;
+    bool isNewSnapshot = from->tick != game->tick;
+    if (isNewSnapshot) {
+        for (long tick = MAX(game->tick + 1, oldestTick); tick <= from->tick;
+             tick++) {
+            GameStatePacket *packet = findSnapshot(lan->snapshots, tick);
+            if (packet) playSnapshotSfx(game, packet);
         }
+    }
+    applyGameStatePacket(game, from);
+    if (to) {
+        interpolateGameState(game, from, to,
+                             (lan->renderTick - from->tick) /
+                                 (to->tick - from->tick));
+    }
+    if (isNewSnapshot) {
+        rebuildFieldMasks(game);
+        updatePlayerLifesUI(game);
+    }
+    rebuildBulletLists(game);
+    rebuildTankGrid(game);
+    if (game->screen != from->screen) {
+        setScreen(game, from->screen);
+    }
+    if (game->stage != from->stage) {
+        initStage(game, from->stage);
+    }
 
-        GameStatePacket packet = unpackGameState(&game, decompressed);
+    if (lan->isSpectator) return;
+    GameStatePacket *latest = findSnapshot(lan->snapshots, lan->latestTick);
+    Tank *own = &game->tanks[lan->localTank];
+    unpackTank(own, &latest->tanks[lan->localTank]);
+    updateTankGrid(game, own);
+    predictClientTank(game, latest->inputTick + 1);
+}
 
-        if (packet.tick != game.tick) continue;
-        updatePlayerLifesUI();
-        if (game.screen != packet.screen) {
-            setScreen(packet.screen);
-        }
-        if (game.stage != packet.stage) {
-            initStage(packet.stage);
+static double benchTime(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void countNet(Lan *lan, NetCounter counter, long amount) {
+    atomic_fetch_add_explicit(&lan->netCounters[counter], amount,
+                              memory_order_relaxed);
+}
+
+// Notes when packets for the ticks up to tick first go out.
+static void stampSend(Lan *lan, long tick) {
+    double now = benchTime();
+    for (long t = MAX(lan->stampedTick + 1, tick - INPUT_HISTORY_SIZE + 1);
+         t <= tick; t++) {
+        lan->sendStamps[t % INPUT_HISTORY_SIZE] = (SendStamp){t, now};
+    }
+    lan->stampedTick = MAX(lan->stampedTick, tick);
+}
+
+// Takes a round trip sample when the peer echoes a newer tick.
+static void sampleRtt(Lan *lan, long tick) {
+    if (tick <= lan->echoedTick) return;
+    lan->echoedTick = tick;
+    SendStamp *stamp = &lan->sendStamps[tick % INPUT_HISTORY_SIZE];
+    if (stamp->tick != tick) return;
+    countNet(lan, NCRttTime, (benchTime() - stamp->time) * 1e6);
+    countNet(lan, NCRttSamples, 1);
+}
+
+static void receiveSnapshot(Lan *lan, char *buffer, int size) {
+    // Drops the lockstep packets a host sends until it falls back too.
+    if (size < COMPRESSION_HEADER_SIZE || (u8)buffer[0] == LOCKSTEP_MARKER) {
+        return;
+    }
+    trackSnapshotLoss(lan, (u8)buffer[1] | ((u8)buffer[2] << 8));
+
+    double start = benchTime();
+    char decompressed[MAX_PACKET_SIZE];
+    size_t decompressedSize = decompressSnapshot(
+        lan, buffer, size, decompressed, sizeof(decompressed));
+    if (decompressedSize == 0) return;
+
+    if (ZSTD_isError(decompressedSize)) {
+        fprintf(stderr, "ZSTD decompression failed: %s\n",
+                ZSTD_getErrorName(decompressedSize));
+        return;
+    }
+
+    GameStatePacket *packet = unpackGameState(
+        lan->netSnapshots, lan->netTick, decompressed, decompressedSize);
+    if (!packet) return;
+    countNet(lan, NCCodecTime, (benchTime() - start) * 1e9);
+    countNet(lan, NCCodedSnapshots, 1);
+    countNet(lan, NCRawBytes, decompressedSize);
+    countNet(lan, NCCompressedBytes, size);
+    if (!lan->isSpectator) sampleRtt(lan, packet->inputTick);
+    lan->netTick = MAX(lan->netTick, packet->tick);
+    GameStatePacket *slot = ringWriteSlot(&lan->inbox);
+    if (!slot) return;
+    *slot = *packet;
+    ringPush(&lan->inbox);
+}
+
+static int receiveLanPackets(Lan *lan) {
+    PacketBatch *batch = &lan->received;
+    int count = receivePackets(lan->socket, batch);
+    countNet(lan, NCPacketsIn, batch->count);
+    for (int i = 0; i < batch->count; i++) {
+        countNet(lan, NCBytesIn, batch->sizes[i]);
+    }
+    return count;
+}
+
+// Sends the outgoing batch, or hands it to the network emulator.
+static void sendLanPackets(Lan *lan) {
+    countNet(lan, NCPacketsOut, lan->outgoing.count);
+    for (int i = 0; i < lan->outgoing.count; i++) {
+        countNet(lan, NCBytesOut, lan->outgoing.sizes[i]);
+    }
+    if (lan->netEmulator) {
+        emulatePackets(lan->netEmulator, &lan->outgoing, benchTime());
+    } else {
+        sendPackets(lan->socket, &lan->outgoing);
+    }
+}
+
+static bool isFrom(struct sockaddr_in *address, struct sockaddr_in *peer) {
+    return address->sin_addr.s_addr == peer->sin_addr.s_addr &&
+           address->sin_port == peer->sin_port;
+}
+
+// Network thread, client side: decodes snapshots into its own history for
+// the game loop and sends the queued input packets with the newest ack.
+static void clientNetworkStep(Lan *lan) {
+    PacketBatch *batch = &lan->received;
+    while (receiveLanPackets(lan) > 0) {
+        for (int i = 0; i < batch->count; i++) {
+            if (!isFrom(&batch->addresses[i], &lan->serverAddress)) continue;
+            receiveSnapshot(lan, packetBuffer(batch, i), batch->sizes[i]);
         }
+        if (batch->count < PACKET_BATCH_SIZE) break;
     }
 
-    memset(game.lan.clientInput, 0, CLIENT_INPUT_SIZE);
+    InputPacket *input;
+    char *buffer;
+    while ((input = ringReadSlot(&lan->outbox)) &&
+           (buffer = nextPacket(&lan->outgoing))) {
+        input->lossPercent = lan->lossPercent;
+        stampSend(lan, input->inputTick);
+        size_t size = writeInputPacket(buffer, lan->netTick, input);
+        queuePacket(&lan->outgoing, size, &lan->serverAddress);
+        ringPop(&lan->outbox);
+    }
+    sendLanPackets(lan);
+}
 
-    if (IsKeyDown(controls[0].right)) game.lan.clientInput[0] = 1;
-    if (IsKeyDown(controls[0].left)) game.lan.clientInput[1] = 1;
-    if (IsKeyDown(controls[0].up)) game.lan.clientInput[2] = 1;
-    if (IsKeyDown(controls[0].down)) game.lan.clientInput[3] = 1;
-    if (IsKeyPressed(controls[0].fire)) game.lan.clientInput[4] = 1;
-    if (IsKeyPressed(KEY_ENTER)) game.lan.clientInput[5] = 1;
+// Halves the send rate while the client reports loss and speeds it back up
+// one step per two loss free seconds.
+static void updateSendInterval(Lan *lan, long tick) {
+    long sinceChange = tick - lan->lastRateChangeTick;
+    if (lan->reportedLoss >= LOSS_BACKOFF_PERCENT) {
+        if (sinceChange < TICK_RATE) return;
+        lan->sendInterval =
+            MIN(lan->sendInterval * 2, TICK_RATE / MIN_NET_RATE);
+        lan->lastRateChangeTick = tick;
+    } else if (lan->sendInterval > lan->minSendInterval &&
+               sinceChange >= 2 * TICK_RATE) {
+        lan->sendInterval--;
+        lan->lastRateChangeTick = tick;
+    }
+}
 
-    ssize_t sent = sendto(
-        game.lan.socket, game.lan.clientInput, CLIENT_INPUT_SIZE, 0,
-        (struct sockaddr *)&game.lan.serverAddress, game.lan.addressLength);
-    if (sent < 0) {
-        perror("sendto");
+// Sounds of the ticks between two snapshots ride along with the next one.
+// Returns whether a snapshot is due this tick.
+static bool snapshotDue(Lan *lan, long tick, const SfxType *sfxPlayed) {
+    for (int i = 0, j = 0; i < MAX_SFX_PLAYED; i++) {
+        if (sfxPlayed[i] == SFX_MAX) break;
+        while (j < MAX_SFX_PLAYED && lan->pendingSfx[j] != SFX_MAX) j++;
+        if (j == MAX_SFX_PLAYED) break;
+        lan->pendingSfx[j] = sfxPlayed[i];
     }
+    updateSendInterval(lan, tick);
+    return tick >= lan->nextSendTick;
+}
 
+// Stamps a filled snapshot with what is specific to this client.
+static void markSnapshotSent(Lan *lan, long tick, GameStatePacket *packet) {
+    lan->nextSendTick = tick + lan->sendInterval;
+    packet->inputTick = lan->inputTick;
+    memcpy(packet->sfxPlayed, lan->pendingSfx, sizeof(packet->sfxPlayed));
     for (int i = 0; i < MAX_SFX_PLAYED; i++) {
-        if (game.sfxPlayed[i] == SFX_MAX) break;
-        playSound(game.sounds.sfx[game.sfxPlayed[i]]);
+        lan->pendingSfx[i] = SFX_MAX;
     }
 }
 
-static void lanGameServerSend() {
-    game.tick++;
-
+static void queueSnapshot(Lan *lan, GameStatePacket *packet,
+                          PacketBatch *batch, char *buffer) {
+    double start = benchTime();
     char rawBuffer[MAX_PACKET_SIZE];
-    size_t rawSize = packGameState(&game, rawBuffer);
-
-    char compressedBuffer[MAX_PACKET_SIZE];
+    size_t rawSize =
+        encodeSnapshot(packet, lan->netSnapshots, lan->ackedTick, rawBuffer);
+    lan->netTick = packet->tick;
+    recordSnapshot(rawBuffer, rawSize);
 
-    size_t compressedSize = ZSTD_compress(
-        compressedBuffer, sizeof(compressedBuffer), rawBuffer, rawSize, 7);
+    size_t compressedSize = compressSnapshot(lan, rawBuffer, rawSize, buffer,
+                                             MAX_COMPRESSED_PACKET_SIZE);
 
     if (ZSTD_isError(compressedSize)) {
         fprintf(stderr, "ZSTD compression failed: %s\n",
@@ -2216,123 +2990,1855 @@ static void lanGameServerSend() {
         return;
     }
 
-    sendto(game.lan.socket, compressedBuffer, compressedSize, 0,
-           (struct sockaddr *)&game.lan.clientAddress, game.lan.addressLength);
+    countNet(lan, NCCodecTime, (benchTime() - start) * 1e9);
+    countNet(lan, NCCodedSnapshots, 1);
+    countNet(lan, NCRawBytes, rawSize);
+    countNet(lan, NCCompressedBytes, compressedSize);
+    stampSend(lan, packet->tick);
+    queuePacket(batch, compressedSize, &lan->clientAddress);
+}
+
+// Later snapshots are encoded against the newest one the client has.
+static void ackSnapshot(Lan *lan, long ackedTick) {
+    if (ackedTick > lan->ackedTick && ackedTick <= lan->netTick) {
+        lan->ackedTick = ackedTick;
+    }
 }
 
-static void lanGameServerRecieve() {
-    bool fire = false;
-    bool enter = false;
+// Only the size tells input packets from the lockstep ones a client sends
+// until it falls back too: an ack can start with LOCKSTEP_MARKER.
+static void receiveInputPacket(Lan *lan, char *buffer, int size) {
+    if (size != CLIENT_PACKET_SIZE) return;
+    InputPacket input;
+    long ackedTick = readInputPacket(buffer, &input);
+    sampleRtt(lan, ackedTick);
+    ackSnapshot(lan, ackedTick);
+    InputPacket *slot = ringWriteSlot(&lan->inbox);
+    if (!slot) return;
+    *slot = input;
+    ringPush(&lan->inbox);
+}
 
-    struct sockaddr_in recvAddress;
+static void initSpectatorFeed(Lan *lan) {
+    if (!lan->spectatorFeed) {
+        Lan *feed = calloc(1, sizeof(Lan));
+        feed->cctx = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(feed->cctx, ZSTD_c_compressionLevel,
+                               COMPRESSION_LEVEL);
+        feed->netSnapshots = calloc(1, sizeof(SnapshotHistory));
+        initPacketBatch(&lan->spectatorBatch, MAX_COMPRESSED_PACKET_SIZE);
+        lan->spectatorFeed = feed;
+    }
+    Lan *feed = lan->spectatorFeed;
+    feed->compression = lan->compression;
+    feed->netRate = SPECTATOR_NET_RATE;
+    resetLanSession(feed);
+    ZSTD_CCtx_reset(feed->cctx, ZSTD_reset_session_only);
+    ZSTD_CCtx_refCDict(feed->cctx, lan->cdict);
+    memset(feed->netSnapshots, 0, sizeof(SnapshotHistory));
+    feed->netTick = 0;
+    lan->spectatorCount = 0;
+}
 
-    char buffer[BUFFER_SIZE];
-    while (true) {
-        int n =
-            recvfrom(game.lan.socket, buffer, BUFFER_SIZE - 1, 0,
-                     (struct sockaddr *)&recvAddress, &game.lan.addressLength);
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-            perror("recvfrom");
-            break;
+// Spectators find a running game with DISCOVER and ask to watch it. They
+// must have the host's dictionary, since they all share one stream.
+static void spectatorMessage(Lan *lan, char *buffer, int size,
+                             struct sockaddr_in *address) {
+    buffer[size] = '\0';
+    int index = 0;
+    while (index < lan->spectatorCount &&
+           !isFrom(address, &lan->spectators[index])) {
+        index++;
+    }
+    if (strcmp(buffer, "DISCOVER") == 0) {
+        char reply[] = "AVAILABLE";
+        sendto(lan->socket, reply, strlen(reply), 0,
+               (struct sockaddr *)address, sizeof(*address));
+    } else if (strncmp(buffer, "SPECTATE_REQUEST", 16) == 0) {
+        u32 dictId = 0;
+        sscanf(buffer + 16, "%u", &dictId);
+        if (dictId != lan->dictId || index == MAX_SPECTATORS) return;
+        if (index == lan->spectatorCount) {
+            lan->spectators[lan->spectatorCount++] = *address;
+            // Starts the newcomer off with a full snapshot.
+            lan->spectatorFeed->ackedTick = 0;
+            printf("%s is watching\n", inet_ntoa(address->sin_addr));
         }
+        lan->spectatorSeenTicks[index] = lan->netTick;
+        char reply[] = "SPECTATE_ACCEPT";
+        sendto(lan->socket, reply, strlen(reply), 0,
+               (struct sockaddr *)address, sizeof(*address));
+    } else if (index < lan->spectatorCount) {
+        lan->spectatorSeenTicks[index] = lan->netTick;
+    }
+}
 
-        if (recvAddress.sin_addr.s_addr !=
-                game.lan.clientAddress.sin_addr.s_addr ||
-            recvAddress.sin_port != game.lan.clientAddress.sin_port) {
+static void dropSilentSpectators(Lan *lan) {
+    for (int i = lan->spectatorCount - 1; i >= 0; i--) {
+        if (lan->netTick - lan->spectatorSeenTicks[i] <= TIMEOUT * TICK_RATE) {
             continue;
         }
+        printf("%s stopped watching\n",
+               inet_ntoa(lan->spectators[i].sin_addr));
+        lan->spectatorCount--;
+        lan->spectators[i] = lan->spectators[lan->spectatorCount];
+        lan->spectatorSeenTicks[i] =
+            lan->spectatorSeenTicks[lan->spectatorCount];
+    }
+}
 
-        game.lan.timeout = 0;
+// Spectators do not ack, so each of their snapshots is a delta against the
+// previous one, and every so often a full one.
+static void sendSpectatorSnapshot(Lan *lan, const GameStatePacket *packet) {
+    Lan *feed = lan->spectatorFeed;
+    if (!snapshotDue(feed, packet->tick, packet->sfxPlayed)) return;
+    GameStatePacket copy = *packet;
+    markSnapshotSent(feed, copy.tick, &copy);
+    if (!lan->spectatorCount) return;
+    if (feed->streamSequence % SPECTATOR_KEYFRAME_INTERVAL == 0) {
+        feed->ackedTick = 0;
+    }
+    PacketBatch *batch = &lan->spectatorBatch;
+    queueSnapshot(feed, &copy, batch, packetBuffer(batch, 0));
+    if (batch->count == 0) return;
+    ackSnapshot(feed, copy.tick);
+    broadcastPacket(lan->socket, batch, lan->spectators, lan->spectatorCount);
+}
 
-        if (n > CLIENT_INPUT_SIZE) n = CLIENT_INPUT_SIZE;
-        memcpy(game.lan.clientInput, buffer, n);
+// Network thread, host side: takes the acks from client packets, hands the
+// inputs to the game loop and sends the queued snapshots, to the client and
+// to the spectators.
+static void hostNetworkStep(Lan *lan) {
+    PacketBatch *batch = &lan->received;
+    while (receiveLanPackets(lan) > 0) {
+        for (int i = 0; i < batch->count; i++) {
+            char *buffer = packetBuffer(batch, i);
+            if (isFrom(&batch->addresses[i], &lan->clientAddress)) {
+                receiveInputPacket(lan, buffer, batch->sizes[i]);
+            } else {
+                spectatorMessage(lan, buffer, batch->sizes[i],
+                                 &batch->addresses[i]);
+            }
+        }
+        if (batch->count < PACKET_BATCH_SIZE) break;
+    }
+    dropSilentSpectators(lan);
+
+    GameStatePacket *packet;
+    char *buffer;
+    while ((packet = ringReadSlot(&lan->outbox)) &&
+           (buffer = nextPacket(&lan->outgoing))) {
+        queueSnapshot(lan, packet, &lan->outgoing, buffer);
+        sendSpectatorSnapshot(lan, packet);
+        ringPop(&lan->outbox);
+    }
+    sendLanPackets(lan);
+}
 
-        if (game.lan.clientInput[4]) fire = true;  // prevents loss of data
-        if (game.lan.clientInput[5]) enter = true;
+// Network thread, lockstep on either side: both ways only input packets go
+// over the wire. Anything else from the peer means it fell back to
+// snapshots, which the game loop learns from a desynced packet.
+static void lockstepNetworkStep(Lan *lan) {
+    struct sockaddr_in *peer =
+        lan->lanMode == LServer ? &lan->clientAddress : &lan->serverAddress;
+    PacketBatch *batch = &lan->received;
+    while (receiveLanPackets(lan) > 0) {
+        for (int i = 0; i < batch->count; i++) {
+            if (!isFrom(&batch->addresses[i], peer)) continue;
+            InputPacket *slot = ringWriteSlot(&lan->inbox);
+            if (!slot) break;
+            if (readLockstepPacket(packetBuffer(batch, i), batch->sizes[i],
+                                   slot)) {
+                sampleRtt(lan, slot->ackTick);
+            } else {
+                *slot = (InputPacket){.desynced = true};
+            }
+            ringPush(&lan->inbox);
+        }
+        if (batch->count < PACKET_BATCH_SIZE) break;
     }
 
-    game.lan.clientInput[4] = fire;
-    game.lan.clientInput[5] = enter;
+    InputPacket *input;
+    char *buffer;
+    while ((input = ringReadSlot(&lan->outbox)) &&
+           (buffer = nextPacket(&lan->outgoing))) {
+        stampSend(lan, input->inputTick);
+        queuePacket(&lan->outgoing, writeLockstepPacket(buffer, input), peer);
+        ringPop(&lan->outbox);
+    }
+    sendLanPackets(lan);
+}
 
-    game.proceed |= game.lan.clientInput[5];  // client pressed enter
+// Wakes up for every packet, and at least once a millisecond to send what
+// the game loop queued.
+static void *runNetThread(void *arg) {
+    Lan *lan = arg;
+    struct pollfd pollFd = {.fd = lan->socket, .events = POLLIN};
+    while (atomic_load(&lan->netRunning)) {
+        poll(&pollFd, 1, 1);
+        if (lan->lockstep) {
+            lockstepNetworkStep(lan);
+        } else if (lan->lanMode == LServer) {
+            hostNetworkStep(lan);
+        } else {
+            clientNetworkStep(lan);
+        }
+        if (lan->netEmulator) {
+            releasePackets(lan->netEmulator, lan->socket, benchTime());
+        }
+    }
+    return NULL;
 }
 
-static void lanGameLogic() {
-    checkTimeout();
+static void startNetThread(Lan *lan) {
+    if (!lan->netSnapshots) {
+        lan->netSnapshots = calloc(1, sizeof(SnapshotHistory));
+    }
+    memset(lan->netSnapshots, 0, sizeof(SnapshotHistory));
+    memset(lan->snapshots, 0, sizeof(SnapshotHistory));
+    lan->netTick = 0;
+    lan->ackedTick = 0;
+    lan->stampedTick = 0;
+    lan->echoedTick = 0;
+    for (int i = 0; i < NCMax; i++) {
+        atomic_store(&lan->netCounters[i], 0);
+        lan->reportedCounters[i] = 0;
+    }
+    lan->statsTime = benchTime();
+    lan->stats = (NetStats){};
+    if (lan->rollback && !lan->checkpoints) {
+        lan->checkpoints = calloc(ROLLBACK_WINDOW + 1, sizeof(GameCheckpoint));
+    }
+    if (lan->lockstep) {
+        initRing(&lan->outbox, sizeof(InputPacket), INPUT_RING_SIZE);
+        initRing(&lan->inbox, sizeof(InputPacket), INPUT_RING_SIZE);
+    } else if (lan->lanMode == LServer) {
+        initSpectatorFeed(lan);
+        initRing(&lan->outbox, sizeof(GameStatePacket), SNAPSHOT_RING_SIZE);
+        initRing(&lan->inbox, sizeof(InputPacket), INPUT_RING_SIZE);
+    } else {
+        initRing(&lan->outbox, sizeof(InputPacket), INPUT_RING_SIZE);
+        initRing(&lan->inbox, sizeof(GameStatePacket), SNAPSHOT_RING_SIZE);
+    }
+    atomic_store(&lan->netRunning, true);
+    pthread_create(&lan->netThread, NULL, runNetThread, lan);
+}
+
+static void stopNetThread(Lan *lan) {
+    if (!atomic_load(&lan->netRunning)) return;
+    atomic_store(&lan->netRunning, false);
+    pthread_join(lan->netThread, NULL);
+    freeRing(&lan->outbox);
+    freeRing(&lan->inbox);
+}
+
+static void closeLanSocket(Lan *lan) {
+    stopNetThread(lan);
+    close(lan->socket);
+}
+
+// Frees what a LAN session allocated, once its socket is closed.
+static void freeLanSession(Lan *lan) {
+    free(lan->snapshots);
+    free(lan->netSnapshots);
+    free(lan->checkpoints);
+    ZSTD_freeCCtx(lan->cctx);
+    ZSTD_freeDCtx(lan->dctx);
+    ZSTD_freeCDict(lan->cdict);
+    ZSTD_freeDDict(lan->ddict);
+    freePacketBatch(&lan->received);
+    freePacketBatch(&lan->outgoing);
+    if (lan->spectatorFeed) {
+        ZSTD_freeCCtx(lan->spectatorFeed->cctx);
+        free(lan->spectatorFeed->netSnapshots);
+        free(lan->spectatorFeed);
+        freePacketBatch(&lan->spectatorBatch);
+    }
+    freeNetEmulator(lan->netEmulator);
+}
+
+// Game loop, client side: copies in the snapshots the network thread
+// decoded and queues this tick's input packet.
+static void lanGameClient(Game *game) {
+    Lan *lan = &game->lan;
+    Command cmd = game->playerCommands[TPlayer1];
+    lan->inputTick++;
+    lan->inputHistory[lan->inputTick % INPUT_HISTORY_SIZE] =
+        (InputFrame){lan->inputTick, cmd, game->proceed};
+    lan->clientTick++;
+
+    GameStatePacket *packet;
+    while ((packet = ringReadSlot(&lan->inbox))) {
+        lan->timeout = 0;
+        if (packet->tick <= game->tick) countNet(lan, NCLatePackets, 1);
+        lan->snapshots->packets[packet->tick % SNAPSHOT_HISTORY_SIZE] = *packet;
+        if (packet->tick > lan->latestTick) {
+            updateSnapshotTiming(lan, packet->tick);
+        }
+        ringPop(&lan->inbox);
+    }
+
+    playBufferedSnapshots(game);
+
+    // A spectator's input packets only tell the host it is still watching.
+    if (lan->isSpectator && lan->inputTick % SPECTATOR_KEEPALIVE_TICKS) return;
+    InputPacket *input = ringWriteSlot(&lan->outbox);
+    if (!input) return;
+    input->inputTick = lan->inputTick;
+    for (int i = 0; i < INPUT_REDUNDANCY; i++) {
+        long tick = lan->inputTick - i;
+        input->frames[i] = (InputFrame){};
+        if (tick > 0) {
+            input->frames[i] = lan->inputHistory[tick % INPUT_HISTORY_SIZE];
+        }
+    }
+    ringPush(&lan->outbox);
+}
+
+// Runs once per host tick. The state is handed to the network thread only
+// every sendInterval ticks, so the packet rate and the compression work do
+// not depend on the frame rate.
+static void scheduleSnapshot(Game *game) {
+    Lan *lan = &game->lan;
+    game->tick++;
+    if (!snapshotDue(lan, game->tick, game->sfxPlayed)) return;
+    // A full ring means the network thread is behind, try again next tick.
+    GameStatePacket *packet = ringWriteSlot(&lan->outbox);
+    if (!packet) return;
+    fillGameStatePacket(game, packet);
+    markSnapshotSent(lan, game->tick, packet);
+    ringPush(&lan->outbox);
+}
+
+// Stores the input frames of a client packet that the host has not applied
+// or received yet.
+static void receiveClientInput(Lan *lan, const InputPacket *packet) {
+    lan->reportedLoss = packet->lossPercent;
+    if (packet->inputTick <= lan->inputTick) countNet(lan, NCLatePackets, 1);
+    for (int i = 0; i < INPUT_REDUNDANCY; i++) {
+        const InputFrame *frame = &packet->frames[i];
+        if (frame->tick <= lan->inputTick) break;
+        lan->inputHistory[frame->tick % INPUT_HISTORY_SIZE] = *frame;
+    }
+    lan->receivedInputTick = MAX(lan->receivedInputTick, packet->inputTick);
+}
+
+// Applies exactly one client input frame per tick, from a queue that grows
+// by a frame whenever a packet comes late. The tank stands still while the
+// queue is empty. A queue that kept a spare frame for a whole second, or
+// grew past MAX_INPUT_BACKLOG, drops its oldest frames but keeps their
+// shots and key presses.
+static void nextClientInput(Lan *lan, long tick) {
+    lan->inputTick =
+        MAX(lan->inputTick, lan->receivedInputTick - INPUT_HISTORY_SIZE);
+    long backlog = lan->receivedInputTick - lan->inputTick;
+    lan->minInputBacklog = MIN(lan->minInputBacklog, backlog);
+    long skip = MAX(0, backlog - 1 - MAX_INPUT_BACKLOG);
+    if (tick % TICK_RATE == 0) {
+        if (lan->minInputBacklog > 1) skip = MAX(skip, 1);
+        lan->minInputBacklog = backlog;
+    }
 
-    if (game.lan.lanMode == LServer) {
-        lanGameServerRecieve();
+    InputFrame input = {};
+    if (backlog == 0) {
+        lan->clientInput = input;
+        return;
+    }
+    int frames = 0;
+    for (long i = 0; i <= skip; i++) {
+        lan->inputTick++;
+        InputFrame *frame =
+            &lan->inputHistory[lan->inputTick % INPUT_HISTORY_SIZE];
+        if (frame->tick != lan->inputTick) continue;
+        input.command.move = frame->command.move;
+        input.command.direction = frame->command.direction;
+        input.command.fire |= frame->command.fire;
+        input.proceed |= frame->proceed;
+        frames++;
+    }
+    if (frames > 1) countNet(lan, NCMergedInputs, frames - 1);
+    lan->clientInput = input;
+}
+
+static void lanGameServerRecieve(Game *game) {
+    InputPacket *input;
+    while ((input = ringReadSlot(&game->lan.inbox))) {
+        game->lan.timeout = 0;
+        receiveClientInput(&game->lan, input);
+        ringPop(&game->lan.inbox);
+    }
+
+    nextClientInput(&game->lan, game->tick);
+
+    game->proceed |= game->lan.clientInput.proceed;  // client pressed enter
+}
+
+static void storePrevPositions(Game *game) {
+    for (int i = 0; i < MAX_TANK_COUNT; i++) {
+        game->tanks[i].prevPos = game->tanks[i].pos;
+    }
+    for (int i = 0; i < game->activeBulletCount; i++) {
+        Bullet *b = &game->bullets[game->activeBullets[i]];
+        b->prevPos = b->pos;
+    }
+}
+
+// Restarts the session with snapshots, for good. The peer notices the
+// packets change.
+static void fallBackToSnapshots(Game *game) {
+    printf("Lockstep desync at tick %ld, falling back to snapshots\n",
+           game->tick);
+    stopNetThread(&game->lan);
+    game->lan.lockstep = false;
+    game->lan.rollback = false;
+    resetLanSession(&game->lan);
+    startNetThread(&game->lan);
+}
+
+static bool checkStateHash(Lan *lan) {
+    return lan->hashTick != lan->peerHashTick || lan->hash == lan->peerHash;
+}
+
+// The frame of a player for a tick, NULL while it is still on its way.
+// Nobody has input for the first inputDelay ticks.
+static InputFrame *lockstepFrame(Lan *lan, InputFrame *history, long tick) {
+    static InputFrame noInput;
+    if (tick <= lan->inputDelay) return &noInput;
+    InputFrame *frame = &history[tick % INPUT_HISTORY_SIZE];
+    return frame->tick == tick ? frame : NULL;
+}
+
+// Copies the simulated part of the game. A restore marks the cells that
+// change as dirty, so the field layers get redrawn.
+static void saveCheckpoint(Game *game, GameCheckpoint *checkpoint) {
+#define SAVE_FIELD(name) \
+    memcpy(&checkpoint->name, &game->name, sizeof(checkpoint->name));
+    CHECKPOINT_FIELDS(SAVE_FIELD)
+#undef SAVE_FIELD
+}
+
+static void restoreCheckpoint(Game *game, const GameCheckpoint *checkpoint) {
+    for (int row = 0; row < FIELD_ROWS; row++) {
+        if (!memcmp(game->field[row], checkpoint->field[row],
+                    sizeof(game->field[row]))) {
+            continue;
+        }
+        for (int col = 0; col < FIELD_COLS; col++) {
+            if (game->field[row][col].type !=
+                checkpoint->field[row][col].type) {
+                setMaskBit(&game->dirtyCells, row, col, true);
+            }
+        }
+    }
+#define RESTORE_FIELD(name) \
+    memcpy(&game->name, &checkpoint->name, sizeof(game->name));
+    CHECKPOINT_FIELDS(RESTORE_FIELD)
+#undef RESTORE_FIELD
+}
+
+// Steps one tick with the two players' frames, whichever side is local.
+static void stepLockstep(Game *game, const InputFrame *local,
+                         const InputFrame *peer) {
+    Lan *lan = &game->lan;
+    bool host = lan->lanMode == LServer;
+    const InputFrame *p1 = host ? local : peer;
+    const InputFrame *p2 = host ? peer : local;
+    game->playerCommands[TPlayer1] = p1->command;
+    lan->clientInput = *p2;
+    game->proceed = p1->proceed || p2->proceed;
+    storePrevPositions(game);
+    if (game->screen == GSPlayLan) {
+        gameLogic(game);
+    } else {
+        stageSummaryLogic(game);
+    }
+    game->tick++;
+}
+
+// Keeps a peer frame that is new. Under rollback, a frame for a tick that
+// was already played on a different prediction schedules a rewind to it.
+static void storePeerFrame(Game *game, const InputFrame *frame) {
+    Lan *lan = &game->lan;
+    lan->peerInputHistory[frame->tick % INPUT_HISTORY_SIZE] = *frame;
+    if (!lan->rollback || frame->tick > game->tick) return;
+    InputFrame *predicted =
+        &lan->predictedInput[frame->tick % INPUT_HISTORY_SIZE];
+    if (predicted->tick != frame->tick ||
+        predicted->command.move != frame->command.move ||
+        predicted->command.direction != frame->command.direction ||
+        predicted->command.fire != frame->command.fire ||
+        predicted->proceed != frame->proceed) {
+        lan->rollbackTick = MIN(lan->rollbackTick, frame->tick);
+    }
+}
+
+// Steps one tick under rollback, on the peer's frame if it is in and on a
+// guess otherwise: the peer keeps moving the way it last did and does not
+// fire. A guessed tick that would leave the playfield is undone, the
+// screen only changes on confirmed input. Returns whether it stepped.
+static bool rollbackStep(Game *game) {
+    Lan *lan = &game->lan;
+    long tick = game->tick + 1;
+    bool confirmed = tick <= lan->confirmedTick;
+    InputFrame *local = lockstepFrame(lan, lan->inputHistory, tick);
+    if (!local || (!confirmed && game->screen != GSPlayLan)) return false;
+    InputFrame peer;
+    InputFrame *frame = lockstepFrame(lan, lan->peerInputHistory, tick);
+    if (frame) {
+        peer = *frame;
+    } else {
+        InputFrame *last =
+            lockstepFrame(lan, lan->peerInputHistory, lan->confirmedTick);
+        peer = (InputFrame){.tick = tick};
+        if (last) peer.command.move = last->command.move;
+        if (last) peer.command.direction = last->command.direction;
+    }
+    peer.tick = tick;
+    lan->predictedInput[tick % INPUT_HISTORY_SIZE] = peer;
+
+    GameCheckpoint *checkpoint =
+        &lan->checkpoints[game->tick % (ROLLBACK_WINDOW + 1)];
+    saveCheckpoint(game, checkpoint);
+    GameScreen screen = game->screen;
+    stepLockstep(game, local, &peer);
+    if (!confirmed && game->screen != screen) {
+        restoreCheckpoint(game, checkpoint);
+        return false;
+    }
+    if (tick % LOCKSTEP_HASH_INTERVAL == 0) {
+        lan->pendingHashTick = tick;
+        lan->pendingHash = hashGameState(game);
+    }
+    return true;
+}
+
+// Rewinds to the first mispredicted tick and replays up to where the game
+// was, muted, then steps the current tick unless the game is too far ahead
+// of the peer. A hash is only sent once its tick is confirmed.
+static void rollbackLogic(Game *game) {
+    Lan *lan = &game->lan;
+    if (lan->rollbackTick <= game->tick) {
+        long target = game->tick;
+        restoreCheckpoint(
+            game, &lan->checkpoints[(lan->rollbackTick - 1) %
+                                    (ROLLBACK_WINDOW + 1)]);
+        bool mute = game->mute;
+        game->mute = true;
+        lan->rollbacks++;
+        while (game->tick < target && rollbackStep(game)) {
+            lan->replayedTicks++;
+        }
+        game->mute = mute;
+    }
+    lan->rollbackTick = LONG_MAX;
+    if (game->tick - lan->confirmedTick < ROLLBACK_WINDOW) rollbackStep(game);
+    if (lan->pendingHashTick > lan->hashTick &&
+        lan->pendingHashTick <= MIN(lan->confirmedTick, game->tick)) {
+        lan->hashTick = lan->pendingHashTick;
+        lan->hash = lan->pendingHash;
+    }
+}
+
+// Lockstep tick on either side. The local input is sampled for a tick
+// inputDelay ahead, and the game only steps once both players' frames for
+// the next tick are in. Presses made while it waits are kept for later.
+static void lockstepLogic(Game *game) {
+    Lan *lan = &game->lan;
+    Command cmd = game->playerCommands[TPlayer1];
+    lan->pendingInput.command.move = cmd.move;
+    lan->pendingInput.command.direction = cmd.direction;
+    lan->pendingInput.command.fire |= cmd.fire;
+    lan->pendingInput.proceed |= game->proceed;
+    long scheduledTick = game->tick + 1 + lan->inputDelay;
+    if (scheduledTick > lan->inputTick) {
+        lan->inputTick = scheduledTick;
+        lan->pendingInput.tick = scheduledTick;
+        lan->inputHistory[scheduledTick % INPUT_HISTORY_SIZE] =
+            lan->pendingInput;
+        lan->pendingInput = (InputFrame){};
+    }
+
+    InputPacket *input;
+    while ((input = ringReadSlot(&lan->inbox))) {
+        lan->timeout = 0;
+        InputPacket packet = *input;
+        ringPop(&lan->inbox);
+        if (packet.desynced) {
+            fallBackToSnapshots(game);
+            return;
+        }
+        for (int i = 0; i < INPUT_REDUNDANCY; i++) {
+            InputFrame *frame = &packet.frames[i];
+            // Frames up to the confirmed tick are known already.
+            if (frame->tick <= lan->confirmedTick) break;
+            InputFrame *stored =
+                &lan->peerInputHistory[frame->tick % INPUT_HISTORY_SIZE];
+            if (stored->tick != frame->tick) storePeerFrame(game, frame);
+        }
+        lan->peerAckTick = MAX(lan->peerAckTick, packet.ackTick);
+        if (packet.hashTick > lan->peerHashTick) {
+            lan->peerHashTick = packet.hashTick;
+            lan->peerHash = packet.hash;
+        }
+    }
+    while (lockstepFrame(lan, lan->peerInputHistory, lan->confirmedTick + 1)) {
+        lan->confirmedTick++;
+    }
+    if (!checkStateHash(lan)) {
+        fallBackToSnapshots(game);
+        return;
+    }
+
+    // The frames go out from the oldest one the peer is missing, so one
+    // that fell behind catches up instead of waiting for lost frames. They
+    // never reach back past the input history.
+    input = ringWriteSlot(&lan->outbox);
+    if (input) {
+        long newestTick =
+            MIN(lan->inputTick, lan->peerAckTick + INPUT_REDUNDANCY);
+        long oldestTick = lan->inputTick - INPUT_HISTORY_SIZE;
+        newestTick = MAX(newestTick, oldestTick + INPUT_REDUNDANCY);
+        *input = (InputPacket){
+            .inputTick = newestTick,
+            .ackTick = lan->confirmedTick,
+            .hashTick = lan->hashTick,
+            .hash = lan->hash};
+        for (int i = 0; i < INPUT_REDUNDANCY; i++) {
+            input->frames[i] =
+                *lockstepFrame(lan, lan->inputHistory, newestTick - i);
+        }
+        ringPush(&lan->outbox);
+    }
+
+    if (lan->rollback) {
+        rollbackLogic(game);
+        return;
+    }
+    long tick = game->tick + 1;
+    InputFrame *local = lockstepFrame(lan, lan->inputHistory, tick);
+    InputFrame *peer = lockstepFrame(lan, lan->peerInputHistory, tick);
+    if (!local || !peer) return;
+    stepLockstep(game, local, peer);
+    if (tick % LOCKSTEP_HASH_INTERVAL == 0) {
+        lan->hashTick = tick;
+        lan->hash = hashGameState(game);
+    }
+}
+
+// Turns the counters of the last second into rates for the overlay, and
+// writes them to the --net-stats file.
+static void updateNetStats(Game *game) {
+    Lan *lan = &game->lan;
+    double now = benchTime();
+    double seconds = now - lan->statsTime;
+    if (seconds < 1) return;
+    lan->statsTime = now;
+    long delta[NCMax];
+    for (int i = 0; i < NCMax; i++) {
+        long count = atomic_load_explicit(&lan->netCounters[i],
+                                          memory_order_relaxed);
+        delta[i] = count - lan->reportedCounters[i];
+        lan->reportedCounters[i] = count;
+    }
+    NetStats *stats = &lan->stats;
+    if (delta[NCRttSamples]) {
+        stats->rtt = delta[NCRttTime] / 1e3 / delta[NCRttSamples];
+    }
+    stats->packetsIn = delta[NCPacketsIn] / seconds;
+    stats->packetsOut = delta[NCPacketsOut] / seconds;
+    stats->bytesIn = delta[NCBytesIn] / seconds;
+    stats->bytesOut = delta[NCBytesOut] / seconds;
+    if (delta[NCCodedSnapshots]) {
+        stats->compressionRatio =
+            (float)delta[NCRawBytes] / delta[NCCompressedBytes];
+        stats->codecTime = delta[NCCodecTime] / 1e3 / delta[NCCodedSnapshots];
+    }
+    stats->latePackets = delta[NCLatePackets] / seconds;
+    stats->mergedInputs = delta[NCMergedInputs] / seconds;
+    bool host = lan->lanMode == LServer;
+    stats->lossPercent =
+        host ? lan->reportedLoss
+             : atomic_load_explicit(&lan->lossPercent, memory_order_relaxed);
+
+    if (!netStatsFile) return;
+    // The send interval is the host's, the jitter the client's.
+    char sendInterval[16] = "", jitter[16] = "";
+    if (host) {
+        snprintf(sendInterval, sizeof(sendInterval), "%d", lan->sendInterval);
     } else {
-        lanGameClient();
+        snprintf(jitter, sizeof(jitter), "%.2f", lan->jitter);
+    }
+    fprintf(netStatsFile,
+            "%.3f,%s,%ld,%.2f,%ld,%ld,%ld,%ld,%.2f,%.1f,%ld,%ld,%d,%s,%s,%ld,"
+            "%ld\n",
+            now, host ? "host" : "client", game->tick, stats->rtt,
+            stats->packetsIn, stats->packetsOut, stats->bytesIn,
+            stats->bytesOut, stats->compressionRatio, stats->codecTime,
+            stats->latePackets, stats->mergedInputs, stats->lossPercent,
+            sendInterval, jitter, lan->rollbacks, lan->replayedTicks);
+}
+
+static void lanGameLogic(Game *game) {
+    checkTimeout(game);
+    updateNetStats(game);
+
+    if (game->lan.lockstep) {
+        lockstepLogic(game);
+        return;
+    }
+    if (game->lan.lanMode == LServer) {
+        lanGameServerRecieve(game);
+    } else {
+        lanGameClient(game);
         return;
     }
 
-    gameLogic();
+    gameLogic(game);
 
-    lanGameServerSend();
+    scheduleSnapshot(game);
 }
 
-static void lanStageSummaryLogic() {
-    if (game.lan.lanMode == LServer) {
-        lanGameServerRecieve();
+static void lanStageSummaryLogic(Game *game) {
+    updateNetStats(game);
+    if (game->lan.lockstep) {
+        lockstepLogic(game);
+        return;
+    }
+    if (game->lan.lanMode == LServer) {
+        lanGameServerRecieve(game);
     } else {
-        lanGameClient();
+        lanGameClient(game);
         return;
     }
 
-    stageSummaryLogic();
+    stageSummaryLogic(game);
 
-    lanGameServerSend();
+    scheduleSnapshot(game);
 }
 
-static void saveHiScore() {
+static void saveHiScore(Game *game) {
+    if (game->headless) return;
     u8 bytes[4];
-    bytes[0] = game.hiScore & 0xFF;
-    bytes[1] = (game.hiScore >> 8) & 0xFF;
-    bytes[2] = (game.hiScore >> 16) & 0xFF;
-    bytes[3] = (game.hiScore >> 24) & 0xFF;
+    bytes[0] = game->hiScore & 0xFF;
+    bytes[1] = (game->hiScore >> 8) & 0xFF;
+    bytes[2] = (game->hiScore >> 16) & 0xFF;
+    bytes[3] = (game->hiScore >> 24) & 0xFF;
     Buffer b = {bytes, 4};
     saveBuffer(b, "hiscore");
 }
 
 #ifdef ALT_ASSETS
-static void playMusic() {
+static void playMusic(Game *game) {
     static bool isFirstTime = true;
 #define currentSoundtrack \
-    (game.sounds.soundtrack[game.soundtrack * 4 + game.soundtrackPhase])
+    (assets.sounds.soundtrack[game->soundtrack * 4 + game->soundtrackPhase])
 #define dieSoundtrack \
-    (game.sounds.soundtrack[ASIZE(game.sounds.soundtrack) - 1])
+    (assets.sounds.soundtrack[ASIZE(assets.sounds.soundtrack) - 1])
     if (isFirstTime) {
         isFirstTime = false;
-        playSound(game.sounds.soundtrack[0]);
+        playSound(game, assets.sounds.soundtrack[0]);
         return;
     }
-    if (game.gameOverTime) {
+    if (game->gameOverTime) {
         if (IsSoundPlaying(dieSoundtrack)) return;
-        if (!game.isDieSoundtrackPlayed) {
+        if (!game->isDieSoundtrackPlayed) {
             StopSound(currentSoundtrack);
-            playSound(dieSoundtrack);
-            game.isDieSoundtrackPlayed = true;
+            playSound(game, dieSoundtrack);
+            game->isDieSoundtrackPlayed = true;
         }
     }
     if (IsSoundPlaying(currentSoundtrack) || IsSoundPlaying(dieSoundtrack))
         return;
-    char track = (game.screen == GSPlay || game.screen == GSPlayLan)
-                     ? (game.stage - 1) % 4 + 1
+    char track = (game->screen == GSPlay || game->screen == GSPlayLan)
+                     ? (game->stage - 1) % 4 + 1
                      : 0;
-    if (game.soundtrack != track) {
-        game.soundtrackPhase = 0;
+    if (game->soundtrack != track) {
+        game->soundtrackPhase = 0;
+    } else {
+        game->soundtrackPhase++;
+        game->soundtrackPhase %= 4;
+    }
+    game->soundtrack = track;
+    playSound(game, currentSoundtrack);
+}
+#endif
+
+static Command parseScriptCommand(const char *token, bool *proceed) {
+    Command cmd = {};
+    for (const char *c = token; *c; c++) {
+        switch (*c) {
+            case 'L':
+                cmd.move = true;
+                cmd.direction = DLeft;
+                break;
+            case 'R':
+                cmd.move = true;
+                cmd.direction = DRight;
+                break;
+            case 'U':
+                cmd.move = true;
+                cmd.direction = DUp;
+                break;
+            case 'D':
+                cmd.move = true;
+                cmd.direction = DDown;
+                break;
+            case 'F':
+                cmd.fire = true;
+                break;
+            case 'E':
+                *proceed = true;
+                break;
+        }
+    }
+    return cmd;
+}
+
+// Script format, one step per line: <ticks> <player1> [<player2>], where a
+// player token is any combination of L/R/U/D (move), F (fire every tick of
+// the step) and E (press enter on the first tick), or "-" for no input.
+// Lines starting with '#' are comments. The script loops when it runs out.
+static InputScript loadInputScript(const char *filename) {
+    InputScript script = {};
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open file: %s\n", filename);
+        exit(1);
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char p1[32] = "-", p2[32] = "-";
+        int ticks;
+        if (line[0] == '#' || sscanf(line, "%d %31s %31s", &ticks, p1, p2) < 2)
+            continue;
+        if (ticks <= 0) continue;
+        script.steps =
+            realloc(script.steps, (script.stepCount + 1) * sizeof(ScriptStep));
+        ScriptStep *step = &script.steps[script.stepCount++];
+        *step = (ScriptStep){.ticks = ticks};
+        step->commands[TPlayer1] = parseScriptCommand(p1, &step->proceed);
+        step->commands[TPlayer2] = parseScriptCommand(p2, &step->proceed);
+    }
+    fclose(f);
+    return script;
+}
+
+static void nextScriptTick(Game *game, InputScript *script) {
+    if (script->stepCount == 0) {
+        memset(game->playerCommands, 0, sizeof(game->playerCommands));
+        return;
+    }
+    ScriptStep *step = &script->steps[script->step];
+    game->playerCommands[TPlayer1] = step->commands[TPlayer1];
+    game->playerCommands[TPlayer2] = step->commands[TPlayer2];
+    game->proceed = step->proceed && script->tick == 0;
+    if (++script->tick >= step->ticks) {
+        script->tick = 0;
+        script->step = (script->step + 1) % script->stepCount;
+    }
+}
+
+// Advances the current screen by one fixed TICK_TIME step. Key presses are
+// latched by the caller until a tick consumes them.
+static void stepGame(Game *game) {
+    for (int i = 0; i < MAX_SFX_PLAYED; i++) {
+        game->sfxPlayed[i] = SFX_MAX;
+    }
+    storePrevPositions(game);
+    game->logic(game);
+    game->proceed = false;
+    game->switchMode = false;
+    game->playerCommands[TPlayer1].fire = false;
+    game->playerCommands[TPlayer2].fire = false;
+}
+
+typedef struct {
+    Game *game;
+    InputScript script;
+    int startStage;
+    int stageCount;
+    long maxStageTicks;
+    long ticks;
+} HeadlessJob;
+
+// Runs stages back to back without a window, audio or frame cap.
+static void *runHeadlessJob(void *arg) {
+    HeadlessJob *job = arg;
+    Game *game = job->game;
+    game->headless = true;
+    game->mute = true;
+    seedRng(&game->rng, game->seed);
+    initGame(game);
+    initGameRun(game);
+
+    int stagesPlayed = 0;
+    for (int stage = job->startStage;
+         stagesPlayed < job->stageCount && stage <= LEVEL_COUNT; stage++) {
+        initStage(game, stage);
+        setScreen(game, GSPlay);
+        game->stageCurtainTime = STAGE_CURTAIN_TIME;
+        long ticks = 0;
+        while (game->screen == GSPlay && ticks < job->maxStageTicks) {
+            nextScriptTick(game, &job->script);
+            stepGame(game);
+            game->totalTime += game->frameTime;
+            ticks++;
+        }
+        job->ticks += ticks;
+        stagesPlayed++;
+        const char *result = game->gameOverTime         ? "game over"
+                             : game->screen == GSPlay ? "timed out"
+                                                       : "cleared";
+        printf(
+            "seed %llu stage %2d: %-9s ticks %7ld p1 %6d p2 %6d lifes %d/%d\n",
+            (unsigned long long)game->seed, stage, result, ticks,
+            game->playerScores[TPlayer1].totalScore,
+            game->playerScores[TPlayer2].totalScore,
+            game->tanks[TPlayer1].lifes, game->tanks[TPlayer2].lifes);
+        if (game->gameOverTime || game->screen == GSPlay) break;
+    }
+    return NULL;
+}
+
+// Every job is an independent match with its own Game, seeded with
+// game->seed + job index, so jobs can run on separate threads.
+static void runHeadless(Game *game, InputScript *script, int startStage,
+                        int stageCount, long maxStageTicks, int jobCount) {
+    HeadlessJob *jobs = calloc(jobCount, sizeof(HeadlessJob));
+    pthread_t *threads = calloc(jobCount, sizeof(pthread_t));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < jobCount; i++) {
+        Game *jobGame = calloc(1, sizeof(Game));
+        jobGame->mode = game->mode;
+        jobGame->seed = game->seed + i;
+        jobs[i] = (HeadlessJob){.game = jobGame,
+                                .script = *script,
+                                .startStage = startStage,
+                                .stageCount = stageCount,
+                                .maxStageTicks = maxStageTicks};
+        pthread_create(&threads[i], NULL, runHeadlessJob, &jobs[i]);
+    }
+    long totalTicks = 0;
+    for (int i = 0; i < jobCount; i++) {
+        pthread_join(threads[i], NULL);
+        totalTicks += jobs[i].ticks;
+        free(jobs[i].game);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d job(s), %ld ticks in %.3fs (%.0f ticks/s)\n", jobCount,
+           totalTicks, seconds, seconds > 0 ? totalTicks / seconds : 0);
+    free(threads);
+    free(jobs);
+}
+
+typedef struct {
+    long bytes;
+    double compressTime;
+    double decompressTime;
+} CompressionStats;
+
+typedef struct {
+    const char *name;
+    CompressionMode mode;
+    bool dict;
+} BenchCodec;
+
+// Plays a stage headless and compresses every snapshot the server would send
+// with one-shot ZSTD_compress and the LAN codecs, checking that each one
+// decompresses back to the same bytes. Snapshots are also recorded when
+// --record-snapshots is given.
+static void runCompressionBench(Game *game, InputScript *script, int stage,
+                                long maxTicks) {
+    static const char *payloads[] = {"full", "delta"};
+    static const BenchCodec codecs[] = {{"one-shot", CMFrame, false},
+                                        {"context", CMFrame, false},
+                                        {"stream", CMStream, false},
+                                        {"dict", CMFrame, true},
+                                        {"dict+stream", CMStream, true}};
+    enum { CODEC_COUNT = ASIZE(codecs) };
+    CompressionStats stats[2][CODEC_COUNT] = {};
+    long rawBytes[2] = {};
+    Lan servers[2][CODEC_COUNT] = {}, clients[2][CODEC_COUNT] = {};
+    for (int p = 0; p < 2; p++) {
+        for (int c = 1; c < CODEC_COUNT; c++) {
+            servers[p][c].compression = codecs[c].mode;
+            initLanCompression(&servers[p][c]);
+            initLanCompression(&clients[p][c]);
+            useSnapshotDict(&servers[p][c],
+                            codecs[c].dict ? clients[p][c].dictId : 0);
+        }
+    }
+    // The dictionary codecs come last and are skipped without a dictionary.
+    int codecCount = CODEC_COUNT;
+    if (!clients[0][1].dictId) {
+        printf("No %s, skipping dictionary codecs\n", SNAPSHOT_DICT_FILE);
+        while (codecs[codecCount - 1].dict) codecCount--;
+    }
+
+    game->headless = true;
+    game->mute = true;
+    seedRng(&game->rng, game->seed);
+    initGame(game);
+    initGameRun(game);
+    initStage(game, stage);
+    setScreen(game, GSPlay);
+    SnapshotHistory *history = calloc(1, sizeof(SnapshotHistory));
+    char raw[MAX_PACKET_SIZE];
+    char compressed[MAX_COMPRESSED_PACKET_SIZE];
+    char decompressed[MAX_PACKET_SIZE];
+    long packets = 0;
+    while (game->screen == GSPlay && packets < maxTicks) {
+        nextScriptTick(game, script);
+        stepGame(game);
+        game->tick++;
+        packets++;
+        for (int p = 0; p < 2; p++) {
+            long baseTick = p ? game->tick - 1 : 0;
+            size_t rawSize = packGameState(game, history, baseTick, raw);
+            recordSnapshot(raw, rawSize);
+            rawBytes[p] += rawSize;
+            for (int c = 0; c < codecCount; c++) {
+                double start = benchTime();
+                size_t size =
+                    c ? compressSnapshot(&servers[p][c], raw, rawSize,
+                                         compressed, sizeof(compressed))
+                      : ZSTD_compress(compressed, sizeof(compressed), raw,
+                                      rawSize, COMPRESSION_LEVEL);
+                double mid = benchTime();
+                size_t decompressedSize =
+                    c ? decompressSnapshot(&clients[p][c], compressed, size,
+                                           decompressed, sizeof(decompressed))
+                      : ZSTD_decompress(decompressed, sizeof(decompressed),
+                                        compressed, size);
+                double end = benchTime();
+                if (ZSTD_isError(size) || decompressedSize != rawSize ||
+                    memcmp(raw, decompressed, rawSize)) {
+                    fprintf(stderr, "%s %s: round trip failed at tick %ld\n",
+                            payloads[p], codecs[c].name, game->tick);
+                    exit(1);
+                }
+                stats[p][c].bytes += size;
+                stats[p][c].compressTime += mid - start;
+                stats[p][c].decompressTime += end - mid;
+            }
+        }
+    }
+
+    printf("%ld snapshots, level %d\n", packets, COMPRESSION_LEVEL);
+    printf("payload  codec        bytes/packet  compress us  decompress us\n");
+    for (int p = 0; p < 2; p++) {
+        printf("%-8s %-12s %12.1f\n", payloads[p], "raw",
+               (double)rawBytes[p] / packets);
+        for (int c = 0; c < codecCount; c++) {
+            CompressionStats *st = &stats[p][c];
+            printf("%-8s %-12s %12.1f %12.2f %14.2f\n", payloads[p],
+                   codecs[c].name, (double)st->bytes / packets,
+                   st->compressTime * 1e6 / packets,
+                   st->decompressTime * 1e6 / packets);
+        }
+    }
+    free(history);
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the values.
+static double percentile(double *values, long count, double fraction) {
+    if (!count) return 0;
+    qsort(values, count, sizeof(double), compareDoubles);
+    return values[MIN(count - 1, (long)(count * fraction))];
+}
+
+// Plays a stage headless and every tick rewinds ROLLBACK_BENCH_TICKS ticks
+// and replays them, the way a rollback peer does when a late input changes
+// an old tick. Checks that each replay ends in the state it started from.
+static void runRollbackBench(Game *game, InputScript *script, int stage,
+                             long maxTicks) {
+    const int slots = ROLLBACK_BENCH_TICKS + 1;
+    GameCheckpoint *checkpoints = calloc(slots, sizeof(GameCheckpoint));
+    double *replayTimes = calloc(maxTicks, sizeof(double));
+    Command commands[ROLLBACK_BENCH_TICKS + 1][2];
+    bool proceed[ROLLBACK_BENCH_TICKS + 1];
+
+    game->headless = true;
+    game->mute = true;
+    seedRng(&game->rng, game->seed);
+    initGame(game);
+    initGameRun(game);
+    initStage(game, stage);
+    setScreen(game, GSPlay);
+    double saveTime = 0, restoreTime = 0, replayTime = 0;
+    long ticks = 0, replays = 0;
+    while (game->screen == GSPlay && ticks < maxTicks) {
+        int slot = game->tick % slots;
+        double start = benchTime();
+        saveCheckpoint(game, &checkpoints[slot]);
+        saveTime += benchTime() - start;
+        nextScriptTick(game, script);
+        memcpy(commands[slot], game->playerCommands, sizeof(commands[slot]));
+        proceed[slot] = game->proceed;
+        stepGame(game);
+        game->tick++;
+        ticks++;
+        if (game->tick < ROLLBACK_BENCH_TICKS || game->screen != GSPlay) {
+            continue;
+        }
+
+        u32 hash = hashGameState(game);
+        long tick = game->tick;
+        start = benchTime();
+        restoreCheckpoint(game,
+                          &checkpoints[(tick - ROLLBACK_BENCH_TICKS) % slots]);
+        double mid = benchTime();
+        while (game->tick < tick) {
+            slot = game->tick % slots;
+            saveCheckpoint(game, &checkpoints[slot]);
+            memcpy(game->playerCommands, commands[slot],
+                   sizeof(commands[slot]));
+            game->proceed = proceed[slot];
+            stepGame(game);
+            game->tick++;
+        }
+        double end = benchTime();
+        if (hashGameState(game) != hash) {
+            fprintf(stderr, "Replay diverged at tick %ld\n", tick);
+            exit(1);
+        }
+        restoreTime += mid - start;
+        replayTime += end - mid;
+        replayTimes[replays++] = end - mid;
+    }
+
+    printf("%ld ticks, %ld replays of %d ticks, checkpoint %zu bytes\n",
+           ticks, replays, ROLLBACK_BENCH_TICKS, sizeof(GameCheckpoint));
+    printf("save     %8.2f us\n", saveTime * 1e6 / ticks);
+    if (replays) {
+        // The slowest replays are mostly the scheduler, hence the 99.9th
+        // percentile next to the worst one.
+        double p999 = percentile(replayTimes, replays, 0.999);
+        double worst = replayTimes[replays - 1];
+        printf("restore  %8.2f us\n", restoreTime * 1e6 / replays);
+        printf("replay   %8.2f us, 99.9%% %.2f us, worst %.2f us\n",
+               replayTime * 1e6 / replays, p999 * 1e6, worst * 1e6);
+        printf("a 60 Hz frame fits %.0f replays at 99.9%%\n",
+               1.0 / 60 / p999);
+    }
+    free(replayTimes);
+    free(checkpoints);
+}
+
+typedef enum { MSFree, MSWaiting, MSRunning, MSFinished } MatchState;
+
+// One game on the dedicated server, peer i plays tank i. The IO thread sets
+// a match up and hands it to its worker by marking it running. From then on
+// only the worker touches it, until it marks the match finished and the IO
+// thread frees it. Bot matches play a script and never finish.
+typedef struct {
+    _Atomic int state;
+    u32 generation;
+    int players;
+    bool isBot;
+    InputScript script;
+    Game *game;
+    Lan peers[2];
+    long endTick;
+} Match;
+
+typedef struct {
+    int match;  // -1 for an empty slot
+    int player;
+    struct sockaddr_in address;
+} ServerSession;
+
+// An input packet on its way from the IO thread to a worker.
+typedef struct {
+    int match;
+    u32 generation;
+    int player;
+    long ackedTick;
+    InputPacket input;
+} ServerInput;
+
+typedef struct Server Server;
+
+typedef struct {
+    Server *server;
+    int index;
+    pthread_t thread;
+    SpscRing inputs;
+    PacketBatch outgoing;
+    // Running totals, and the values the last stats line was printed from.
+    atomic_long busyTime;
+    atomic_long matchTicks;
+    atomic_long bytesSent;
+    long reportedBusyTime;
+    long reportedMatchTicks;
+    long reportedBytesSent;
+} ServerWorker;
+
+struct Server {
+    Socket socket;
+    atomic_bool running;
+    // Compression settings and dictionaries shared by all peers.
+    Lan *config;
+    unsigned long long seed;
+    int workerCount;
+    ServerWorker *workers;
+    Match matches[MAX_MATCHES];
+    int waitingMatch;
+    ServerSession sessions[SESSION_TABLE_SIZE];
+};
+
+static volatile sig_atomic_t serverStopRequested;
+
+static void requestServerStop(int signal) { serverStopRequested = 1; }
+
+static u32 hashAddress(struct sockaddr_in *address) {
+    return (address->sin_addr.s_addr * 2654435761u) ^
+           (address->sin_port * 40503u);
+}
+
+// Returns the session of an address, or the empty slot it would go in.
+// The table never fills up: it has room for every peer of every match.
+static ServerSession *findSession(Server *server,
+                                  struct sockaddr_in *address) {
+    for (u32 i = hashAddress(address);; i++) {
+        ServerSession *session = &server->sessions[i % SESSION_TABLE_SIZE];
+        if (session->match < 0 || isFrom(address, &session->address)) {
+            return session;
+        }
+    }
+}
+
+// Shifts the sessions after the removed one back, so lookups never need
+// tombstones.
+static void removeSession(Server *server, struct sockaddr_in *address) {
+    ServerSession *session = findSession(server, address);
+    if (session->match < 0) return;
+    u32 hole = session - server->sessions;
+    for (u32 i = (hole + 1) % SESSION_TABLE_SIZE;;
+         i = (i + 1) % SESSION_TABLE_SIZE) {
+        ServerSession *next = &server->sessions[i];
+        if (next->match < 0) break;
+        u32 home = hashAddress(&next->address) % SESSION_TABLE_SIZE;
+        u32 fromHome = (i - home) % SESSION_TABLE_SIZE;
+        u32 fromHole = (i - hole) % SESSION_TABLE_SIZE;
+        if (fromHome >= fromHole) {
+            server->sessions[hole] = *next;
+            hole = i;
+        }
+    }
+    server->sessions[hole].match = -1;
+}
+
+// Peers share the server's dictionaries but compress with their own
+// context, on the thread of their match's worker.
+static void initServerPeer(Server *server, Lan *peer,
+                           struct sockaddr_in *address, u32 dictId) {
+    peer->lanMode = LServer;
+    peer->compression = server->config->compression;
+    peer->netRate = server->config->netRate;
+    resetLanSession(peer);
+    if (address) peer->clientAddress = *address;
+    if (!peer->cctx) {
+        peer->cctx = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(peer->cctx, ZSTD_c_compressionLevel,
+                               COMPRESSION_LEVEL);
+        peer->netSnapshots = calloc(1, sizeof(SnapshotHistory));
+    }
+    ZSTD_CCtx_reset(peer->cctx, ZSTD_reset_session_only);
+    peer->cdict = server->config->cdict;
+    peer->dictId = server->config->dictId;
+    useSnapshotDict(peer, dictId);
+    memset(peer->netSnapshots, 0, sizeof(SnapshotHistory));
+    peer->netTick = 0;
+    peer->ackedTick = 0;
+}
+
+static void initMatchGame(Match *m, unsigned long long seed, int stage) {
+    Game *game = m->game;
+    memset(game, 0, sizeof(Game));
+    game->headless = true;
+    game->mute = true;
+    game->seed = seed;
+    seedRng(&game->rng, seed);
+    initGame(game);
+    game->mode = GMLan;
+    game->lan.lanMode = LServer;
+    initGameRun(game);
+    initStage(game, stage);
+    setScreen(game, GSPlayLan);
+    // Nobody presses enter to start a bot match.
+    if (m->isBot) game->stageCurtainTime = STAGE_CURTAIN_TIME;
+    m->endTick = 0;
+}
+
+static void startMatch(Server *server, Match *m) {
+    if (!m->game) m->game = malloc(sizeof(Game));
+    m->generation++;
+    initMatchGame(m, server->seed++, 1);
+    atomic_store_explicit(&m->state, MSRunning, memory_order_release);
+}
+
+static void sendJoinAccept(Server *server, struct sockaddr_in *address,
+                           int player) {
+    char reply[32];
+    snprintf(reply, sizeof(reply), "JOIN_ACCEPT %d", player);
+    sendto(server->socket, reply, strlen(reply), 0,
+           (struct sockaddr *)address, sizeof(*address));
+}
+
+// Pairs clients in the order they ask to join.
+static void joinMatch(Server *server, struct sockaddr_in *address,
+                      u32 dictId) {
+    if (server->waitingMatch < 0) {
+        for (int i = 0; i < MAX_MATCHES; i++) {
+            if (atomic_load(&server->matches[i].state) == MSFree) {
+                server->waitingMatch = i;
+                break;
+            }
+        }
+        if (server->waitingMatch < 0) {
+            printf("Server full, ignoring %s\n", inet_ntoa(address->sin_addr));
+            return;
+        }
+        Match *m = &server->matches[server->waitingMatch];
+        m->players = 0;
+        m->isBot = false;
+        atomic_store(&m->state, MSWaiting);
+    }
+    int index = server->waitingMatch;
+    Match *m = &server->matches[index];
+    int player = m->players++;
+    initServerPeer(server, &m->peers[player], address, dictId);
+    *findSession(server, address) =
+        (ServerSession){.match = index, .player = player, .address = *address};
+    printf("%s joined match %d as player %d\n", inet_ntoa(address->sin_addr),
+           index, player + 1);
+    if (m->players < 2) return;
+
+    server->waitingMatch = -1;
+    startMatch(server, m);
+    for (int i = 0; i < 2; i++) {
+        sendJoinAccept(server, &m->peers[i].clientAddress, i);
+    }
+}
+
+static void routeInput(Server *server, ServerSession *session, char *buffer,
+                       int size) {
+    if (size != CLIENT_PACKET_SIZE) return;
+    Match *m = &server->matches[session->match];
+    ServerWorker *w = &server->workers[session->match % server->workerCount];
+    // A worker this far behind loses the packet, the redundant inputs in
+    // the next one cover for it.
+    ServerInput *slot = ringWriteSlot(&w->inputs);
+    if (!slot) return;
+    slot->match = session->match;
+    slot->generation = m->generation;
+    slot->player = session->player;
+    slot->ackedTick = readInputPacket(buffer, &slot->input);
+    ringPush(&w->inputs);
+}
+
+static void serverMessage(Server *server, char *buffer, int size,
+                          struct sockaddr_in *address) {
+    buffer[size] = '\0';
+    ServerSession *session = findSession(server, address);
+    if (session->match >= 0) {
+        Match *m = &server->matches[session->match];
+        if (atomic_load_explicit(&m->state, memory_order_acquire) !=
+            MSRunning) {
+            return;
+        }
+        // The client asks again if the accept got lost.
+        if (strncmp(buffer, "JOIN_REQUEST", 12) == 0) {
+            sendJoinAccept(server, address, session->player);
+        } else {
+            routeInput(server, session, buffer, size);
+        }
+    } else if (strcmp(buffer, "DISCOVER") == 0) {
+        char reply[] = "AVAILABLE";
+        sendto(server->socket, reply, strlen(reply), 0,
+               (struct sockaddr *)address, sizeof(*address));
+    } else if (strncmp(buffer, "JOIN_REQUEST", 12) == 0) {
+        u32 dictId = 0;
+        sscanf(buffer + 12, "%u", &dictId);
+        joinMatch(server, address, dictId);
+    }
+}
+
+// Frees the matches the workers are done with.
+static void sweepMatches(Server *server) {
+    for (int i = 0; i < MAX_MATCHES; i++) {
+        Match *m = &server->matches[i];
+        if (atomic_load_explicit(&m->state, memory_order_acquire) !=
+            MSFinished) {
+            continue;
+        }
+        for (int p = 0; p < 2; p++) {
+            removeSession(server, &m->peers[p].clientAddress);
+        }
+        atomic_store(&m->state, MSFree);
+        printf("Match %d finished\n", i);
+    }
+}
+
+static void drainServerInputs(ServerWorker *w) {
+    ServerInput *input;
+    while ((input = ringReadSlot(&w->inputs))) {
+        Match *m = &w->server->matches[input->match];
+        if (atomic_load_explicit(&m->state, memory_order_acquire) ==
+                MSRunning &&
+            m->generation == input->generation) {
+            Lan *peer = &m->peers[input->player];
+            peer->timeout = 0;
+            ackSnapshot(peer, input->ackedTick);
+            receiveClientInput(peer, &input->input);
+        }
+        ringPop(&w->inputs);
+    }
+}
+
+// Bots have no client: their snapshots are encoded and compressed like any
+// other, counted, then dropped and acked right away.
+static void sendMatchSnapshots(ServerWorker *w, Match *m) {
+    Game *game = m->game;
+    GameStatePacket packet;
+    bool isFilled = false;
+    for (int p = 0; p < 2; p++) {
+        Lan *peer = &m->peers[p];
+        if (!snapshotDue(peer, game->tick, game->sfxPlayed)) continue;
+        if (!isFilled) {
+            fillGameStatePacket(game, &packet);
+            isFilled = true;
+        }
+        markSnapshotSent(peer, game->tick, &packet);
+        PacketBatch *batch = &w->outgoing;
+        if (!nextPacket(batch)) sendPackets(w->server->socket, batch);
+        int count = batch->count;
+        queueSnapshot(peer, &packet, batch, nextPacket(batch));
+        if (batch->count == count) continue;
+        atomic_fetch_add_explicit(&w->bytesSent, batch->sizes[count],
+                                  memory_order_relaxed);
+        if (m->isBot) {
+            batch->count--;
+            ackSnapshot(peer, packet.tick);
+        }
+    }
+}
+
+// The host's LAN tick, for two remote players.
+static void stepMatch(ServerWorker *w, Match *m) {
+    Game *game = m->game;
+    Lan *peers = m->peers;
+    if (m->isBot) {
+        nextScriptTick(game, &m->script);
+        peers[TPlayer1].clientInput =
+            (InputFrame){.command = game->playerCommands[TPlayer1],
+                         .proceed = game->proceed};
+        peers[TPlayer2].clientInput =
+            (InputFrame){.command = game->playerCommands[TPlayer2]};
     } else {
-        game.soundtrackPhase++;
-        game.soundtrackPhase %= 4;
+        for (int p = 0; p < 2; p++) {
+            nextClientInput(&peers[p], game->tick);
+            peers[p].timeout += TICK_TIME;
+        }
+    }
+    game->playerCommands[TPlayer1] = peers[TPlayer1].clientInput.command;
+    game->lan.clientInput = peers[TPlayer2].clientInput;
+    game->proceed = peers[TPlayer1].clientInput.proceed ||
+                    peers[TPlayer2].clientInput.proceed;
+
+    for (int i = 0; i < MAX_SFX_PLAYED; i++) {
+        game->sfxPlayed[i] = SFX_MAX;
+    }
+    storePrevPositions(game);
+    if (game->screen == GSPlayLan) {
+        gameLogic(game);
+    } else if (game->screen == GSScoreLan) {
+        stageSummaryLogic(game);
     }
-    game.soundtrack = track;
-    playSound(currentSoundtrack);
+    game->tick++;
+    sendMatchSnapshots(w, m);
+
+    if (m->isBot) {
+        if (game->screen != GSPlayLan) {
+            initMatchGame(m, game->seed + 1, game->stage % LEVEL_COUNT + 1);
+            for (int p = 0; p < 2; p++) {
+                initServerPeer(w->server, &peers[p], NULL,
+                               w->server->config->dictId);
+            }
+        }
+        return;
+    }
+    if (!m->endTick && game->screen != GSPlayLan &&
+        game->screen != GSScoreLan) {
+        m->endTick = game->tick + MATCH_END_TICKS;
+    }
+    bool isTimedOut =
+        peers[TPlayer1].timeout > TIMEOUT || peers[TPlayer2].timeout > TIMEOUT;
+    if (isTimedOut) {
+        printf("Match %ld timed out\n", m - w->server->matches);
+    }
+    if (isTimedOut || (m->endTick && game->tick >= m->endTick)) {
+        atomic_store_explicit(&m->state, MSFinished, memory_order_release);
+    }
+}
+
+static void sleepUntil(double time) {
+    double delay = time - benchTime();
+    if (delay <= 0) return;
+    struct timespec t = {(time_t)delay, (long)(fmod(delay, 1) * 1e9)};
+    nanosleep(&t, NULL);
+}
+
+// Steps every running match of this worker once per tick. A worker that
+// falls behind drops the lost time instead of catching up in a burst.
+static void *runServerWorker(void *arg) {
+    ServerWorker *w = arg;
+    Server *server = w->server;
+    double nextTick = benchTime();
+    while (atomic_load(&server->running)) {
+        double start = benchTime();
+        drainServerInputs(w);
+        long ticks = 0;
+        for (int i = w->index; i < MAX_MATCHES; i += server->workerCount) {
+            Match *m = &server->matches[i];
+            if (atomic_load_explicit(&m->state, memory_order_acquire) ==
+                MSRunning) {
+                stepMatch(w, m);
+                ticks++;
+            }
+        }
+        sendPackets(server->socket, &w->outgoing);
+        double end = benchTime();
+        atomic_fetch_add_explicit(&w->busyTime, (end - start) * 1e9,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&w->matchTicks, ticks,
+                                  memory_order_relaxed);
+        nextTick = MAX(nextTick + TICK_TIME, end);
+        sleepUntil(nextTick);
+    }
+    return NULL;
+}
+
+// The CPU time per match tick includes the worker's share of the socket
+// and compression work. A core runs TICK_RATE ticks of that many matches.
+static void printServerStats(Server *server, double seconds) {
+    int running = 0, bots = 0;
+    for (int i = 0; i < MAX_MATCHES; i++) {
+        Match *m = &server->matches[i];
+        if (atomic_load(&m->state) != MSRunning) continue;
+        running++;
+        bots += m->isBot;
+    }
+    long busyTime = 0, matchTicks = 0, bytesSent = 0;
+    char busy[256] = "";
+    for (int i = 0; i < server->workerCount; i++) {
+        ServerWorker *w = &server->workers[i];
+        long workerBusy = atomic_load(&w->busyTime) - w->reportedBusyTime;
+        busyTime += workerBusy;
+        matchTicks += atomic_load(&w->matchTicks) - w->reportedMatchTicks;
+        bytesSent += atomic_load(&w->bytesSent) - w->reportedBytesSent;
+        w->reportedBusyTime += workerBusy;
+        w->reportedMatchTicks = atomic_load(&w->matchTicks);
+        w->reportedBytesSent = atomic_load(&w->bytesSent);
+        size_t length = strlen(busy);
+        snprintf(busy + length, sizeof(busy) - length, " %.0f%%",
+                 workerBusy / 1e7 / seconds);
+    }
+    double tickCost = matchTicks ? busyTime / 1e3 / matchTicks : 0;
+    printf("%d matches (%d bots), %.1f us per match tick, %.0f matches per "
+           "core, %.1f kB/s, busy%s\n",
+           running, bots, tickCost,
+           tickCost ? TICK_TIME * 1e6 / tickCost : 0,
+           bytesSent / 1e3 / seconds, busy);
 }
+
+// Runs LAN matches for any number of client pairs on one socket, each
+// match on one of workerCount threads. botCount matches play the script
+// without clients to measure how many matches a core can run.
+static void runServer(Game *game, InputScript *script, int workerCount,
+                      int botCount) {
+    Server *server = calloc(1, sizeof(Server));
+    game->lan.lanMode = LServer;
+    initHostGame(game);
+    server->socket = game->lan.socket;
+    server->config = &game->lan;
+    server->seed = game->seed;
+    server->workerCount = workerCount;
+    server->waitingMatch = -1;
+    for (int i = 0; i < SESSION_TABLE_SIZE; i++) {
+        server->sessions[i].match = -1;
+    }
+    for (int i = 0; i < MIN(botCount, MAX_MATCHES); i++) {
+        Match *m = &server->matches[i];
+        m->isBot = true;
+        m->script = *script;
+        for (int p = 0; p < 2; p++) {
+            initServerPeer(server, &m->peers[p], NULL, game->lan.dictId);
+        }
+        startMatch(server, m);
+    }
+
+    atomic_store(&server->running, true);
+    server->workers = calloc(workerCount, sizeof(ServerWorker));
+    for (int i = 0; i < workerCount; i++) {
+        ServerWorker *w = &server->workers[i];
+        w->server = server;
+        w->index = i;
+        initRing(&w->inputs, sizeof(ServerInput), SERVER_INPUT_RING_SIZE);
+        initPacketBatch(&w->outgoing, MAX_COMPRESSED_PACKET_SIZE);
+        pthread_create(&w->thread, NULL, runServerWorker, w);
+    }
+    printf("%d worker(s), %d bot match(es)\n", workerCount,
+           MIN(botCount, MAX_MATCHES));
+
+    signal(SIGINT, requestServerStop);
+    signal(SIGTERM, requestServerStop);
+#ifdef __linux__
+    int epollFd = epoll_create1(0);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = server->socket};
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, server->socket, &event);
+#else
+    struct pollfd pollFd = {.fd = server->socket, .events = POLLIN};
+#endif
+    PacketBatch *batch = &game->lan.received;
+    double statsTime = benchTime();
+    while (!serverStopRequested) {
+#ifdef __linux__
+        epoll_wait(epollFd, &event, 1, 100);
+#else
+        poll(&pollFd, 1, 100);
 #endif
+        while (receivePackets(server->socket, batch) > 0) {
+            for (int i = 0; i < batch->count; i++) {
+                serverMessage(server, packetBuffer(batch, i), batch->sizes[i],
+                              &batch->addresses[i]);
+            }
+            if (batch->count < PACKET_BATCH_SIZE) break;
+        }
+        sweepMatches(server);
+        double now = benchTime();
+        if (now - statsTime >= SERVER_STATS_INTERVAL) {
+            printServerStats(server, now - statsTime);
+            statsTime = now;
+        }
+    }
 
-int main(void) {
+    atomic_store(&server->running, false);
+    for (int i = 0; i < workerCount; i++) {
+        pthread_join(server->workers[i].thread, NULL);
+    }
+    printServerStats(server, benchTime() - statsTime);
+#ifdef __linux__
+    close(epollFd);
+#endif
+    close(server->socket);
+}
+
+typedef struct {
+    const char *name;
+    NetConditions conditions;
+} LanScenario;
+
+static const LanScenario LAN_SCENARIOS[] = {
+    {"lan", {}},
+    {"wifi", {.delay = 3, .jitter = 2, .loss = 1}},
+    {"internet",
+     {.delay = 40, .jitter = 8, .loss = 2, .duplicate = 1, .reorder = 2}},
+    {"lossy", {.delay = 10, .jitter = 3, .loss = 10}},
+    {"narrow", {.delay = 5, .bandwidth = 24}},
+};
+
+static Game *newBenchPeer(Game *game, LanMode mode, NetConditions conditions,
+                          u64 seed) {
+    Game *peer = calloc(1, sizeof(Game));
+    peer->headless = true;
+    peer->mute = true;
+    peer->seed = game->seed;
+    seedRng(&peer->rng, peer->seed);
+    initGame(peer);
+    peer->mode = GMLan;
+    peer->lan.lanMode = mode;
+    peer->lan.netRate = game->lan.netRate;
+    peer->lan.compression = game->lan.compression;
+    peer->lan.netEmulator =
+        newNetEmulator(conditions, seed, MAX_COMPRESSED_PACKET_SIZE);
+    return peer;
+}
+
+// Has the client find and join the host over loopback.
+static void joinBenchPeers(Game *host, Game *client, const char *name) {
+    initHostGame(host);
+    setScreen(host, GSHostGame);
+    initJoinGame(client);
+    setScreen(client, GSJoinGame);
+    Lan *lan = &client->lan;
+    lan->serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    lan->serverAddress.sin_port = htons(PORT);
+    lan->joinableAddresses[0] = lan->serverAddress;
+    lan->availableGames = 1;
+    lan->selectedAddressIndex = 0;
+    client->proceed = true;
+    for (int i = 0; i < 1000 && (host->screen != GSPlayLan ||
+                                 client->screen != GSPlayLan);
+         i++) {
+        stepGame(client);
+        stepGame(host);
+        sleepUntil(benchTime() + 0.001);
+    }
+    if (host->screen != GSPlayLan || client->screen != GSPlayLan) {
+        fprintf(stderr, "%s: the client could not join\n", name);
+        exit(1);
+    }
+}
+
+// Plays a host and a client in one process over loopback, both sending
+// through the network emulator, and reports how long client inputs take to
+// reach the host, how old the state the client shows is and the traffic
+// each way. Runs the built-in scenarios, or the --net-* conditions alone.
+static void runLanBench(Game *game, InputScript *script, long maxTicks,
+                        NetConditions *conditions) {
+    LanScenario custom = {"custom", *conditions};
+    const LanScenario *scenarios = LAN_SCENARIOS;
+    int scenarioCount = ASIZE(LAN_SCENARIOS);
+    if (hasNetConditions(conditions)) {
+        scenarios = &custom;
+        scenarioCount = 1;
+    }
+    long ticks = MIN(maxTicks, LAN_BENCH_SECONDS * TICK_RATE);
+    double *sampleTimes = malloc((ticks + 1) * sizeof(double));
+    double *latencies = malloc((ticks + 1) * sizeof(double));
+    double *ages = malloc(ticks * sizeof(double));
+
+    printf("%ld ticks per scenario\n", ticks);
+    printf("%-9s %17s %16s %10s %12s %12s %8s\n", "scenario",
+           "input ms avg/p95", "age ms avg/p95", "host kB/s", "client kB/s",
+           "snapshots/s", "dropped");
+    for (int s = 0; s < scenarioCount; s++) {
+        const LanScenario *scenario = &scenarios[s];
+        Game *host =
+            newBenchPeer(game, LServer, scenario->conditions, game->seed);
+        Game *client =
+            newBenchPeer(game, LClient, scenario->conditions, game->seed + 1);
+        joinBenchPeers(host, client, scenario->name);
+        Lan *lan = &client->lan;
+
+        InputScript hostScript = *script, clientScript = *script;
+        memset(sampleTimes, 0, (ticks + 1) * sizeof(double));
+        long latencyCount = 0, ageCount = 0, appliedTick = 0;
+        double start = benchTime(), nextTick = start;
+        for (long t = 0; t < ticks; t++) {
+            nextScriptTick(client, &clientScript);
+            stepGame(client);
+            double now = benchTime();
+            if (lan->inputTick <= ticks) sampleTimes[lan->inputTick] = now;
+
+            nextScriptTick(host, &hostScript);
+            if (t == 0) host->proceed = true;
+            stepGame(host);
+            now = benchTime();
+            // Frames the host skipped over never took effect.
+            while (appliedTick < MIN(host->lan.inputTick, ticks)) {
+                appliedTick++;
+                InputFrame *frame = &host->lan.inputHistory[appliedTick %
+                                                            INPUT_HISTORY_SIZE];
+                if (frame->tick == appliedTick && sampleTimes[appliedTick]) {
+                    latencies[latencyCount++] = now - sampleTimes[appliedTick];
+                }
+            }
+            if (lan->renderTick > 0) {
+                ages[ageCount++] = (host->tick - lan->renderTick) * TICK_TIME;
+            }
+            nextTick += TICK_TIME;
+            sleepUntil(nextTick);
+        }
+        double seconds = benchTime() - start;
+        closeLanSocket(&host->lan);
+        closeLanSocket(&client->lan);
+
+        NetEmulator *up = client->lan.netEmulator;
+        NetEmulator *down = host->lan.netEmulator;
+        double latency = 0, age = 0;
+        for (long i = 0; i < latencyCount; i++) latency += latencies[i];
+        for (long i = 0; i < ageCount; i++) age += ages[i];
+        printf("%-9s %7.1f / %-7.1f %6.1f / %-7.1f %10.1f %12.1f %12.1f %8ld\n",
+               scenario->name,
+               latencyCount ? latency * 1e3 / latencyCount : 0,
+               percentile(latencies, latencyCount, 0.95) * 1e3,
+               ageCount ? age * 1e3 / ageCount : 0,
+               percentile(ages, ageCount, 0.95) * 1e3,
+               down->sentBytes / seconds / 1e3, up->sentBytes / seconds / 1e3,
+               down->sentPackets / seconds,
+               down->droppedPackets + up->droppedPackets);
+        freeLanSession(&host->lan);
+        freeLanSession(&client->lan);
+        free(host);
+        free(client);
+    }
+    free(sampleTimes);
+    free(latencies);
+    free(ages);
+}
+
+// Plays a lockstep game over loopback and has one side see a wrong state
+// hash from the other, so it falls back to snapshots first. Checks that
+// once both did, the client's input still reaches the host. Returns
+// whether it does.
+static bool runDesyncCheck(Game *game, InputScript *script, bool hostFirst) {
+    Game *host = newBenchPeer(game, LServer, (NetConditions){}, game->seed);
+    Game *client =
+        newBenchPeer(game, LClient, (NetConditions){}, game->seed + 1);
+    host->lan.useLockstep = true;
+    host->lan.inputDelay = LOCKSTEP_INPUT_DELAY;
+    joinBenchPeers(host, client, "desync");
+
+    Lan *first = hostFirst ? &host->lan : &client->lan;
+    InputScript hostScript = *script, clientScript = *script;
+    long fallbackTick = 0;
+    double nextTick = benchTime();
+    for (long t = 0; t < DESYNC_CHECK_SECONDS * TICK_RATE; t++) {
+        nextScriptTick(client, &clientScript);
+        stepGame(client);
+        nextScriptTick(host, &hostScript);
+        if (t == 0) host->proceed = true;
+        stepGame(host);
+        if (first->lockstep && first->hashTick == LOCKSTEP_HASH_INTERVAL) {
+            first->peerHashTick = first->hashTick;
+            first->peerHash = ~first->hash;
+        }
+        if (!fallbackTick && !host->lan.lockstep && !client->lan.lockstep) {
+            fallbackTick = t;
+        }
+        nextTick += TICK_TIME;
+        sleepUntil(nextTick);
+    }
+    closeLanSocket(&host->lan);
+    closeLanSocket(&client->lan);
+
+    // The host applies the client's frames a few ticks after they are sent.
+    long sent = client->lan.inputTick, applied = host->lan.inputTick;
+    bool ok = fallbackTick && applied <= sent && applied > sent - TICK_RATE;
+    printf("%s falls back first: %s, both at tick %ld, client input tick "
+           "%ld, applied on the host %ld\n",
+           hostFirst ? "host" : "client", ok ? "ok" : "FAILED", fallbackTick,
+           sent, applied);
+    freeLanSession(&host->lan);
+    freeLanSession(&client->lan);
+    free(host);
+    free(client);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    Game *game = calloc(1, sizeof(Game));
     char exePath[PATH_MAX];
     uint32_t size = sizeof(exePath);
     if (_NSGetExecutablePath(exePath, &size) == 0) {
@@ -2340,78 +4846,241 @@ int main(void) {
             dirname(exePath));  // set working directory to executable location
     }
 
-    srand(time(0));
+    bool headless = false;
+    bool benchCompression = false;
+    bool benchRollback = false;
+    bool benchLan = false;
+    bool checkDesync = false;
+    NetConditions netConditions = {};
+    bool server = false;
+    int workerCount = sysconf(_SC_NPROCESSORS_ONLN);
+    int botCount = 0;
+    game->seed = time(0);
+    InputScript script = {};
+    int startStage = 1;
+    int stageCount = LEVEL_COUNT;
+    long maxStageTicks = TICK_RATE * 60 * 10;
+    int jobCount = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--bench-compression") == 0) {
+            benchCompression = true;
+        } else if (strcmp(argv[i], "--bench-rollback") == 0) {
+            benchRollback = true;
+        } else if (strcmp(argv[i], "--bench-lan") == 0) {
+            benchLan = true;
+        } else if (strcmp(argv[i], "--check-desync") == 0) {
+            checkDesync = true;
+        } else if (strcmp(argv[i], "--net-delay") == 0 && i + 1 < argc) {
+            netConditions.delay = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--net-jitter") == 0 && i + 1 < argc) {
+            netConditions.jitter = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--net-loss") == 0 && i + 1 < argc) {
+            netConditions.loss = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--net-duplicate") == 0 && i + 1 < argc) {
+            netConditions.duplicate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--net-reorder") == 0 && i + 1 < argc) {
+            netConditions.reorder = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--net-bandwidth") == 0 && i + 1 < argc) {
+            netConditions.bandwidth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server") == 0) {
+            server = true;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workerCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bots") == 0 && i + 1 < argc) {
+            botCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lockstep") == 0) {
+            game->lan.useLockstep = true;
+        } else if (strcmp(argv[i], "--rollback") == 0) {
+            game->lan.useLockstep = true;
+            game->lan.useRollback = true;
+        } else if (strcmp(argv[i], "--input-delay") == 0 && i + 1 < argc) {
+            game->lan.inputDelay = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lan-stream") == 0) {
+            game->lan.compression = CMStream;
+        } else if (strcmp(argv[i], "--net-rate") == 0 && i + 1 < argc) {
+            game->lan.netRate = MAX(MIN_NET_RATE, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--record-snapshots") == 0 &&
+                   i + 1 < argc) {
+            snapshotRecording = fopen(argv[++i], "ab");
+            if (!snapshotRecording) {
+                perror("--record-snapshots");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--net-stats") == 0 && i + 1 < argc) {
+            netStatsFile = fopen(argv[++i], "w");
+            if (!netStatsFile) {
+                perror("--net-stats");
+                return 1;
+            }
+            fprintf(netStatsFile,
+                    "time,side,tick,rtt_ms,packets_in,packets_out,bytes_in,"
+                    "bytes_out,compression_ratio,codec_us,late_packets,"
+                    "merged_inputs,loss_percent,send_interval,jitter,"
+                    "rollbacks,replayed_ticks\n");
+        } else if (strcmp(argv[i], "--two-players") == 0) {
+            game->mode = GMTwoPlayers;
+        } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            script = loadInputScript(argv[++i]);
+        } else if (strcmp(argv[i], "--stage") == 0 && i + 1 < argc) {
+            startStage = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stages") == 0 && i + 1 < argc) {
+            stageCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            game->seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--max-ticks") == 0 && i + 1 < argc) {
+            maxStageTicks = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobCount = atoi(argv[++i]);
+        }
+    }
+    startStage = MAX(1, MIN(startStage, LEVEL_COUNT));
+    jobCount = MAX(1, jobCount);
+    workerCount = MAX(1, workerCount);
+    if (!game->lan.inputDelay) {
+        game->lan.inputDelay = game->lan.useRollback ? ROLLBACK_INPUT_DELAY
+                                                     : LOCKSTEP_INPUT_DELAY;
+    }
+    // A peer under rollback can lag ROLLBACK_WINDOW + inputDelay ticks
+    // behind on each side, and the frames it misses must still be in the
+    // input history.
+    int maxInputDelay = game->lan.useRollback
+                            ? INPUT_HISTORY_SIZE / 2 - ROLLBACK_WINDOW - 2
+                            : LOCKSTEP_HASH_INTERVAL / 2;
+    game->lan.inputDelay = MAX(1, MIN(game->lan.inputDelay, maxInputDelay));
+    if (benchCompression) {
+        runCompressionBench(game, &script, startStage, maxStageTicks);
+        if (snapshotRecording) fclose(snapshotRecording);
+        free(script.steps);
+        free(game);
+        return 0;
+    }
+    if (benchLan) {
+        runLanBench(game, &script, maxStageTicks, &netConditions);
+        if (netStatsFile) fclose(netStatsFile);
+        free(script.steps);
+        free(game);
+        return 0;
+    }
+    if (checkDesync) {
+        bool ok = runDesyncCheck(game, &script, true);
+        ok &= runDesyncCheck(game, &script, false);
+        free(script.steps);
+        free(game);
+        return ok ? 0 : 1;
+    }
+    if (hasNetConditions(&netConditions)) {
+        game->lan.netEmulator = newNetEmulator(netConditions, game->seed,
+                                               MAX_COMPRESSED_PACKET_SIZE);
+    }
+    if (benchRollback) {
+        runRollbackBench(game, &script, startStage, maxStageTicks);
+        free(script.steps);
+        free(game);
+        return 0;
+    }
+    if (server) {
+        runServer(game, &script, workerCount, botCount);
+        if (snapshotRecording) fclose(snapshotRecording);
+        free(script.steps);
+        free(game);
+        return 0;
+    }
+    if (headless) {
+        runHeadless(game, &script, startStage, stageCount, maxStageTicks,
+                    jobCount);
+        free(script.steps);
+        free(game);
+        return 0;
+    }
+    seedRng(&game->rng, game->seed);
 
     SetTraceLogLevel(LOG_NONE);
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(1, 1, "Battle City 4000");
     MaximizeWindow();
-    SetTargetFPS(60);
+    SetTargetFPS(GetMonitorRefreshRate(GetCurrentMonitor()));
 
     InitAudioDevice();
 
-    initGame();
-    setScreen(GSTitle);
+    initGame(game);
+    setScreen(game, GSTitle);
 
     SetExitKey(0);
 
+    float tickAccumulator = 0;
     while (!WindowShouldClose()) {
-        game.totalTime = GetTime();
+        game->totalTime = GetTime();
 
         if (IsKeyPressed(KEY_F)) {
-            if (game.fullscreen) {
-                game.fullscreen = false;
+            if (game->fullscreen) {
+                game->fullscreen = false;
                 ToggleFullscreen();
                 SetWindowSize(0, 0);
                 MaximizeWindow();
             } else {
-                game.fullscreen = true;
+                game->fullscreen = true;
                 ToggleFullscreen();
             }
         }
 
-        if (!game.fullscreen) {
-            game.screenWidth = GetScreenWidth();
-            game.screenHeight = GetScreenHeight();
+        if (!game->fullscreen) {
+            game->screenWidth = GetScreenWidth();
+            game->screenHeight = GetScreenHeight();
         } else {
             int display = GetCurrentMonitor();
-            game.screenWidth = GetMonitorWidth(display);
-            game.screenHeight = GetMonitorHeight(display);
+            game->screenWidth = GetMonitorWidth(display);
+            game->screenHeight = GetMonitorHeight(display);
         }
 
-        game.proceed = false;
-        if (IsKeyPressed(KEY_ENTER)) game.proceed = true;
+        if (IsKeyPressed(KEY_ENTER)) game->proceed = true;
+        if (IsKeyPressed(KEY_LEFT_SHIFT)) game->switchMode = true;
 
-        for (int i = 0; i < MAX_SFX_PLAYED; i++) {
-            game.sfxPlayed[i] = SFX_MAX;
+        if (IsKeyPressed(KEY_M)) game->mute = !game->mute;
+        if (IsKeyPressed(KEY_N)) game->showNetStats = !game->showNetStats;
+
+        for (int i = TPlayer1; i <= TPlayer2; i++) {
+            Command cmd = readKeyboardCommand(i);
+            cmd.fire |= game->playerCommands[i].fire;
+            game->playerCommands[i] = cmd;
         }
 
-        if (IsKeyPressed(KEY_M)) game.mute = !game.mute;
+        tickAccumulator += MIN(GetFrameTime(), MAX_FRAME_TIME);
+        while (tickAccumulator >= TICK_TIME) {
+            stepGame(game);
+            tickAccumulator -= TICK_TIME;
+        }
+        game->renderAlpha = tickAccumulator / TICK_TIME;
 
-        game.logic();
+        updateFieldLayers(game);
 
         ClearBackground(BLACK);
 
         BeginDrawing();
 
-        updateCamera();
-        BeginMode2D(game.camera);
-        game.draw();
+        updateCamera(game);
+        BeginMode2D(game->camera);
+        game->draw(game);
         EndMode2D();
 
         EndDrawing();
-        game.frameTime = GetFrameTime();
 #ifdef ALT_ASSETS
-        playMusic();
+        playMusic(game);
 #endif
     }
 
-    UnloadFont(game.font);
+    UnloadFont(assets.font);
+    for (int i = 0; i < FLMax; i++) UnloadRenderTexture(fieldLayers[i]);
 
-    saveHiScore();
+    saveHiScore(game);
 
     CloseAudioDevice();
+    if (snapshotRecording) fclose(snapshotRecording);
+    if (netStatsFile) fclose(netStatsFile);
     CloseWindow();
 
+    free(game);
+
     return 0;
 }
@@ -0,0 +1,180 @@
+#ifndef NET_EMULATOR_H
+#define NET_EMULATOR_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "networkHeaders.h"
+#include "packetBatch.h"
+#include "utils.h"
+
+#define NET_EMULATOR_QUEUE_SIZE 1024
+// A capped link drops what would wait longer than this to go out, in
+// seconds.
+#define NET_EMULATOR_MAX_BACKLOG 0.2
+
+// Network conditions to put on outgoing datagrams, to try LAN play under
+// latency and loss on one machine. Times are in milliseconds, rates in
+// percent and bandwidth in kbit/s, 0 for none.
+typedef struct {
+    float delay;
+    // Standard deviation of the delay. Jitter alone reorders datagrams,
+    // reorder sends a share of them right away, ahead of the delayed ones.
+    float jitter;
+    float loss;
+    float duplicate;
+    float reorder;
+    int bandwidth;
+} NetConditions;
+
+typedef struct {
+    double releaseTime;
+    int size;
+    struct sockaddr_in address;
+    char *buffer;
+} DelayedPacket;
+
+// Datagrams wait in a min heap on their release time. Their buffers are
+// allocated once and reused from a free list.
+typedef struct {
+    NetConditions conditions;
+    Rng rng;
+    DelayedPacket queue[NET_EMULATOR_QUEUE_SIZE];
+    int count;
+    char *buffers;
+    char *freeBuffers[NET_EMULATOR_QUEUE_SIZE];
+    int freeCount;
+    size_t bufferSize;
+    double linkFreeTime;
+    long sentPackets;
+    long sentBytes;
+    long droppedPackets;
+} NetEmulator;
+
+static bool hasNetConditions(const NetConditions *c) {
+    return c->delay > 0 || c->jitter > 0 || c->loss > 0 || c->duplicate > 0 ||
+           c->reorder > 0 || c->bandwidth > 0;
+}
+
+static NetEmulator *newNetEmulator(NetConditions conditions, u64 seed,
+                                   size_t bufferSize) {
+    NetEmulator *em = calloc(1, sizeof(NetEmulator));
+    em->conditions = conditions;
+    seedRng(&em->rng, seed);
+    em->bufferSize = bufferSize;
+    em->buffers = malloc(bufferSize * NET_EMULATOR_QUEUE_SIZE);
+    for (int i = 0; i < NET_EMULATOR_QUEUE_SIZE; i++) {
+        em->freeBuffers[i] = em->buffers + i * bufferSize;
+    }
+    em->freeCount = NET_EMULATOR_QUEUE_SIZE;
+    return em;
+}
+
+static void freeNetEmulator(NetEmulator *em) {
+    if (!em) return;
+    free(em->buffers);
+    free(em);
+}
+
+static double randomUnit(Rng *rng) { return nextRandom(rng) / 4294967296.0; }
+
+static bool randomChance(Rng *rng, float percent) {
+    return percent > 0 && randomUnit(rng) * 100 < percent;
+}
+
+// Box-Muller.
+static double randomNormal(Rng *rng) {
+    double u = 1 - randomUnit(rng);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * randomUnit(rng));
+}
+
+static void swapDelayed(NetEmulator *em, int i, int j) {
+    DelayedPacket p = em->queue[i];
+    em->queue[i] = em->queue[j];
+    em->queue[j] = p;
+}
+
+static void pushDelayed(NetEmulator *em, DelayedPacket *packet) {
+    int i = em->count++;
+    em->queue[i] = *packet;
+    while (i > 0 &&
+           em->queue[(i - 1) / 2].releaseTime > em->queue[i].releaseTime) {
+        swapDelayed(em, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void popDelayed(NetEmulator *em) {
+    em->freeBuffers[em->freeCount++] = em->queue[0].buffer;
+    em->queue[0] = em->queue[--em->count];
+    for (int i = 0;;) {
+        int smallest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2; child++) {
+            if (child < em->count && em->queue[child].releaseTime <
+                                         em->queue[smallest].releaseTime) {
+                smallest = child;
+            }
+        }
+        if (smallest == i) break;
+        swapDelayed(em, i, smallest);
+        i = smallest;
+    }
+}
+
+// Takes the batch's datagrams instead of sending them: drops, copies and
+// delays each one by the conditions, and queues it for releasePackets.
+static void emulatePackets(NetEmulator *em, PacketBatch *batch, double now) {
+    NetConditions *c = &em->conditions;
+    for (int i = 0; i < batch->count; i++) {
+        if (randomChance(&em->rng, c->loss)) {
+            em->droppedPackets++;
+            continue;
+        }
+        int copies = randomChance(&em->rng, c->duplicate) ? 2 : 1;
+        for (int copy = 0; copy < copies; copy++) {
+            double sendTime = now;
+            if (c->bandwidth > 0) {
+                sendTime = MAX(now, em->linkFreeTime);
+                if (sendTime - now > NET_EMULATOR_MAX_BACKLOG) {
+                    em->droppedPackets++;
+                    continue;
+                }
+                em->linkFreeTime =
+                    sendTime + batch->sizes[i] * 8.0 / (c->bandwidth * 1000.0);
+                sendTime = em->linkFreeTime;
+            }
+            double delay = 0;
+            if (!randomChance(&em->rng, c->reorder)) {
+                delay = MAX(0, c->delay + c->jitter * randomNormal(&em->rng));
+            }
+            if (!em->freeCount) {
+                em->droppedPackets++;
+                continue;
+            }
+            DelayedPacket packet = {sendTime + delay / 1000, batch->sizes[i],
+                                    batch->addresses[i],
+                                    em->freeBuffers[--em->freeCount]};
+            memcpy(packet.buffer, packetBuffer(batch, i), packet.size);
+            pushDelayed(em, &packet);
+        }
+    }
+    batch->count = 0;
+}
+
+// Sends the queued datagrams that are due.
+static void releasePackets(NetEmulator *em, int fd, double now) {
+    while (em->count && em->queue[0].releaseTime <= now) {
+        DelayedPacket *p = &em->queue[0];
+        if (sendto(fd, p->buffer, p->size, 0, (struct sockaddr *)&p->address,
+                   sizeof(p->address)) < 0) {
+            perror("sendto");
+        } else {
+            em->sentPackets++;
+            em->sentBytes += p->size;
+        }
+        popDelayed(em);
+    }
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef PACKET_BATCH_H
+#define PACKET_BATCH_H
+
+#include "networkHeaders.h"
+#include "utils.h"
+
+#define PACKET_BATCH_SIZE 32
+
+// Datagrams read or written with one syscall where the platform allows:
+// recvmmsg and sendmmsg on Linux, a recvfrom or sendto loop elsewhere. The
+// buffers are allocated once and reused for every batch.
+typedef struct {
+    char *buffers;
+    size_t bufferSize;
+    int count;
+    int sizes[PACKET_BATCH_SIZE];
+    struct sockaddr_in addresses[PACKET_BATCH_SIZE];
+#ifdef __linux__
+    struct mmsghdr messages[PACKET_BATCH_SIZE];
+    struct iovec vectors[PACKET_BATCH_SIZE];
+#endif
+} PacketBatch;
+
+static void initPacketBatch(PacketBatch *batch, size_t bufferSize) {
+    if (batch->buffers) return;
+    // One spare byte so text messages can be terminated in place.
+    batch->bufferSize = bufferSize + 1;
+    batch->buffers = malloc(batch->bufferSize * PACKET_BATCH_SIZE);
+    batch->count = 0;
+}
+
+static void freePacketBatch(PacketBatch *batch) {
+    free(batch->buffers);
+    batch->buffers = NULL;
+}
+
+static char *packetBuffer(PacketBatch *batch, int i) {
+    return batch->buffers + i * batch->bufferSize;
+}
+
+// Fills the batch with waiting datagrams and returns their count, 0 once
+// the socket is drained. A full batch means more may be waiting.
+static int receivePackets(int fd, PacketBatch *batch) {
+    batch->count = 0;
+#ifdef __linux__
+    for (int i = 0; i < PACKET_BATCH_SIZE; i++) {
+        batch->vectors[i] = (struct iovec){packetBuffer(batch, i),
+                                           batch->bufferSize - 1};
+        batch->messages[i] = (struct mmsghdr){
+            .msg_hdr = {.msg_name = &batch->addresses[i],
+                        .msg_namelen = sizeof(batch->addresses[i]),
+                        .msg_iov = &batch->vectors[i],
+                        .msg_iovlen = 1}};
+    }
+    int n = recvmmsg(fd, batch->messages, PACKET_BATCH_SIZE, MSG_DONTWAIT,
+                     NULL);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) perror("recvmmsg");
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        batch->sizes[i] = batch->messages[i].msg_len;
+    }
+    batch->count = n;
+#else
+    while (batch->count < PACKET_BATCH_SIZE) {
+        socklen_t addressLength = sizeof(batch->addresses[0]);
+        int n = recvfrom(fd, packetBuffer(batch, batch->count),
+                         batch->bufferSize - 1, 0,
+                         (struct sockaddr *)&batch->addresses[batch->count],
+                         &addressLength);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("recvfrom");
+            break;
+        }
+        batch->sizes[batch->count++] = n;
+    }
+#endif
+    return batch->count;
+}
+
+// Returns the buffer for the next outgoing datagram, or NULL when the batch
+// is full.
+static char *nextPacket(PacketBatch *batch) {
+    if (batch->count == PACKET_BATCH_SIZE) return NULL;
+    return packetBuffer(batch, batch->count);
+}
+
+static void queuePacket(PacketBatch *batch, size_t size,
+                        struct sockaddr_in *address) {
+    batch->sizes[batch->count] = size;
+    batch->addresses[batch->count] = *address;
+    batch->count++;
+}
+
+static void sendPackets(int fd, PacketBatch *batch) {
+#ifdef __linux__
+    for (int i = 0; i < batch->count; i++) {
+        batch->vectors[i] =
+            (struct iovec){packetBuffer(batch, i), batch->sizes[i]};
+        batch->messages[i] = (struct mmsghdr){
+            .msg_hdr = {.msg_name = &batch->addresses[i],
+                        .msg_namelen = sizeof(batch->addresses[i]),
+                        .msg_iov = &batch->vectors[i],
+                        .msg_iovlen = 1}};
+    }
+    for (int sent = 0; sent < batch->count;) {
+        int n = sendmmsg(fd, batch->messages + sent, batch->count - sent,
+                         0);
+        if (n < 0) {
+            perror("sendmmsg");
+            break;
+        }
+        sent += n;
+    }
+#else
+    for (int i = 0; i < batch->count; i++) {
+        if (sendto(fd, packetBuffer(batch, i), batch->sizes[i], 0,
+                   (struct sockaddr *)&batch->addresses[i],
+                   sizeof(batch->addresses[i])) < 0) {
+            perror("sendto");
+        }
+    }
+#endif
+    batch->count = 0;
+}
+
+// Sends the batch's first datagram to every address, from the same buffer.
+static void broadcastPacket(int fd, PacketBatch *batch,
+                            struct sockaddr_in *addresses, int count) {
+    char *buffer = packetBuffer(batch, 0);
+    int size = batch->sizes[0];
+#ifdef __linux__
+    for (int start = 0; start < count; start += PACKET_BATCH_SIZE) {
+        int n = MIN(count - start, PACKET_BATCH_SIZE);
+        for (int i = 0; i < n; i++) {
+            batch->vectors[i] = (struct iovec){buffer, size};
+            batch->messages[i] = (struct mmsghdr){
+                .msg_hdr = {.msg_name = &addresses[start + i],
+                            .msg_namelen = sizeof(addresses[start + i]),
+                            .msg_iov = &batch->vectors[i],
+                            .msg_iovlen = 1}};
+        }
+        for (int sent = 0; sent < n;) {
+            int result = sendmmsg(fd, batch->messages + sent, n - sent, 0);
+            if (result < 0) {
+                perror("sendmmsg");
+                break;
+            }
+            sent += result;
+        }
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        if (sendto(fd, buffer, size, 0, (struct sockaddr *)&addresses[i],
+                   sizeof(addresses[i])) < 0) {
+            perror("sendto");
+        }
+    }
+#endif
+    batch->count = 0;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+// Single producer, single consumer queue of fixed size slots that are
+// allocated once. The producer fills the slot returned by ringWriteSlot and
+// publishes it with ringPush, the consumer reads the slot returned by
+// ringReadSlot and frees it with ringPop. The capacity must be a power of
+// two so the counters can wrap.
+typedef struct {
+    u8 *slots;
+    size_t slotSize;
+    u32 capacity;
+    _Atomic u32 head;
+    _Atomic u32 tail;
+} SpscRing;
+
+static void initRing(SpscRing *ring, size_t slotSize, u32 capacity) {
+    ring->slots = malloc(slotSize * capacity);
+    ring->slotSize = slotSize;
+    ring->capacity = capacity;
+    atomic_store(&ring->head, 0);
+    atomic_store(&ring->tail, 0);
+}
+
+static void freeRing(SpscRing *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+// Returns NULL when the ring is full.
+static void *ringWriteSlot(SpscRing *ring) {
+    u32 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    u32 tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == ring->capacity) return NULL;
+    return ring->slots + (head % ring->capacity) * ring->slotSize;
+}
+
+static void ringPush(SpscRing *ring) {
+    u32 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Returns NULL when the ring is empty.
+static void *ringReadSlot(SpscRing *ring) {
+    u32 tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    u32 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head == tail) return NULL;
+    return ring->slots + (tail % ring->capacity) * ring->slotSize;
+}
+
+static void ringPop(SpscRing *ring) {
+    u32 tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+#endif
@@ -2,10 +2,13 @@
 #define UTILS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+typedef uint64_t u64;
 typedef uint32_t u32;
+typedef uint16_t u16;
 typedef uint8_t u8;
 
 typedef struct {
@@ -47,6 +50,35 @@ Buffer readFile(const char *filename) {
     return res;
 }
 
+// PCG32 (pcg-random.org): small, fast and fully determined by its seed.
+typedef struct {
+    u64 state;
+    u64 inc;
+} Rng;
+
+static u32 nextRandom(Rng *rng) {
+    u64 old = rng->state;
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    u32 xorshifted = ((old >> 18u) ^ old) >> 27u;
+    u32 rot = old >> 59u;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+static void seedRng(Rng *rng, u64 seed) {
+    rng->state = 0;
+    rng->inc = (seed << 1u) | 1u;
+    nextRandom(rng);
+    rng->state += seed;
+    nextRandom(rng);
+}
+
+// Bits from..to inclusive.
+static u64 bitSpan(int from, int to) {
+    return (~0ULL >> (63 - to)) & (~0ULL << from);
+}
+
+static int lowestBit(u64 bits) { return __builtin_ctzll(bits); }
+
 static bool collision(int x1, int y1, int w1, int h1, int x2, int y2, int w2,
                       int h2) {
     return (MAX(x1, x2) < MIN(x1 + w1, x2 + w2)) &&